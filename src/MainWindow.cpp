@@ -1319,6 +1319,7 @@ void MainWindow::transferOptions()
 				QMessageBox::critical(this, tr("Error"), e.what());
 			}
 			d->setUserSpeedLimits(wgt->m_nDownLimit*1024,wgt->m_nUpLimit*1024);
+			d->markDirty();
 			updateUi();
 			Queue::saveQueuesAsync();
 		}
@@ -55,7 +55,7 @@ bool MyApplication::notify(QObject* receiver, QEvent* e)
 
 void MyApplication::saveState(QSessionManager&)
 {
-	Queue::saveQueues();
+	Queue::saveQueues(true);
 }
 
 void MyApplication::reportException(QString text, QString type)
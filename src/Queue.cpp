@@ -28,13 +28,16 @@ respects for all of the code used other than "OpenSSL".
 #include "Queue.h"
 #include "QueueMgr.h"
 #include "Settings.h"
+#include "QueueStore.h"
 #include "engines/PlaceholderTransfer.h"
+#include "engines/LazyTransfer.h"
 #include <unistd.h>
 #include <QList>
 #include <QReadWriteLock>
 #include <QDir>
 #include <QFile>
 #include <QDomDocument>
+#include <QMutexLocker>
 #include <QtDebug>
 
 using namespace std;
@@ -43,10 +46,13 @@ QList<Queue*> g_queues;
 QReadWriteLock g_queuesLock(QReadWriteLock::Recursive);
 
 bool Queue::m_bLoaded = false;
+QueueStore* Queue::m_store = 0;
+QMutex Queue::m_saveMutex;
 
 Queue::Queue()
 	: m_nDownLimit(0), m_nUpLimit(0), m_nDownTransferLimit(1), m_nUpTransferLimit(1),
-	m_nDownAuto(0), m_nUpAuto(0), m_bUpAsDown(false), m_lock(QReadWriteLock::Recursive)
+	m_nDownAuto(0), m_nUpAuto(0), m_downBucket(TokenBucket::global(false)), m_upBucket(TokenBucket::global(true)),
+	m_bUpAsDown(false), m_lock(QReadWriteLock::Recursive)
 {
 	memset(&m_stats, 0, sizeof m_stats);
 	m_uuid = QUuid::createUuid();
@@ -64,6 +70,9 @@ void Queue::unloadQueues()
 {
 	qDebug() << "Queue::unloadQueues()";
 	qDeleteAll(g_queues);
+	
+	delete m_store;
+	m_store = 0;
 }
 
 void Queue::stopQueues()
@@ -89,10 +98,60 @@ void Queue::loadQueues()
 	QDomDocument doc;
 	QFile file;
 	QDir dir = QDir::home();
+	QList<QueueStore::StoredQueue> stored;
 	
 	dir.mkpath(".local/share/fatrat");
 	if(!dir.cd(".local/share/fatrat"))
 		return;
+	
+	m_store = new QueueStore(dir.absoluteFilePath("queues.log"));
+	if(m_store->load(stored))
+	{
+		g_queuesLock.lockForWrite();
+		qDeleteAll(g_queues);
+		g_queues.clear();
+		
+		qDebug() << "Loading queues from" << dir.absoluteFilePath("queues.log");
+		
+		foreach(const QueueStore::StoredQueue& sq, stored)
+		{
+			QDomDocument qdoc;
+			Queue* pQueue;
+			
+			if(!qdoc.setContent(sq.element) || !(pQueue = fromElement(qdoc.documentElement())))
+				continue;
+			
+			foreach(const QByteArray& element, sq.transfers)
+			{
+				// the inactive ones get their engine objects once they're needed
+				Transfer* d = LazyTransfer::create(element);
+				
+				if(d)
+				{
+					// just read from the log, there's nothing to write back
+					d->takeDirty();
+				}
+				else
+				{
+					// left dirty, so that a record saved without the summary gets one
+					QDomDocument tdoc;
+					if(!tdoc.setContent(element))
+						continue;
+					d = loadTransfer(tdoc.documentElement());
+				}
+				
+				pQueue->m_transfers << d;
+			}
+			
+			g_queues << pQueue;
+		}
+		
+		g_queuesLock.unlock();
+		m_bLoaded = true;
+		return;
+	}
+	
+	// no log yet, migrate queues.xml if there's one (it's kept as a backup)
 	file.setFileName(dir.absoluteFilePath("queues.xml"));
 	
 	QString errmsg;
@@ -106,33 +165,23 @@ void Queue::loadQueues()
 		Queue* q = new Queue;
 		q->setName(QObject::tr("Main queue"));
 		g_queues << q;
+		
+		m_bLoaded = true;
 	}
 	else
 	{
 		g_queuesLock.lockForWrite();
 		qDeleteAll(g_queues);
+		g_queues.clear();
 		
-		qDebug() << "Loading queues";
+		qDebug() << "Migrating queues from" << file.fileName();
 		
 		QDomElement n = doc.documentElement().firstChildElement("queue");
 		while(!n.isNull())
 		{
-			if(!n.hasAttribute("name"))
-				continue;
-			else
+			Queue* pQueue = fromElement(n);
+			if(pQueue)
 			{
-				Queue* pQueue = new Queue;
-				
-				pQueue->m_strName = n.attribute("name");
-				pQueue->m_nDownLimit = n.attribute("downlimit").toInt();
-				pQueue->m_nUpLimit = n.attribute("uplimit").toInt();
-				pQueue->m_nDownTransferLimit = n.attribute("dtranslimit").toInt();
-				pQueue->m_nUpTransferLimit = n.attribute("utranslimit").toInt();
-				pQueue->m_bUpAsDown = n.attribute("upasdown").toInt() != 0;
-				pQueue->m_uuid = QUuid( n.attribute("uuid", pQueue->m_uuid.toString()) );
-				pQueue->m_strDefaultDirectory = n.attribute("defaultdir", pQueue->m_strDefaultDirectory);
-				pQueue->m_strMoveDirectory = n.attribute("movedir");
-				
 				pQueue->loadQueue(n);
 				g_queues << pQueue;
 			}
@@ -140,16 +189,35 @@ void Queue::loadQueues()
 		}
 		
 		g_queuesLock.unlock();
+		
+		// everything loaded is dirty, this writes the whole log
+		m_bLoaded = true;
+		saveQueues(true);
 	}
+}
 
-	m_bLoaded = true;
+Queue* Queue::fromElement(const QDomElement& n)
+{
+	if(!n.hasAttribute("name"))
+		return 0;
+	
+	Queue* pQueue = new Queue;
+	
+	pQueue->m_strName = n.attribute("name");
+	pQueue->setSpeedLimits(n.attribute("downlimit").toInt(), n.attribute("uplimit").toInt());
+	pQueue->m_nDownTransferLimit = n.attribute("dtranslimit").toInt();
+	pQueue->m_nUpTransferLimit = n.attribute("utranslimit").toInt();
+	pQueue->m_bUpAsDown = n.attribute("upasdown").toInt() != 0;
+	pQueue->m_uuid = QUuid( n.attribute("uuid", pQueue->m_uuid.toString()) );
+	pQueue->m_strDefaultDirectory = n.attribute("defaultdir", pQueue->m_strDefaultDirectory);
+	pQueue->m_strMoveDirectory = n.attribute("movedir");
+	
+	return pQueue;
 }
 
 void Queue::BackgroundSaver::run()
 {
 	Queue::saveQueues();
-	if (getSettingsValue("queue_synconwrite").toBool())
-		sync();
 }
 
 void Queue::saveQueuesAsync()
@@ -159,33 +227,22 @@ void Queue::saveQueuesAsync()
 	t->start();
 }
 
-void Queue::saveQueues()
+void Queue::saveQueues(bool sync)
 {
-	if (!m_bLoaded)
+	if (!m_bLoaded || !m_store)
 	{
 		qDebug() << "Not saving queues as they haven't been loaded yet.";
 		return;
 	}
-
-	QDomDocument doc;
-	QDomElement root;
-	QFile file;
-	QDir dir = QDir::home();
-	
-	if(!dir.cd(".local/share/fatrat"))
-		return;
-	file.setFileName(dir.filePath("queues.xml.new"));
 	
-	if(!file.open(QIODevice::WriteOnly))
-		return;
-	
-	root = doc.createElement("fatrat");
-	doc.appendChild(root);
+	QMutexLocker l(&m_saveMutex);
+	QStringList order;
 	
 	g_queuesLock.lockForRead();
 	
 	foreach(Queue* q, g_queues)
 	{
+		QDomDocument doc;
 		QDomElement elem = doc.createElement("queue");
 		elem.setAttribute("name",q->m_strName);
 		elem.setAttribute("downlimit",QString::number(q->m_nDownLimit));
@@ -196,23 +253,18 @@ void Queue::saveQueues()
 		elem.setAttribute("uuid",q->m_uuid.toString());
 		elem.setAttribute("defaultdir",q->m_strDefaultDirectory);
 		elem.setAttribute("movedir",q->m_strMoveDirectory);
+		doc.appendChild(elem);
 		
-		q->saveQueue(elem,doc);
-		root.appendChild(elem);
+		m_store->putQueue(q->uuid(), doc.toByteArray(-1), q->saveQueue());
+		order << q->uuid();
 	}
 	
 	g_queuesLock.unlock();
-	if (file.write(doc.toByteArray()) == -1 || !file.flush())
+	
+	m_store->putQueueList(order);
+	
+	if(!m_store->commit(sync || getSettingsValue("queue_synconwrite").toBool()))
 		Logger::global()->enterLogMessage(tr("Queue"), tr("Failed to write the queue file!"));
-	else {
-		file.close();
-
-		QByteArray path = (dir.path() + "/queues.xml.new").toUtf8();
-		QByteArray dpath = (dir.path() + "/queues.xml").toUtf8();
-		
-		qDebug() << "Saving queue to" << dpath;
-		rename(path.data(), dpath.data());
-	}
 }
 
 void Queue::loadQueue(const QDomNode& node)
@@ -220,59 +272,60 @@ void Queue::loadQueue(const QDomNode& node)
 	m_lock.lockForWrite();
 	
 	qDeleteAll(m_transfers);
+	m_transfers.clear();
 	
 	QDomElement n = node.firstChildElement("download");
 	while(!n.isNull())
 	{
-		QDomElement e = n.firstChildElement("param");
-		QMap<QString,QString> map;
-		Transfer* d;
-		
-		d = Transfer::createInstance(n.attribute("class"));
-		
-		if(d != 0)
-		{
-			/*while(!e.isNull())
-			{
-				if(e.hasAttribute("name"))
-					map[e.attribute("name")] = e.text();
-				
-				e = e.nextSiblingElement("param");
-			}
-			*/
-			d->load(n);
-			m_transfers << d;
-		}
-		else
-		{
-			qDebug() << "***ERROR*** Unable to createInstance " << n.attribute("class");
-
-			d = new PlaceholderTransfer(n.attribute("class"));
-			d->load(n);
-			m_transfers << d;
-		}
-		
+		m_transfers << loadTransfer(n);
 		n = n.nextSiblingElement("download");
 	}
 	
 	m_lock.unlock();
 }
 
-void Queue::saveQueue(QDomNode& node,QDomDocument& doc)
+Transfer* Queue::loadTransfer(const QDomElement& n)
+{
+	Transfer* d = Transfer::createInstance(n.attribute("class"));
+	
+	if(!d)
+	{
+		qDebug() << "***ERROR*** Unable to createInstance " << n.attribute("class");
+		d = new PlaceholderTransfer(n.attribute("class"));
+	}
+	
+	d->load(n);
+	return d;
+}
+
+QStringList Queue::saveQueue()
 {
+	QStringList uuids;
+	
 	lock();
 	
 	foreach(Transfer* d,m_transfers)
 	{
+		uuids << d->uuid();
+		
+		// running transfers change all the time, the others only when marked
+		if(!d->takeDirty() && !d->isActive())
+			continue;
+		
+		QDomDocument doc;
 		QDomElement elem = doc.createElement("download");
 		
 		d->save(doc, elem);
 		elem.setAttribute("class",d->myClass());
+		LazyTransfer::saveSummary(d, elem);
+		doc.appendChild(elem);
 		
-		node.appendChild(elem);
+		m_store->putTransfer(d->uuid(), doc.toByteArray(-1));
 	}
 	
 	unlock();
+	
+	return uuids;
 }
 
 int Queue::size()
@@ -294,6 +347,8 @@ void Queue::add(Transfer* d)
 	m_lock.lockForWrite();
 	m_transfers << d;
 	m_lock.unlock();
+	
+	d->queueChanged(this);
 }
 
 void Queue::add(QList<Transfer*> d)
@@ -301,6 +356,9 @@ void Queue::add(QList<Transfer*> d)
 	m_lock.lockForWrite();
 	m_transfers << d;
 	m_lock.unlock();
+	
+	foreach(Transfer* t, d)
+		t->queueChanged(this);
 }
 
 int Queue::moveDown(int n, bool nolock)
@@ -405,6 +463,14 @@ void Queue::removeWithData(int n, bool nolock)
 	d->deleteLater();
 }
 
+void Queue::setSpeedLimits(int down, int up)
+{
+	m_nDownLimit = down;
+	m_nUpLimit = up;
+	m_downBucket.setLimit(down);
+	m_upBucket.setLimit(up);
+}
+
 void Queue::setAutoLimits(int down, int up)
 {
 	m_nDownAuto = down;
@@ -412,7 +478,8 @@ void Queue::setAutoLimits(int down, int up)
 	
 	foreach(Transfer* d, m_transfers)
 	{
-		if(!d->isActive())
+		// those are held back by the queue's bucket already
+		if(!d->isActive() || d->isShaped())
 			continue;
 		d->setInternalSpeedLimits(down, up);
 	}
@@ -471,6 +538,22 @@ bool Queue::replace(Transfer* old, Transfer* _new)
 	return true;
 }
 
+bool Queue::tryReplace(Transfer* old, Transfer* _new)
+{
+	if(!m_lock.tryLockForWrite())
+		return false;
+	
+	int i = m_transfers.indexOf(old);
+	if (i != -1)
+	{
+		m_transfers[i] = _new;
+		old->deleteLater();
+	}
+	
+	m_lock.unlock();
+	return i != -1;
+}
+
 bool Queue::replace(Transfer* old, QList<Transfer*> _new)
 {
 	QWriteLocker l(&m_lock);
@@ -33,9 +33,13 @@ respects for all of the code used other than "OpenSSL".
 #include <QPair>
 #include <QUuid>
 #include <QThread>
+#include <QMutex>
+#include <QStringList>
 #include "Transfer.h"
+#include "util/TokenBucket.h"
 
 class Queue;
+class QueueStore;
 extern QList<Queue*> g_queues;
 extern QReadWriteLock g_queuesLock;
 
@@ -48,12 +52,16 @@ public:
 	
 	static void stopQueues();
 	static void loadQueues();
-	static void saveQueues();
+	// Writes what has changed since the last save, see QueueStore.
+	// With sync, the queue log is flushed to the disk before returning.
+	static void saveQueues(bool sync = false);
 	static void saveQueuesAsync();
 	static void unloadQueues();
 	
-	Q_INVOKABLE void setSpeedLimits(int down,int up) { m_nDownLimit=down; m_nUpLimit=up; }
+	Q_INVOKABLE void setSpeedLimits(int down,int up);
 	void speedLimits(int& down, int& up) const { down=m_nDownLimit; up=m_nUpLimit; }
+	// the shaper node of the queue, see TokenBucket
+	TokenBucket* bucket(bool upload) { return upload ? &m_upBucket : &m_downBucket; }
 	
 	Q_INVOKABLE void setTransferLimits(int down = -1,int up = -1) { m_nDownTransferLimit=down; m_nUpTransferLimit=up; }
 	void transferLimits(int& down,int& up) const { down=m_nDownTransferLimit; up=m_nUpTransferLimit; }
@@ -110,13 +118,19 @@ public:
 public slots:
 	bool replace(Transfer* old, Transfer* _new);
 	bool replace(Transfer* old, QList<Transfer*> _new);
+	// Like replace(), but gives up instead of waiting if the queue is locked
+	bool tryReplace(Transfer* old, Transfer* _new);
 private:
+	static Queue* fromElement(const QDomElement& n);
+	static Transfer* loadTransfer(const QDomElement& n);
 	void loadQueue(const QDomNode& node);
-	void saveQueue(QDomNode& node,QDomDocument& doc);
+	// Puts the dirty transfers into the store, returns the UUIDs of all of them
+	QStringList saveQueue();
 	
 	QString m_strName, m_strDefaultDirectory, m_strMoveDirectory;
 	int m_nDownLimit,m_nUpLimit,m_nDownTransferLimit,m_nUpTransferLimit;
 	int m_nDownAuto, m_nUpAuto;
+	TokenBucket m_downBucket, m_upBucket;
 	bool m_bUpAsDown;
 	QUuid m_uuid;
 	mutable QReadWriteLock m_lock;
@@ -142,6 +156,8 @@ protected:
 	};
 
 	static bool m_bLoaded;
+	static QueueStore* m_store;
+	static QMutex m_saveMutex;
 };
 
 #endif
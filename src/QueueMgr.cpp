@@ -38,6 +38,9 @@ extern QSettings* g_settings;
 
 QueueMgr* QueueMgr::m_instance = 0;
 
+// the waiting transfers get ready once an active one is expected to finish within this many seconds
+static const int WARM_UP_HORIZON = 10;
+
 QueueMgr::QueueMgr() : m_nCycle(0), m_down(0), m_up(0)
 {
 	m_instance = this;
@@ -57,23 +60,31 @@ void QueueMgr::doWork()
 	g_queuesLock.lockForRead();
 	
 	const bool autoremove = getSettingsValue("autoremove").toBool();
+	const int warmUpCount = getSettingsValue("warmup_transfers").toInt();
+	// the transfers next in line for a slot
+	QList<Transfer*> warmUp;
+	
+	TokenBucket::global(false)->setLimit(getSettingsValue("global_down_limit").toInt() * 1024);
+	TokenBucket::global(true)->setLimit(getSettingsValue("global_up_limit").toInt() * 1024);
 	
 	foreach(Queue* q,g_queues)
 	{
-		int lim_down,lim_up;
 		int down,up, active = 0;
+		// speeds of the transfers that enforce the queue limits themselves
+		int shapedDown = 0, shapedUp = 0;
 		
 		Queue::Stats stats;
 		
 		memset(&stats, 0, sizeof stats);
 		
-		q->transferLimits(lim_down,lim_up);
 		q->speedLimits(down,up);
 		q->updateGraph();
 		
 		q->lock();
 		
 		QList<int> stopList, resumeList;
+		// a slot is about to open
+		bool turnover = false;
 		
 		for(int i=0;i<q->m_transfers.size();i++)
 		{
@@ -93,24 +104,7 @@ void QueueMgr::doWork()
 			stats.down += downs;
 			stats.up += ups;
 			
-			if(state == Transfer::Waiting || state == Transfer::Active)
-			{
-				int* lim;
-				
-				if(mode == Transfer::Download || q->m_bUpAsDown)
-					lim = &lim_down;
-				else
-					lim = &lim_up;
-				
-				if(*lim != 0)
-				{
-					(*lim)--;
-					resumeList << i;
-				}
-				else
-					stopList << i;
-			}
-			else if(state == Transfer::Completed && autoremove)
+			if(state == Transfer::Completed && autoremove)
 			{
 				doMove(q, d);
 				q->remove(i--, true);
@@ -118,18 +112,37 @@ void QueueMgr::doWork()
 			
 			if(d->isActive())
 			{
+				qulonglong size = d->total(), done = d->done();
+				int speed = (mode == Transfer::Download) ? downs : ups;
+				
+				if(speed > 0 && size > done && (size - done) / speed < WARM_UP_HORIZON)
+					turnover = true;
+				
 				( (mode == Transfer::Download) ? stats.active_d : stats.active_u) ++;
-				active++;
+				if(d->isShaped())
+				{
+					shapedDown += downs;
+					shapedUp += ups;
+				}
+				else
+					active++;
 			}
 			else if(d->state() == Transfer::Waiting)
 				( (mode == Transfer::Download) ? stats.waiting_d : stats.waiting_u) ++;
 		}
 		
+		assignSlots(q, stopList, resumeList);
 		foreach(int x, stopList)
 			q->m_transfers[x]->setState(Transfer::Waiting);
 		foreach(int x, resumeList)
 			q->m_transfers[x]->setState(Transfer::Active);
 		
+		if(turnover)
+		{
+			for(int i=0;i<stopList.size() && i<warmUpCount;i++)
+				warmUp << q->m_transfers[stopList[i]];
+		}
+		
 		total[0] += stats.down;
 		total[1] += stats.up;
 		
@@ -140,13 +153,19 @@ void QueueMgr::doWork()
 			float avgd, avgu, supd, supu;
 			int curd, curu;
 			
+			// the other transfers get whatever the shaped ones leave unused
+			if(down)
+				down = qMax(down - shapedDown, 1024);
+			if(up)
+				up = qMax(up - shapedUp, 1024);
+			
 			q->autoLimits(curd, curu);
 			
 			if(!curd)
 				curd = down/active;
 			else if(down)
 			{
-				avgd = float(stats.down) / active;
+				avgd = float(stats.down - shapedDown) / active;
 				supd = float(down) / active;
 				curd += (supd-avgd)/active;
 			}
@@ -157,7 +176,7 @@ void QueueMgr::doWork()
 				curu = up/active;
 			else if(up)
 			{
-				avgu = float(stats.up) / active;
+				avgu = float(stats.up - shapedUp) / active;
 				supu = float(up) / active;
 				//qDebug() << "avgu:" << avgu << "supu:" << supu << "->" << (supu-avgu)/active;
 				curu += (supu-avgu)/active;
@@ -198,6 +217,10 @@ void QueueMgr::doWork()
 	
 	g_queuesLock.unlock();
 	
+	// transfers are only deleted by this thread
+	foreach(Transfer* t, warmUp)
+		t->warmUp();
+	
 	m_down = total[0];
 	m_up = total[1];
 	
@@ -209,6 +232,57 @@ void QueueMgr::doWork()
 	}
 }
 
+void QueueMgr::assignSlots(Queue* q, QList<int>& stopList, QList<int>& resumeList)
+{
+	int lim_down,lim_up;
+	
+	q->transferLimits(lim_down,lim_up);
+	
+	for(int i=0;i<q->m_transfers.size();i++)
+	{
+		Transfer* d = q->m_transfers[i];
+		Transfer::State state = d->state();
+		
+		if(state == Transfer::Waiting || state == Transfer::Active)
+		{
+			int* lim;
+			
+			if(d->mode() == Transfer::Download || q->m_bUpAsDown)
+				lim = &lim_down;
+			else
+				lim = &lim_up;
+			
+			if(*lim != 0)
+			{
+				(*lim)--;
+				resumeList << i;
+			}
+			else
+				stopList << i;
+		}
+	}
+}
+
+void QueueMgr::handOverSlots()
+{
+	g_queuesLock.lockForRead();
+	
+	foreach(Queue* q,g_queues)
+	{
+		QList<int> stopList, resumeList;
+		
+		q->lock();
+		assignSlots(q, stopList, resumeList);
+		foreach(int x, stopList)
+			q->m_transfers[x]->setState(Transfer::Waiting);
+		foreach(int x, resumeList)
+			q->m_transfers[x]->setState(Transfer::Active);
+		q->unlock();
+	}
+	
+	g_queuesLock.unlock();
+}
+
 void QueueMgr::doMove(Queue* q, Transfer* t)
 {
 	QString whereTo = q->moveDirectory();
@@ -218,6 +292,7 @@ void QueueMgr::doMove(Queue* q, Transfer* t)
 	try
 	{
 		t->setObject(whereTo);
+		t->markDirty();
 	}
 	catch(const RuntimeException& e)
 	{
@@ -225,9 +300,14 @@ void QueueMgr::doMove(Queue* q, Transfer* t)
 	}
 }
 
-void QueueMgr::transferStateChanged(Transfer* t, Transfer::State, Transfer::State now)
+void QueueMgr::transferStateChanged(Transfer* t, Transfer::State was, Transfer::State now)
 {
 	const bool autoremove = getSettingsValue("autoremove").toBool();
+	
+	// the freed slot is handed over right away, not on the next tick
+	if(was == Transfer::Active && (now == Transfer::Completed || now == Transfer::Failed))
+		QMetaObject::invokeMethod(this, "handOverSlots", Qt::QueuedConnection);
+
 	if(now == Transfer::Completed)
 	{
 		if(autoremove)
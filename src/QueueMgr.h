@@ -50,8 +50,13 @@ public:
 private:
 	void doMove(Queue* q, Transfer* t);
 	static Queue* findQueue(Transfer* t);
+	// Splits the waiting and active transfers of the locked queue into those within the limits
+	// of the queue and the rest
+	static void assignSlots(Queue* q, QList<int>& stopList, QList<int>& resumeList);
 public slots:
 	void doWork();
+	// Gives the free slots to the waiting transfers, without the rest of doWork()
+	void handOverSlots();
 	void transferStateChanged(Transfer*,Transfer::State,Transfer::State);
 	void transferModeChanged(Transfer*,Transfer::Mode,Transfer::Mode);
 private:
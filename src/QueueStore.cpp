@@ -0,0 +1,344 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "QueueStore.h"
+#include <QCryptographicHash>
+#include <QFileInfo>
+#include <QtDebug>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+
+// The log isn't compacted before it grows this big
+static const qint64 COMPACT_MIN = 4*1024*1024;
+// Roughly the size of a record header, not counting the key
+static const qint64 RECORD_OVERHEAD = 48;
+
+QueueStore::QueueStore(QString path)
+	: m_strPath(path), m_bListed(false), m_nLive(0)
+{
+}
+
+bool QueueStore::load(QList<StoredQueue>& queues)
+{
+	QFile file(m_strPath);
+	if(!file.open(QIODevice::ReadOnly))
+		return false;
+	
+	QByteArray data = file.readAll();
+	file.close();
+	
+	Log log;
+	parse(data, log);
+	
+	if(!openLog())
+		return false;
+	
+	if(log.valid < data.size())
+	{
+		// appending right after the last complete record keeps the rest readable
+		qDebug() << "Dropping the damaged tail of" << m_strPath << "at" << log.valid;
+		m_file.resize(log.valid);
+	}
+	
+	// nothing has ever been committed, migrate as if there was no log
+	if(!log.listed)
+		return false;
+	
+	m_bListed = true;
+	m_list = log.list;
+	account('L', "-", log.list);
+	
+	foreach(QByteArray quuid, log.list.split('\n'))
+	{
+		QString key = QString::fromLatin1(quuid);
+		QHash<QString, QByteArray>::const_iterator q = log.queues.constFind(key);
+		if(q == log.queues.constEnd())
+			continue;
+		
+		QList<QByteArray> lines = q.value().split('\n');
+		StoredQueue sq;
+		
+		m_queues[key] = q.value();
+		account('Q', key, q.value());
+		
+		sq.element = lines.takeFirst();
+		foreach(QByteArray tuuid, lines)
+		{
+			QString tkey = QString::fromLatin1(tuuid);
+			QHash<QString, QByteArray>::const_iterator t = log.transfers.constFind(tkey);
+			if(t == log.transfers.constEnd())
+				continue;
+			
+			account('T', tkey, t.value());
+			sq.transfers << t.value();
+		}
+		
+		queues << sq;
+	}
+	
+	return true;
+}
+
+void QueueStore::putTransfer(QString uuid, const QByteArray& element)
+{
+	put('T', uuid, element);
+}
+
+void QueueStore::putQueue(QString uuid, const QByteArray& element, const QStringList& transfers)
+{
+	QByteArray payload = element;
+	foreach(QString t, transfers)
+	{
+		payload += '\n';
+		payload += t.toLatin1();
+	}
+	
+	if(m_queues.value(uuid) == payload)
+		return;
+	
+	m_queues[uuid] = payload;
+	put('Q', uuid, payload);
+}
+
+void QueueStore::putQueueList(const QStringList& uuids)
+{
+	QByteArray payload = uuids.join("\n").toLatin1();
+	
+	if(m_bListed && payload == m_list)
+		return;
+	
+	// dropped queues go away with the next compaction
+	foreach(QString uuid, m_queues.keys())
+	{
+		if(!uuids.contains(uuid))
+			m_queues.remove(uuid);
+	}
+	
+	m_bListed = true;
+	m_list = payload;
+	put('L', "-", payload);
+}
+
+bool QueueStore::commit(bool sync)
+{
+	if(m_pending.isEmpty() && !sync)
+		return true;
+	if(!m_file.isOpen() && !openLog())
+		return false;
+	
+	if(!m_pending.isEmpty())
+	{
+		qint64 size = m_file.size();
+		
+		if(m_file.write(m_pending) != m_pending.size() || !m_file.flush())
+		{
+			qDebug() << "Failed to append to" << m_strPath << m_file.errorString();
+			// a torn record would hide everything appended after it
+			m_file.resize(size);
+			return false;
+		}
+		
+		m_pending.clear();
+	}
+	
+	if(sync && fdatasync(m_file.handle()) != 0)
+		return false;
+	
+	if(m_file.size() > COMPACT_MIN && m_file.size() > 2*m_nLive)
+		compact();
+	
+	return true;
+}
+
+void QueueStore::put(char type, QString key, const QByteArray& payload)
+{
+	account(type, key, payload);
+	record(m_pending, type, key, payload);
+}
+
+void QueueStore::account(char type, QString key, const QByteArray& payload)
+{
+	QString id = QChar(type) + key;
+	qint64 size = payload.size() + key.size() + RECORD_OVERHEAD;
+	
+	m_nLive += size - m_sizes.value(id);
+	m_sizes[id] = size;
+}
+
+void QueueStore::parse(const QByteArray& data, Log& log)
+{
+	int pos = 0;
+	
+	log.listed = false;
+	log.valid = 0;
+	
+	while(pos < data.size())
+	{
+		int eol = data.indexOf('\n', pos);
+		if(eol < 0)
+			break;
+		
+		QList<QByteArray> header = data.mid(pos, eol-pos).split(' ');
+		if(header.size() != 4 || header[0].size() != 1)
+			break;
+		
+		bool ok;
+		int length = header[2].toInt(&ok);
+		if(!ok || length < 0 || length > data.size() - eol - 2 || data[eol+1+length] != '\n')
+			break;
+		
+		QByteArray payload = data.mid(eol+1, length);
+		if(QCryptographicHash::hash(payload, QCryptographicHash::Md5).toHex() != header[3])
+			break;
+		
+		QString key = QString::fromLatin1(header[1]);
+		switch(header[0][0])
+		{
+			case 'T':
+				log.transfers[key] = payload;
+				break;
+			case 'Q':
+				log.queues[key] = payload;
+				break;
+			case 'L':
+				log.list = payload;
+				log.listed = true;
+				break;
+			default:
+				// written by a newer version, skip it
+				break;
+		}
+		
+		pos = eol + 1 + length + 1;
+		log.valid = pos;
+	}
+}
+
+void QueueStore::record(QByteArray& out, char type, QString key, const QByteArray& payload)
+{
+	out += type;
+	out += ' ';
+	out += key.toLatin1();
+	out += ' ';
+	out += QByteArray::number(payload.size());
+	out += ' ';
+	out += QCryptographicHash::hash(payload, QCryptographicHash::Md5).toHex();
+	out += '\n';
+	out += payload;
+	out += '\n';
+}
+
+bool QueueStore::openLog()
+{
+	m_file.close();
+	m_file.setFileName(m_strPath);
+	
+	if(!m_file.open(QIODevice::ReadWrite | QIODevice::Append))
+	{
+		qDebug() << "Failed to open" << m_strPath << m_file.errorString();
+		return false;
+	}
+	return true;
+}
+
+bool QueueStore::compact()
+{
+	QFile file(m_strPath);
+	Log log;
+	
+	if(!file.open(QIODevice::ReadOnly))
+		return false;
+	parse(file.readAll(), log);
+	file.close();
+	
+	QByteArray transfers, queues;
+	
+	m_sizes.clear();
+	m_nLive = 0;
+	
+	foreach(QByteArray quuid, log.list.split('\n'))
+	{
+		QString key = QString::fromLatin1(quuid);
+		QHash<QString, QByteArray>::const_iterator q = log.queues.constFind(key);
+		if(q == log.queues.constEnd())
+			continue;
+		
+		QList<QByteArray> lines = q.value().split('\n');
+		for(int i = 1; i < lines.size(); i++)
+		{
+			QString tkey = QString::fromLatin1(lines[i]);
+			QHash<QString, QByteArray>::const_iterator t = log.transfers.constFind(tkey);
+			if(t == log.transfers.constEnd())
+				continue;
+			
+			account('T', tkey, t.value());
+			record(transfers, 'T', tkey, t.value());
+		}
+		
+		account('Q', key, q.value());
+		record(queues, 'Q', key, q.value());
+	}
+	
+	// the transfers go first, a queue never refers to a transfer that isn't there yet
+	account('L', "-", log.list);
+	record(queues, 'L', "-", log.list);
+	transfers += queues;
+	
+	QString tmpPath = m_strPath + ".new";
+	QFile tmp(tmpPath);
+	
+	if(!tmp.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		return false;
+	if(tmp.write(transfers) != transfers.size() || !tmp.flush() || fdatasync(tmp.handle()) != 0)
+	{
+		tmp.close();
+		tmp.remove();
+		return false;
+	}
+	tmp.close();
+	
+	if(rename(QFile::encodeName(tmpPath).constData(), QFile::encodeName(m_strPath).constData()) != 0)
+		return false;
+	
+	syncDirectory(QFileInfo(m_strPath).absolutePath());
+	qDebug() << "Compacted" << m_strPath << "to" << transfers.size() << "bytes";
+	
+	return openLog();
+}
+
+bool QueueStore::syncDirectory(QString path)
+{
+	int fd = ::open(QFile::encodeName(path).constData(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	
+	bool ok = fsync(fd) == 0;
+	::close(fd);
+	
+	return ok;
+}
@@ -0,0 +1,96 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef QUEUESTORE_H
+#define QUEUESTORE_H
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QFile>
+
+// Append-only log of the queues and their transfers, a save only writes what has changed since the last one.
+// A record is a "<type> <key> <length> <md5>" header line followed by the payload and a newline.
+// 'T' records hold a transfer's <download> element and are keyed by its UUID,
+// 'Q' records hold a queue's <queue> element on the first line followed by the UUIDs of its transfers,
+// one per line, and the 'L' record lists the UUIDs of the queues. The last record with a key wins.
+// Loading stops at the first torn or damaged record, which is what an interrupted append leaves behind.
+// Once the dead records make up most of the log, it's compacted into a fresh one.
+class QueueStore
+{
+public:
+	struct StoredQueue
+	{
+		QByteArray element;
+		QList<QByteArray> transfers;
+	};
+	
+	QueueStore(QString path);
+	
+	// Reads the queues in their order, false if there's no log yet
+	bool load(QList<StoredQueue>& queues);
+	
+	void putTransfer(QString uuid, const QByteArray& element);
+	// Queues and the list are skipped if they haven't changed since they were last written
+	void putQueue(QString uuid, const QByteArray& element, const QStringList& transfers);
+	void putQueueList(const QStringList& uuids);
+	
+	// Appends the records put so far with a single write, they're kept for the next commit if it fails.
+	// With sync, the log is flushed to the disk before returning.
+	bool commit(bool sync);
+private:
+	struct Log
+	{
+		QHash<QString, QByteArray> transfers, queues;
+		QByteArray list;
+		bool listed;
+		qint64 valid;
+	};
+	
+	void put(char type, QString key, const QByteArray& payload);
+	// Updates the live size with the latest record of the key
+	void account(char type, QString key, const QByteArray& payload);
+	static void parse(const QByteArray& data, Log& log);
+	static void record(QByteArray& out, char type, QString key, const QByteArray& payload);
+	bool openLog();
+	bool compact();
+	static bool syncDirectory(QString path);
+private:
+	QString m_strPath;
+	QFile m_file;
+	QByteArray m_pending;
+	// the last written queue records and list, to skip unchanged ones
+	QHash<QString, QByteArray> m_queues;
+	QByteArray m_list;
+	bool m_bListed;
+	// the size of the latest record of each key, dead transfers are only dropped by compaction
+	QHash<QString, qint64> m_sizes;
+	qint64 m_nLive;
+};
+
+#endif
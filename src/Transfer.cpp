@@ -98,7 +98,7 @@ void addTransferClass(const EngineEntry& e, Transfer::Mode m)
 Transfer::Transfer(bool local)
 	: m_state(Paused), m_mode(Download), m_nDownLimit(0), m_nUpLimit(0),
 		  m_nDownLimitInt(0), m_nUpLimitInt(0), m_bLocal(local), m_bWorking(false),
-		  m_nTimeRunning(0), m_nRetryCount(0)
+		  m_nTimeRunning(0), m_nRetryCount(0), m_dirty(1)
 {
 	m_uuid = QUuid::createUuid();
 }
@@ -117,6 +117,7 @@ void Transfer::setUserSpeedLimits(int down,int up)
 	m_nDownLimitInt = m_nDownLimit = down;
 	m_nUpLimitInt = m_nUpLimit = up;
 	setSpeedLimits(down,up);
+	markDirty();
 }
 
 void Transfer::setInternalSpeedLimits(int down,int up)
@@ -305,6 +306,9 @@ void Transfer::setState(State newState)
 	if(!m_bLocal)
 		emit TransferNotifier::instance()->stateChanged(this, m_lastState, newState);
 	emit stateChanged(m_state, newState);
+	
+	// only now, the saver would write out what it was before the deactivation otherwise
+	markDirty();
 }
 
 qint64 Transfer::timeRunning() const
@@ -504,6 +508,7 @@ void Transfer::setAutoActionCommand(State state, QString command)
 {
 	if(state == Completed)
 		m_strCommandCompleted = command;
+	markDirty();
 }
 
 QString Transfer::stateString() const
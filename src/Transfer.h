@@ -33,6 +33,7 @@ respects for all of the code used other than "OpenSSL".
 #include <QDateTime>
 #include <QDomNode>
 #include <QUuid>
+#include <QAtomicInt>
 #include "Logger.h"
 
 struct EngineEntry;
@@ -102,6 +103,14 @@ public:
 	virtual void speeds(int& down, int& up) const = 0;
 	Q_INVOKABLE void setUserSpeedLimits(int down,int up);
 	void userSpeedLimits(int& down,int& up) const { down=m_nDownLimit; up=m_nUpLimit; }
+	// The queue limits are enforced by the engine itself (see TokenBucket),
+	// the automatic per-transfer limits of the queue don't apply
+	virtual bool isShaped() const { return false; }
+	// The transfer has been put into another queue, a shaped one moves under its limits
+	virtual void queueChanged(Queue*) { }
+	// The transfer is next in line to become active, the engine may get ready for it
+	// (e.g. open connections) to cut the start-up time
+	virtual void warmUp() { }
 	
 	// TRANSFER SIZE
 	Q_INVOKABLE virtual qulonglong total() const = 0;
@@ -123,7 +132,7 @@ public:
 	
 	// COMMENT
 	Q_INVOKABLE QString comment() const { return m_strComment; }
-	Q_INVOKABLE void setComment(QString text) { m_strComment = text; }
+	Q_INVOKABLE void setComment(QString text) { m_strComment = text; markDirty(); }
 	Q_PROPERTY(QString comment WRITE setComment READ comment)
 	
 	// AUTO ACTIONS
@@ -133,6 +142,10 @@ public:
 	Q_INVOKABLE QString uuid() const;
 	Q_PROPERTY(QString uuid READ uuid)
 	
+	// Has the transfer written with the next queue save even if it's inactive,
+	// call it after changing anything save() stores
+	void markDirty() { m_dirty.storeRelease(1); }
+	
 	// GENERIC UTILITY FUNCTIONS
 	static State string2state(QString s);
 	static QString state2string(State s);
@@ -179,6 +192,8 @@ protected:
 	Q_INVOKABLE void replaceItself(Transfer* newObject);
 	Q_INVOKABLE void replaceItself(Transfer::TransferList newObjects);
 	Queue* myQueue() const;
+	// Returns and clears the mark set by markDirty()
+	bool takeDirty() { return m_dirty.fetchAndStoreOrdered(0) != 0; }
 	
 	State m_state, m_lastState;
 	Mode m_mode;
@@ -195,9 +210,11 @@ protected:
 	
 	QQueue<QPair<int,int> > m_qSpeedData;
 	QUuid m_uuid;
+	QAtomicInt m_dirty;
 	
 	friend class QueueMgr;
 	friend class Queue;
+	friend class LazyTransfer;
 #ifdef WITH_JPLUGINS
 	friend class JPlugin;
 #endif
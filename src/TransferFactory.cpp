@@ -25,6 +25,8 @@ respects for all of the code used other than "OpenSSL".
 */
 
 #include "TransferFactory.h"
+#include "Queue.h"
+#include "engines/LazyTransfer.h"
 #include <QThread>
 #include <QMetaType>
 #include <QtDebug>
@@ -101,6 +103,35 @@ void TransferFactory::init(Transfer* t, QString source, QString target, RuntimeE
 	}
 }
 
+void TransferFactory::materialize(QString uuid)
+{
+	if (QThread::currentThread() != thread())
+		QMetaObject::invokeMethod(this, "materializeSlot", Qt::BlockingQueuedConnection, Q_ARG(QString, uuid));
+	else
+		materializeSlot(uuid);
+}
+
+void TransferFactory::materializeSlot(QString uuid)
+{
+	QReadLocker l(&g_queuesLock);
+	
+	foreach (Queue* q, g_queues)
+	{
+		q->lock();
+		for (int i = 0; i < q->size(); i++)
+		{
+			if (q->at(i)->uuid() != uuid)
+				continue;
+			
+			if (LazyTransfer* lazy = qobject_cast<LazyTransfer*>(q->at(i)))
+				lazy->materialize();
+			q->unlock();
+			return;
+		}
+		q->unlock();
+	}
+}
+
 TransferFactory::TransferFactory()
 {
 	qRegisterMetaType<bool*>("bool*");
@@ -45,6 +45,10 @@ public:
 
 	// Init a Transfer in the correct thread
 	void init(Transfer* t, QString source, QString target);
+	
+	// Create the engine object of a lazily loaded transfer in the correct thread (see LazyTransfer).
+	// No queue may be locked by the caller, the transfer is looked up under the locks.
+	void materialize(QString uuid);
 private:
 	TransferFactory();
 	TransferFactory(const TransferFactory &) {}
@@ -54,6 +58,7 @@ private slots:
 	void createInstance(QString clsName, Transfer** t);
 	void init(Transfer* t, QString source, QString target, RuntimeException* e, bool* eThrown);
 	void setStateSlot(Transfer* t, Transfer::State state);
+	void materializeSlot(QString uuid);
 private:
 	static TransferFactory* m_instance;
 };
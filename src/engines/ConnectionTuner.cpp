@@ -0,0 +1,139 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#include "ConnectionTuner.h"
+#include "Settings.h"
+#include <QVariant>
+#include <QtDebug>
+
+// how many samples a changed number of connections gets to show its effect
+static const int SETTLE_SAMPLES = 2;
+// how long a settled number of connections is kept before trying one more
+static const int STABLE_SAMPLES = 12;
+// how long a refusal keeps the number of connections down
+static const int CEILING_SAMPLES = 60;
+// the least relative gain that justifies another connection
+static const double MIN_GAIN = 0.1;
+
+ConnectionTuner::ConnectionTuner()
+	: m_nCeiling(0), m_nCeilingAge(0), m_nSettle(SETTLE_SAMPLES), m_nStable(0)
+{
+}
+
+void ConnectionTuner::reset(QString host)
+{
+	m_strHost = host;
+	m_speeds.clear();
+	m_nCeiling = 0;
+	m_nCeilingAge = 0;
+	m_nSettle = SETTLE_SAMPLES;
+	m_nStable = 0;
+}
+
+ConnectionTuner::Decision ConnectionTuner::sample(int speed, int connections)
+{
+	const int maximum = getSettingsValue("httpftp/autotune_max").toInt();
+	
+	if (connections <= 0)
+		return Keep;
+	
+	// the server may accept more connections by now
+	if (m_nCeiling && ++m_nCeilingAge >= CEILING_SAMPLES)
+		m_nCeiling = 0;
+	
+	if (m_nCeiling && connections > m_nCeiling)
+	{
+		m_nSettle = SETTLE_SAMPLES;
+		return Remove;
+	}
+	
+	if (m_nSettle > 0)
+	{
+		m_nSettle--;
+		return Keep;
+	}
+	
+	m_speeds[connections] = speed;
+	
+	if (m_speeds.contains(connections-1) && speed < m_speeds[connections-1] * (1+MIN_GAIN))
+	{
+		// the last connection hasn't helped
+		qDebug() << "ConnectionTuner:" << m_strHost << "plateaued at" << connections-1 << "connections";
+		remember(connections-1);
+		m_speeds.remove(connections);
+		m_nSettle = SETTLE_SAMPLES;
+		m_nStable = STABLE_SAMPLES;
+		return Remove;
+	}
+	
+	if (m_nStable > 0)
+	{
+		m_nStable--;
+		return Keep;
+	}
+	
+	if ((m_nCeiling && connections >= m_nCeiling) || (maximum > 0 && connections >= maximum))
+	{
+		remember(connections);
+		return Keep;
+	}
+	
+	// the conditions may have changed since the last try
+	m_speeds.remove(connections+1);
+	m_nSettle = SETTLE_SAMPLES;
+	return Add;
+}
+
+void ConnectionTuner::refused(QString host, int connections)
+{
+	if (host != m_strHost)
+		return;
+	
+	m_nCeiling = qMax(1, connections-1);
+	m_nCeilingAge = 0;
+	m_speeds.remove(connections);
+	remember(m_nCeiling);
+}
+
+void ConnectionTuner::remember(int connections)
+{
+	if (m_strHost.isEmpty())
+		return;
+	
+	QMap<QString,QVariant> counts = getSettingsValue("httpftp/tuned_connections").toMap();
+	if (counts.value(m_strHost).toInt() != connections)
+	{
+		counts[m_strHost] = connections;
+		setSettingsValue("httpftp/tuned_connections", counts);
+	}
+}
+
+int ConnectionTuner::rememberedCount(QString host)
+{
+	return getSettingsValue("httpftp/tuned_connections").toMap().value(host).toInt();
+}
@@ -0,0 +1,70 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef CONNECTIONTUNER_H
+#define CONNECTIONTUNER_H
+#include <QString>
+#include <QMap>
+
+// Hill climbing over the number of connections of a single download.
+// A connection is added as long as the aggregate speed keeps rising noticeably,
+// the last one is taken back once it stops paying off or the server refuses it.
+// The count that has worked best is remembered per host, it's only where the next download starts from.
+class ConnectionTuner
+{
+public:
+	ConnectionTuner();
+	
+	enum Decision { Keep, Add, Remove };
+	
+	// Starts tuning anew
+	void reset(QString host);
+	// To be called periodically with the aggregate speed and the current number of connections
+	Decision sample(int speed, int connections);
+	// The server has refused another connection, other hosts than the tuned one are ignored
+	void refused(QString host, int connections);
+	
+	// 0 if nothing is known about the host
+	static int rememberedCount(QString host);
+private:
+	void remember(int connections);
+	
+	QString m_strHost;
+	// the speed reached with a number of connections
+	QMap<int,int> m_speeds;
+	// no more connections than this are accepted by the server
+	int m_nCeiling;
+	// samples since the ceiling was hit, it's lifted after a while
+	int m_nCeilingAge;
+	// samples to skip while new connections get up to speed
+	int m_nSettle;
+	// samples left until trying another connection again
+	int m_nStable;
+};
+
+#endif
@@ -26,7 +26,7 @@ respects for all of the code used other than "OpenSSL".
 
 
 #include "config.h"
-#include "engines/CurlPollingMaster.h"
+#include "engines/CurlTransferGroup.h"
 #include "CurlDownload.h"
 #include "Settings.h"
 #include "RuntimeException.h"
@@ -35,16 +35,31 @@ respects for all of the code used other than "OpenSSL".
 #include "tools/HashDlg.h"
 #include "util/ExtendedAttributes.h"
 #include "CurlPoller.h"
+#include "DiskWriter.h"
+#include "ResumeJournal.h"
+#include "StreamingHash.h"
+#include "PieceHashes.h"
+#include "MirrorScores.h"
+#include "HostGovernor.h"
 #include "Auth.h"
 #include "HttpDetails.h"
+#include "VerifyThread.h"
+#ifdef WITH_WEBINTERFACE
+#	include "remote/XmlRpcService.h"
+#endif
 #include <errno.h>
 #include <cstring>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <fcntl.h>
+#include <unistd.h>
 #include <QMessageBox>
 #include <QMenu>
 #include <QColor>
+#include <QDialog>
+#include <QVBoxLayout>
+#include <QPlainTextEdit>
 #include <QtDebug>
 #include <iostream>
 #include <errno.h>
@@ -57,20 +72,38 @@ respects for all of the code used other than "OpenSSL".
 #	define O_LARGEFILE 0
 #endif
 
+// seconds between checks for slow connections
+static const int BALANCE_INTERVAL = 5;
+// how long a new connection has to get up to speed
+static const int SPEED_FLOOR_GRACE = 30;
+// segments expected to finish sooner than this aren't raced in the endgame
+static const int ENDGAME_MIN_TIME = 5;
+
+// seconds a warmed up connection is expected to stay open
+static const int WARM_UP_LIFETIME = 30;
+
+// checksum files looked for next to the URL, the best hash first
+static const char* const g_sidecars[][2] = { { ".sha256", "sha-256" }, { ".md5", "md5" } };
+
 static const QColor g_colors[] = { Qt::red, Qt::green, Qt::blue, Qt::cyan, Qt::magenta, Qt::yellow, Qt::darkRed,
 	Qt::darkGreen, Qt::darkBlue, Qt::darkCyan, Qt::darkMagenta, Qt::darkYellow };
 
 CurlDownload::CurlDownload()
-	: m_nTotal(0), m_nStart(0), m_bAutoName(false), m_segmentsLock(QReadWriteLock::Recursive), m_master(0), m_nameChanger(0)
+	: m_nTotal(0), m_nStart(0), m_nPreallocated(0), m_bAutoName(false), m_segmentsLock(QReadWriteLock::Recursive), m_master(0), m_journal(0), m_nameChanger(0), m_probe(0),
+	  m_trace(getSettingsValue("httpftp/trace_buffer").toInt() * 1024), m_hasher(0), m_sidecar(0), m_nSidecar(0), m_verifier(0), m_nPieceLength(0), m_pieces(0),
+	  m_warmGroup(0), m_warmClient(0), m_nWarmTime(0)
 {
 	m_errorBuffer[0] = 0;
 	connect(&m_timer, SIGNAL(timeout()), this, SLOT(updateSegmentProgress()));
+	connect(&m_timer, SIGNAL(timeout()), this, SLOT(checkPieces()));
+	connect(&m_balanceTimer, SIGNAL(timeout()), this, SLOT(balanceSegments()));
 }
 
 CurlDownload::~CurlDownload()
 {
 	if(isActive())
 		changeActive(false);
+	stopWarmUp(true);
 }
 
 void CurlDownload::init(QString uri, QString dest)
@@ -157,6 +190,9 @@ int CurlDownload::acceptable(QString uri, bool)
 void CurlDownload::globalInit()
 {
 	new CurlPoller;
+	DiskWriter::createInstance();
+	new MirrorScores;
+	new HostGovernor;
 
 	CurlPoller::setTransferTimeout(getSettingsValue("httpftp/timeout").toInt());
 	
@@ -166,12 +202,54 @@ void CurlDownload::globalInit()
 	si.lpfnCreate = HttpFtpSettings::create;
 	
 	addSettingsPage(si);
+
+#ifdef WITH_WEBINTERFACE
+	XmlRpcService::registerFunction("CurlDownload.getHostStats", getHostStats, QVector<QVariant::Type>());
+#endif
 }
 
 void CurlDownload::globalExit()
 {
 	delete CurlPoller::instance();
+	delete DiskWriter::instance();
+	delete MirrorScores::instance();
+	delete HostGovernor::instance();
+}
+
+#ifdef WITH_WEBINTERFACE
+QVariant CurlDownload::getHostStats(QList<QVariant>&)
+{
+	QVariantMap rv;
+	QHash<QString, CurlShare::HostStats> stats = CurlPoller::instance()->share()->hostStats();
+	QMap<QString,int> open = HostGovernor::instance()->connections();
+
+	for(QHash<QString, CurlShare::HostStats>::const_iterator it = stats.constBegin(); it != stats.constEnd(); it++)
+	{
+		QVariantMap host;
+
+		host["transfers"] = it->transfers;
+		host["connects"] = it->connects;
+		host["connections"] = open.value(it.key());
+		rv[it.key()] = host;
+	}
+
+	// the hosts with nothing finished yet
+	for(QMap<QString,int>::const_iterator it = open.constBegin(); it != open.constEnd(); it++)
+	{
+		if(rv.contains(it.key()))
+			continue;
+
+		QVariantMap host;
+
+		host["transfers"] = 0;
+		host["connects"] = 0;
+		host["connections"] = it.value();
+		rv[it.key()] = host;
+	}
+
+	return rv;
 }
+#endif
 
 void CurlDownload::setObject(QString target)
 {
@@ -182,6 +260,9 @@ void CurlDownload::setObject(QString target)
 			throw RuntimeException(tr("Cannot move the file."));
 			
 		m_dir = dirnew;
+		// the file may have been copied to another file system
+		m_nPreallocated = 0;
+		markDirty();
 	}
 }
 
@@ -224,31 +305,97 @@ void CurlDownload::changeActive(bool bActive)
 
 		m_nameChanger = 0;
 
+		if(m_nTotal && !preallocate(m_nTotal))
+		{
+			setState(Failed);
+			return;
+		}
+
 		QWriteLocker l(&m_segmentsLock);
 
-		simplifySegments(m_segments);
+		m_segments.mergeAll();
 
 		if(m_segments.size() == 1 && m_nTotal == d && d)
 		{
+			ResumeJournal::remove(uuid());
 			setState(Completed);
 			return;
 		}
 
-		m_master = new CurlPollingMaster;
-		CurlPoller::instance()->addTransfer(m_master);
-		m_master->setMaxDown(m_nDownLimitInt);
+		// a journal left behind while journaling was disabled would be outdated
+		if(getSettingsValue("httpftp/journal_interval").toInt() > 0)
+		{
+			m_journal = ResumeJournal::open(uuid(), m_segments.isEmpty());
+			
+			// load() prefers the journal over the queue, so it has to know the progress
+			// made before it existed (or while journaling was off) before anything is added to it
+			if(m_journal && !m_segments.isEmpty())
+			{
+				for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+				{
+					if(it->bytes)
+						m_journal->record(it->offset, it->bytes);
+				}
+				m_journal->commit();
+			}
+		}
+		else
+			ResumeJournal::remove(uuid());
+
+		// the warm-up request may still be running, its connection is cached once it's done
+		if(m_warmGroup)
+		{
+			m_master = m_warmGroup;
+			m_warmGroup = 0;
+			m_nWarmTime = 0;
+		}
+		else
+		{
+			m_master = new CurlTransferGroup;
+			m_master->setShapingQueue(myQueue());
+			CurlPoller::instance()->addTransfer(m_master);
+		}
+		CurlPoller::instance()->setTransferLimits(m_master, m_nDownLimitInt, 0);
 
 		qDebug() << "The limit is" << m_nDownLimitInt;
 
+		startHash();
+		startPieces();
+
 		fixActiveSegmentsList();
 
+		if (getSettingsValue("httpftp/autotune").toBool())
+		{
+			// start with what has worked best for the host last time
+			QString host = m_urls[0].url.host();
+			int count = ConnectionTuner::rememberedCount(host);
+
+			// the tuner's changes aren't saved, the user's list is restored once inactive
+			m_listUserSegments = m_listActiveSegments;
+			m_tuner.reset(host);
+			if (count > 0)
+			{
+				for (int i = 0; m_listActiveSegments.size() < count; i++)
+					m_listActiveSegments << m_listActiveSegments[i];
+				while (m_listActiveSegments.size() > count)
+					m_listActiveSegments.removeLast();
+			}
+		}
+
+		for(int i=0;i<m_listActiveSegments.size();i++)
+			m_listActiveSegments[i] = pickUrl(m_listActiveSegments[i]);
+
 		if (m_nTotal)
 		{
 			for(int i=0;i<m_listActiveSegments.size();i++)
 				startSegment(m_listActiveSegments[i]);
 		}
 		else
+		{
 			startSegment(m_listActiveSegments[0]);
+			if (m_listActiveSegments.size() > 1)
+				startProbe();
+		}
 
 		/*
 		// 1) find free spots
@@ -338,287 +485,811 @@ void CurlDownload::changeActive(bool bActive)
 
 		// 8) update the segment progress every 500 miliseconds
 		m_timer.start(500);
+		m_balanceTimer.start(BALANCE_INTERVAL*1000);
 	}
 	else if(m_master != 0)
 	{
 		updateSegmentProgress();
 
 		m_segmentsLock.lockForWrite();
-		for(int i=0;i<m_segments.size();i++)
+		stopProbe();
+		stopSidecar();
+		foreach(Racer r, m_racers)
+		{
+			r.client->stop();
+			CurlPoller::instance()->removeTransfer(r.client);
+		}
+		m_racers.clear();
+
+		for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
 		{
-			if(!m_segments[i].client)
+			if(!it->client)
 				continue;
-			m_master->removeTransfer(m_segments[i].client);
-			m_segments[i].client->stop();
-			//delete m_segments[i].client;
-			m_segments[i].client = 0;
-			m_segments[i].color = Qt::black;
+			it->client->stop();
+			CurlPoller::instance()->removeTransfer(it->client);
+			//delete it->client;
+			m_segments.setClient(it, (UrlClient*) 0);
+			it->color = Qt::black;
 		}
-		qDebug() << "Before final simplify segments:" << m_segments;
-		simplifySegments(m_segments);
-		qDebug() << "After final simplify segments:" << m_segments;
+		m_segments.mergeAll();
+		qDebug() << "Final segments:" << m_segments.serialize();
 		m_segmentsLock.unlock();
+
+		// the thread holds its own reference to the hash, it's left to finish on its own
+		if(m_verifier)
+		{
+			m_verifier->disconnect(this);
+			m_verifier = 0;
+		}
+		// the streams keep the journal open until their data is on the disk
+		if(m_journal)
+		{
+			m_journal->deref();
+			m_journal = 0;
+		}
+		if(m_hasher)
+		{
+			m_hasher->deref();
+			m_hasher = 0;
+		}
+		if(m_pieces)
+		{
+			m_pieces->deref();
+			m_pieces = 0;
+		}
+		m_writtenBy.clear();
+		// the segments waiting for a connection slot aren't needed anymore
+		HostGovernor::instance()->cancel(this);
+		stopWarmUp(true);
 		m_nameChanger = 0;
 		m_timer.stop();
+		m_balanceTimer.stop();
+		m_urlSpeeds.clear();
+		if(!m_listUserSegments.isEmpty())
+		{
+			m_listActiveSegments = m_listUserSegments;
+			m_listUserSegments.clear();
+		}
 
+		// deleted by the poller
 		CurlPoller::instance()->removeTransfer(m_master);
-		//delete m_master;
 		m_master = 0;
 	}
 }
 
-void CurlDownload::startSegment(Segment& seg, qlonglong bytes)
+bool CurlDownload::preallocate(qlonglong bytes)
 {
-	qDebug() << "CurlDownload::startSegment(): seg offset:" << seg.offset << "; bytes:" << bytes;
-
-	if (!bytes)
-		abort(); // this is a serious bug
+	if (bytes <= m_nPreallocated)
+		return true;
 
 	std::string spath = filePath().toStdString();
 	int file = open(spath.c_str(), O_CREAT|O_RDWR|O_LARGEFILE, 0666);
 	if(file < 0)
 	{
 		enterLogMessage(m_strMessage = strerror(errno));
-		setState(Failed);
-		return;
+		return false;
 	}
-	ExtendedAttributes::setAttribute(filePath(), ExtendedAttributes::ATTR_ORIGIN_URL, m_urls[0].url.toString().toUtf8());
 
-	seg.client = new UrlClient;
-	seg.client->setRange(seg.offset, (bytes > 0) ? seg.offset+bytes : -1);
-	seg.client->setSourceObject(m_urls[seg.urlIndex]);
-	seg.client->setTargetObject(file);
+	int err = EOPNOTSUPP;
+	qlonglong missing = 0;
+
+#ifdef HAVE_FALLOCATE
+	// The file size is kept, it still tells how far the download has got (see autoCreateSegment()).
+	// The blocks are reserved as a whole, so the segments don't fragment the file.
+	if (fallocate(file, FALLOC_FL_KEEP_SIZE, 0, bytes) == 0)
+		err = 0;
+	else
+		err = errno;
+#endif
 
-	connect(seg.client, SIGNAL(renameTo(QString)), this, SLOT(clientRenameTo(QString)));
-	connect(seg.client, SIGNAL(logMessage(QString)), this, SLOT(clientLogMessage(QString)));
-	connect(seg.client, SIGNAL(done(QString)), this, SLOT(clientDone(QString)));
-	connect(seg.client, SIGNAL(failure(QString)), this, SLOT(clientFailure(QString)));
-	connect(seg.client, SIGNAL(totalSizeKnown(qlonglong)), this, SLOT(clientTotalSizeKnown(qlonglong)));
-	connect(seg.client, SIGNAL(rangesUnsupported()), this, SLOT(clientRangesUnsupported()));
+	if (err == ENOSPC)
+	{
+		struct stat st;
+		if (fstat(file, &st) == 0)
+			missing = bytes - qlonglong(st.st_blocks) * 512;
+	}
+	else if (err != 0)
+	{
+		// The file system can't do it, the file stays sparse.
+		// Checking the free space at least avoids running out of it at the very end.
+		struct stat st;
+		struct statvfs vfs;
 
-	seg.client->setPollingMaster(m_master);
-	seg.client->start();
-	m_master->addTransfer(static_cast<CurlUser*>(seg.client));
-}
+		qDebug() << "CurlDownload::preallocate(): falling back to a sparse file:" << strerror(err);
 
-bool CurlDownload::Segment::operator<(const Segment& s2) const
-{
-	return this->offset < s2.offset;
+		err = 0;
+		if (fstat(file, &st) == 0 && fstatvfs(file, &vfs) == 0)
+		{
+			missing = bytes - qlonglong(st.st_blocks) * 512;
+			if (missing > qlonglong(vfs.f_bavail) * qlonglong(vfs.f_frsize))
+				err = ENOSPC;
+		}
+	}
+
+	close(file);
+
+	if (err != 0)
+	{
+		if (err == ENOSPC && missing > 0)
+			m_strMessage = tr("Not enough disk space, %1 more is needed").arg(formatSize(missing));
+		else
+			m_strMessage = strerror(err);
+		enterLogMessage(m_strMessage);
+		return false;
+	}
+
+	m_nPreallocated = bytes;
+	return true;
 }
 
-bool CurlDownload::FreeSegment::operator <(const FreeSegment& s2) const
+void CurlDownload::startHash()
 {
-	return this->bytes < s2.bytes;
+	if(!getSettingsValue("httpftp/verify_hash").toBool())
+		return;
+
+	if(m_strHash.isEmpty())
+	{
+		if(!m_sidecar && getSettingsValue("httpftp/hash_sidecars").toBool())
+			fetchSidecar();
+		return;
+	}
+
+	m_hasher = StreamingHash::create(m_strHash, filePath());
+	if(!m_hasher)
+	{
+		enterLogMessage(tr("The file cannot be verified against \"%1\"").arg(m_strHash));
+		return;
+	}
+
+	seedHash();
 }
 
-bool CurlDownload::FreeSegment::compareByOffset(const FreeSegment& s1, const FreeSegment& s2)
+void CurlDownload::seedHash()
 {
-	return s1.offset < s2.offset;
+	// what has been written so far is read back as the download goes on, the running
+	// connections feed the hash from now on; the writer holds it until none of the data
+	// is waiting in the write-behind queue anymore, nothing is waited for on this thread
+	m_hasher->hold();
+	DiskWriter::instance()->attachHash(filePath(), m_hasher);
+
+	m_segmentsLock.lockForRead();
+	for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+		m_hasher->present(it->offset, it->bytes);
+	m_segmentsLock.unlock();
+
+	m_hasher->release();
 }
 
-void CurlDownload::setTargetName(QString newFileName)
+void CurlDownload::fetchSidecar()
 {
-	if(m_strFile != newFileName)
+	const int count = sizeof(g_sidecars) / sizeof(g_sidecars[0]);
+
+	if(m_nSidecar < count && m_master && !m_urls.isEmpty())
 	{
-		m_dir.rename(m_strFile, newFileName);
-		m_strFile = newFileName;
+		QString scheme = m_urls[0].url.scheme().toLower();
+
+		// a POST request would be repeated for nothing
+		if((scheme != "http" && scheme != "https" && scheme != "ftp") || !m_urls[0].strPostData.isEmpty())
+			return;
+
+		// the same proxy, credentials, cookies etc. as the download itself
+		m_sidecarSource = m_urls[0];
+		m_sidecarSource.url.setPath(m_sidecarSource.url.path() + g_sidecars[m_nSidecar][0]);
+		m_sidecarSource.effective = QUrl();
+
+		m_sidecar = new UrlClient;
+		m_sidecar->setSourceObject(m_sidecarSource);
+		m_sidecar->setMemoryTarget(4096);
+		connect(m_sidecar, SIGNAL(done(QString)), this, SLOT(sidecarFetched(QString)));
+
+		m_sidecar->setTransferGroup(m_master);
+		m_sidecar->start();
+		CurlPoller::instance()->addTransfer(static_cast<CurlUser*>(m_sidecar));
 	}
 }
 
-void CurlDownload::speeds(int& down, int& up) const
+void CurlDownload::stopSidecar()
 {
-	down = up = 0;
-	if(m_master != 0)
-		m_master->speeds(down, up);
+	if(m_sidecar)
+	{
+		m_sidecar->stop();
+		CurlPoller::instance()->removeTransfer(m_sidecar);
+		m_sidecar = 0;
+	}
 }
 
-qulonglong CurlDownload::total() const
+void CurlDownload::sidecarFetched(QString error)
 {
-	return m_nTotal;
-}
+	if(sender() != m_sidecar)
+		return;
 
-qulonglong CurlDownload::done() const
-{
-	m_segmentsLock.lockForRead();
-	qlonglong total = 0;
+	QByteArray body = m_sidecar->body();
+	stopSidecar();
 
-	for(int i=0;i<m_segments.size();i++)
-		total += m_segments[i].bytes;
+	if(error.isNull())
+	{
+		// "<digest>  <file name>", as written by sha256sum and md5sum
+		QString content = QString::fromLatin1(body);
+		QString digest = content.section(QRegExp("\\s+"), 0, 0, QString::SectionSkipEmpty);
+		QString hash = QString("%1:%2").arg(g_sidecars[m_nSidecar][1]).arg(digest);
+		QCryptographicHash::Algorithm algorithm;
+		QByteArray normalized;
+
+		if(StreamingHash::parse(hash, algorithm, normalized))
+		{
+			m_strHash = hash;
+			enterLogMessage(tr("The file is going to be verified against %1").arg(m_sidecarSource.url.toString(QUrl::RemoveUserInfo)));
 
-	m_segmentsLock.unlock();
-	return total;
+			if(isActive() && m_master && !m_hasher && getSettingsValue("httpftp/verify_hash").toBool())
+			{
+				m_hasher = StreamingHash::create(m_strHash, filePath());
+				if(m_hasher)
+					seedHash();
+			}
+			return;
+		}
+	}
+
+	m_nSidecar++;
+	fetchSidecar();
 }
 
-void CurlDownload::load(const QDomNode& map)
+bool CurlDownload::verifyHash()
 {
-	m_dir = getXMLProperty(map, "dir");
-	m_nTotal = getXMLProperty(map, "knowntotal").toULongLong();
-	m_strFile = getXMLProperty(map, "filename");
-	m_bAutoName = getXMLProperty(map, "autoname").toInt() != 0;
+	if(!m_hasher)
+		return true;
 
-	QStringList activeSegments = getXMLProperty(map, "activesegments").split(',');
-	m_listActiveSegments.clear();
-	foreach(QString seg, activeSegments)
-		m_listActiveSegments << seg.toInt();
-	
-	QDomElement url = map.firstChildElement("url");
-	while(!url.isNull())
+	StreamingHash* hasher = m_hasher;
+	m_hasher = 0;
+
+	// the VerifyThread has hashed it all, this only takes the result
+	QByteArray digest = hasher->finish(done());
+	bool matches = hasher->matches();
+	QString algorithm = hasher->algorithmName();
+	hasher->deref();
+
+	if(digest.isEmpty())
 	{
-		UrlClient::UrlObject obj;
-		
-		obj.url = getXMLProperty(url, "address");
-		obj.strReferrer = getXMLProperty(url, "referrer");
-		obj.proxy = getXMLProperty(url, "proxy");
-		obj.ftpMode = (UrlClient::FtpMode) getXMLProperty(url, "ftpmode").toInt();
-		obj.strBindAddress = getXMLProperty(url, "bindip");
-		obj.effective = getXMLProperty(url, "effective");
-		
-		url = url.nextSiblingElement("url");
-		
-		m_urls << obj;
+		enterLogMessage(tr("The %1 hash could not be computed").arg(algorithm));
+		return true;
 	}
-
-	QDomElement segment, segments = map.firstChildElement("segments");
-	
-	m_segmentsLock.lockForWrite();
-	if(!segments.isNull())
-		segment = segments.firstChildElement("segment");
-	while(!segment.isNull())
+	if(matches)
 	{
-		Segment data;
-
-		data.offset = getXMLProperty(segment, "offset").toLongLong();
-		data.bytes = getXMLProperty(segment, "bytes").toLongLong();
-		//data.urlIndex = getXMLProperty(segment, "urlindex").toInt();
-		data.urlIndex = -1;
-		data.client = 0;
-
-		segment = segment.nextSiblingElement("segment");
-		m_segments << data;
+		enterLogMessage(tr("The %1 hash has been verified: %2").arg(algorithm).arg(QString::fromLatin1(digest)));
+		return true;
 	}
 
-	if(m_strFile.isEmpty())
-		generateName();
+	enterLogMessage(m_strMessage = tr("The %1 hash doesn't match, the file is corrupt").arg(algorithm));
+	setState(Failed);
 
-	autoCreateSegment();
+	// the file is downloaded again from scratch next time, the size would tell otherwise (see autoCreateSegment())
+	m_segmentsLock.lockForWrite();
+	m_segments.clear();
 	m_segmentsLock.unlock();
-	
-	Transfer::load(map);
+	ResumeJournal::remove(uuid());
+	if(::truncate(filePath().toStdString().c_str(), 0) != 0)
+		qDebug() << "CurlDownload::verifyHash(): truncate failed:" << strerror(errno);
+	m_nPreallocated = 0;
+	markDirty();
+
+	return false;
 }
 
-void CurlDownload::save(QDomDocument& doc, QDomNode& map) const
+void CurlDownload::warmUp()
 {
-	Transfer::save(doc, map);
-	
-	setXMLProperty(doc, map, "dir", m_dir.path());
-	setXMLProperty(doc, map, "knowntotal", QString::number(m_nTotal));
-	setXMLProperty(doc, map, "filename", m_strFile);
-	setXMLProperty(doc, map, "autoname", QString::number(m_bAutoName));
-	
-	for(int i=0;i<m_urls.size();i++)
-	{
-		QDomElement sub = doc.createElement("url");
-		//sub.setAttribute("id", QString::number(i));
-		const UrlClient::UrlObject& url = m_urls[i];
-		
-		setXMLProperty(doc, sub, "address", QString(url.url.toString()));
-		setXMLProperty(doc, sub, "effective", QString(url.effective.toEncoded()));
-		setXMLProperty(doc, sub, "referrer", url.strReferrer);
-		setXMLProperty(doc, sub, "proxy", url.proxy.toString());
-		setXMLProperty(doc, sub, "ftpmode", QString::number( (int) url.ftpMode ));
-		setXMLProperty(doc, sub, "bindip", url.strBindAddress);
-		
-		map.appendChild(sub);
-	}
+	// the server closes idle connections after a while, a stale one is opened again
+	if(m_warmGroup && CurlStat::monotonicMsecs() - m_nWarmTime < WARM_UP_LIFETIME*1000)
+		return;
+	stopWarmUp(true);
 
-	QDomElement subSegments = doc.createElement("segments");
+	if(isActive() || m_urls.isEmpty())
+		return;
 
-	m_segmentsLock.lockForRead();
-	for(int i=0;i<m_segments.size();i++)
-	{
-		QDomElement sub = doc.createElement("segment");
-		const Segment& s = m_segments[i];
+	int urlIndex = pickUrl(m_listActiveSegments.isEmpty() ? 0 : m_listActiveSegments[0]);
+	const UrlClient::UrlObject& obj = m_urls[urlIndex];
+	QString scheme = obj.url.scheme().toLower();
 
-		setXMLProperty(doc, sub, "offset", QString::number(s.offset));
-		setXMLProperty(doc, sub, "bytes", QString::number(s.bytes));
-		//setXMLProperty(doc, sub, "urlindex", QString::number(s.urlIndex));
+	// a POST request would be repeated for nothing
+	if((scheme != "http" && scheme != "https" && scheme != "ftp") || !obj.strPostData.isEmpty())
+		return;
+	if(!HostGovernor::instance()->tryAcquire(obj.url.host()))
+		return;
 
-		subSegments.appendChild(sub);
-	}
-	m_segmentsLock.unlock();
-	map.appendChild(subSegments);
+	qDebug() << "Warming up a connection to" << obj.url.host();
 
-	QString activeSegments;
-	foreach(int index, m_listActiveSegments)
-	{
-		if(!activeSegments.isEmpty())
-			activeSegments += ',';
-		activeSegments += QString::number(index);
-	}
-	setXMLProperty(doc, map, "activesegments", activeSegments);
+	m_warmGroup = new CurlTransferGroup;
+	m_warmGroup->setShapingQueue(myQueue());
+	CurlPoller::instance()->addTransfer(m_warmGroup);
+	m_nWarmTime = CurlStat::monotonicMsecs();
+
+	m_warmClient = new UrlClient;
+	m_warmClient->setSourceObject(m_urls[urlIndex]);
+	m_warmClient->setWarmUp(true);
+	m_warmClient->setHostSlot(obj.url.host());
+	connect(m_warmClient, SIGNAL(done(QString)), this, SLOT(warmUpDone(QString)));
+
+	m_warmClient->setTransferGroup(m_warmGroup);
+	m_warmClient->start();
+	CurlPoller::instance()->addTransfer(static_cast<CurlUser*>(m_warmClient));
 }
 
-void CurlDownload::autoCreateSegment()
+void CurlDownload::warmUpDone(QString error)
 {
-	QFileInfo fi(filePath());
-
-	if(!fi.exists())
-	{
-		m_segments.clear();
+	if(sender() != m_warmClient)
 		return;
-	}
 
-	if(m_segments.isEmpty())
-	{
-		Segment s;
+	if(!error.isNull())
+		qDebug() << "The warm-up request has failed:" << error;
 
-		s.offset = s.bytes = 0;
-		s.urlIndex = 0;
-		s.client = 0;
+	// the connection stays in the cache of the group's polling thread
+	stopWarmUp(false);
+}
 
-		s.bytes = fi.size();
-		if (s.bytes)
-			m_segments << s;
+void CurlDownload::stopWarmUp(bool dropGroup)
+{
+	if(m_warmClient)
+	{
+		m_warmClient->stop();
+		CurlPoller::instance()->removeTransfer(m_warmClient);
+		m_warmClient = 0;
 	}
-	else
+	if(m_warmGroup && dropGroup)
 	{
-		// check for segments beyond the EOF (truncated file)
-		qSort(m_segments);
-		for (int i=0;i<m_segments.size();i++)
-		{
-			Segment& s = m_segments[i];
-			if (s.offset >= fi.size())
-				m_segments.removeAt(i--);
-			else if (s.offset + s.bytes > fi.size())
-				s.bytes = fi.size() - s.offset;
-		}
+		// deleted by the poller
+		CurlPoller::instance()->removeTransfer(m_warmGroup);
+		m_warmGroup = 0;
 	}
 }
 
-void CurlDownload::updateSegmentProgress()
+void CurlDownload::setPieceHashes(QString algorithm, qlonglong length, QList<QByteArray> hashes)
 {
-	m_segmentsLock.lockForWrite();
-	for(int i=0;i<m_segments.size();i++)
+	m_strPieceAlgorithm = algorithm;
+	m_nPieceLength = length;
+	m_pieceHashes = hashes;
+	markDirty();
+}
+
+void CurlDownload::startPieces()
+{
+	if(!m_nPieceLength || m_pieceHashes.isEmpty() || !getSettingsValue("httpftp/verify_hash").toBool())
+		return;
+
+	m_pieces = PieceHashes::create(m_strPieceAlgorithm, m_nPieceLength, m_pieceHashes, filePath());
+	if(!m_pieces)
 	{
-		if(m_segments[i].client != 0)
-			m_segments[i].bytes = m_segments[i].client->progress();
+		enterLogMessage(tr("The piece hashes cannot be used"));
+		return;
 	}
-	simplifySegments(m_segments);
-	m_segmentsLock.unlock();
+
+	if(m_nTotal)
+		m_pieces->setTotal(m_nTotal);
+
+	// what the previous runs have written is verified as the download goes on
+	DiskWriter::instance()->sync(filePath());
+	for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+		m_pieces->present(it->offset, it->bytes);
 }
 
-void CurlDownload::fillContextMenu(QMenu& menu)
+int CurlDownload::urlWritten(qlonglong offset) const
 {
-	QAction* a;
-	
-	//a = menu.addAction(tr("Switch mirror"));
-	//connect(a, SIGNAL(triggered()), this, SLOT(switchMirror()));
-	
-	a = menu.addAction(tr("Compute hash..."));
-	connect(a, SIGNAL(triggered()), this, SLOT(computeHash()));
+	QMap<qlonglong, int>::const_iterator it = m_writtenBy.upperBound(offset);
+	if(it == m_writtenBy.constBegin())
+		return -1;
+	return (--it).value();
 }
 
-/*
+int CurlDownload::avoidUrl(int urlIndex)
+{
+	QString host = m_urls[urlIndex].url.host();
+	int best = -1;
+	double bestScore = 0;
+
+	for(int i=0;i<m_urls.size();i++)
+	{
+		QString other = m_urls[i].url.host();
+		if(other == host)
+			continue;
+
+		double score = MirrorScores::instance()->score(other);
+		if(best == -1 || score > bestScore)
+		{
+			best = i;
+			bestScore = score;
+		}
+	}
+
+	if(best == -1)
+		return urlIndex;
+
+	int slot = m_listActiveSegments.indexOf(urlIndex);
+	if(slot != -1)
+		m_listActiveSegments[slot] = best;
+	return best;
+}
+
+bool CurlDownload::checkPieces()
+{
+	if(!m_pieces || !isActive() || !m_master)
+		return false;
+
+	QList<int> corrupt = m_pieces->takeCorrupt();
+	if(corrupt.isEmpty())
+		return false;
+
+	QWriteLocker l(&m_segmentsLock);
+	// the URLs of the connections to be started instead of the stopped ones
+	QList<int> restart;
+	qlonglong firstCorrupt = -1;
+	int culprit = -1;
+
+	updateSegmentProgress();
+
+	foreach(int piece, corrupt)
+	{
+		qlonglong from = piece * m_nPieceLength;
+		qlonglong to = from + m_nPieceLength;
+
+		culprit = urlWritten(from);
+		if(culprit != -1)
+		{
+			MirrorScores::instance()->recordResult(m_urls[culprit].url.host(), true);
+			enterLogMessage(tr("Piece %1 from %2 is corrupt, downloading it again").arg(piece).arg(m_urls[culprit].url.host()));
+		}
+		else
+			enterLogMessage(tr("Piece %1 is corrupt, downloading it again").arg(piece));
+
+		if(firstCorrupt < 0 || from < firstCorrupt)
+			firstCorrupt = from;
+
+		// the connections that have written into the piece are moved elsewhere
+		for(Segments::iterator it = m_segments.begin(); it != m_segments.end();)
+		{
+			if(!it->client || it.key() >= to || it.key() + it->bytes <= from)
+			{
+				++it;
+				continue;
+			}
+
+			UrlClient* client = it->client;
+			restart << it->urlIndex;
+
+			releaseSegment(it);
+			stopRacer(client);
+			client->stop();
+			CurlPoller::instance()->removeTransfer(client);
+
+			// merged, start over
+			it = m_segments.begin();
+		}
+
+		m_segments.cut(from, to - from);
+	}
+
+	// a digest can't be rewound once it has got past the corrupt data,
+	// the VerifyThread hashes the whole file on completion instead
+	if(m_hasher && m_hasher->hashed() > firstCorrupt)
+	{
+		m_hasher->deref();
+		m_hasher = 0;
+	}
+
+	if(restart.isEmpty() && !m_segments.hasActive())
+		restart << ((culprit != -1) ? culprit : 0);
+
+	foreach(int urlIndex, restart)
+		startSegment(avoidUrl(urlIndex));
+
+	return true;
+}
+
+void CurlDownload::startSegment(Segment& seg, qlonglong bytes)
+{
+	qDebug() << "CurlDownload::startSegment(): seg offset:" << seg.offset << "; bytes:" << bytes;
+
+	seg.client = startClient(seg.urlIndex, seg.offset, bytes);
+	seg.started = time(0);
+}
+
+UrlClient* CurlDownload::startClient(int urlIndex, qlonglong offset, qlonglong bytes, UrlClient* raceWith)
+{
+	if (!bytes)
+		abort(); // this is a serious bug
+
+	std::string spath = filePath().toStdString();
+	int file = open(spath.c_str(), O_CREAT|O_RDWR|O_LARGEFILE, 0666);
+	if(file < 0)
+	{
+		enterLogMessage(m_strMessage = strerror(errno));
+		setState(Failed);
+		return 0;
+	}
+	ExtendedAttributes::setAttribute(filePath(), ExtendedAttributes::ATTR_ORIGIN_URL, m_urls[0].url.toString().toUtf8());
+
+	UrlClient* client = new UrlClient;
+	client->setRange(offset, (bytes > 0) ? offset+bytes : -1);
+	client->setSourceObject(m_urls[urlIndex]);
+	client->setTargetObject(file, m_journal, m_hasher, m_pieces);
+	m_writtenBy[offset] = urlIndex;
+	if (raceWith)
+		client->raceWith(raceWith);
+
+	connect(client, SIGNAL(renameTo(QString)), this, SLOT(clientRenameTo(QString)));
+	connect(client, SIGNAL(done(QString)), this, SLOT(clientDone(QString)));
+	connect(client, SIGNAL(failure(QString)), this, SLOT(clientFailure(QString)));
+	connect(client, SIGNAL(totalSizeKnown(qlonglong)), this, SLOT(clientTotalSizeKnown(qlonglong)));
+	connect(client, SIGNAL(rangesUnsupported()), this, SLOT(clientRangesUnsupported()));
+	connect(client, SIGNAL(rangesConfirmed(qlonglong)), this, SLOT(clientRangesConfirmed(qlonglong)));
+
+	client->setTransferGroup(m_master);
+	client->setTrace(&m_trace);
+	client->start();
+	CurlPoller::instance()->addTransfer(static_cast<CurlUser*>(client));
+	return client;
+}
+
+CurlDownload::FreeSegment CurlDownload::freeSegment(const Segments::Range& gap)
+{
+	FreeSegment fs(gap.offset, gap.bytes);
+	Segments::iterator prev = m_segments.preceding(gap.offset + gap.bytes);
+
+	if (prev != m_segments.end())
+		fs.affectedClient = prev->client;
+	return fs;
+}
+
+void CurlDownload::setTargetName(QString newFileName)
+{
+	if(m_strFile != newFileName)
+	{
+		m_dir.rename(m_strFile, newFileName);
+		m_strFile = newFileName;
+		markDirty();
+	}
+}
+
+void CurlDownload::speeds(int& down, int& up) const
+{
+	down = up = 0;
+	if(m_master != 0)
+		m_master->speeds(down, up);
+}
+
+qulonglong CurlDownload::total() const
+{
+	return m_nTotal;
+}
+
+qulonglong CurlDownload::done() const
+{
+	m_segmentsLock.lockForRead();
+	qlonglong total = m_segments.done();
+	m_segmentsLock.unlock();
+	return total;
+}
+
+void CurlDownload::load(const QDomNode& map)
+{
+	m_dir = getXMLProperty(map, "dir");
+	m_nTotal = getXMLProperty(map, "knowntotal").toULongLong();
+	m_strFile = getXMLProperty(map, "filename");
+	m_bAutoName = getXMLProperty(map, "autoname").toInt() != 0;
+	m_trace.setEnabled(getXMLProperty(map, "diagnostics").toInt() != 0);
+	m_strHash = getXMLProperty(map, "hash");
+	m_strPieceAlgorithm = getXMLProperty(map, "piecehash");
+	m_nPieceLength = getXMLProperty(map, "piecelength").toLongLong();
+	m_pieceHashes = getXMLProperty(map, "pieces").toLatin1().split(',');
+
+	QStringList activeSegments = getXMLProperty(map, "activesegments").split(',');
+	m_listActiveSegments.clear();
+	foreach(QString seg, activeSegments)
+		m_listActiveSegments << seg.toInt();
+	
+	QDomElement url = map.firstChildElement("url");
+	while(!url.isNull())
+	{
+		UrlClient::UrlObject obj;
+		
+		obj.url = getXMLProperty(url, "address");
+		obj.strReferrer = getXMLProperty(url, "referrer");
+		obj.proxy = getXMLProperty(url, "proxy");
+		obj.ftpMode = (UrlClient::FtpMode) getXMLProperty(url, "ftpmode").toInt();
+		obj.strBindAddress = getXMLProperty(url, "bindip");
+		obj.effective = getXMLProperty(url, "effective");
+		
+		url = url.nextSiblingElement("url");
+		
+		m_urls << obj;
+	}
+
+	m_segmentsLock.lockForWrite();
+	m_segments.setTotal(m_nTotal);
+
+	QList<ResumeJournal::Range> journal;
+	QDomElement ranges = map.firstChildElement("ranges");
+
+	// the queue may claim data that never made it to the disk, the journal only has what has been synced
+	if(ResumeJournal::read(getXMLProperty(map, "uuid"), journal))
+	{
+		foreach(ResumeJournal::Range r, journal)
+		{
+			Segment data;
+
+			data.offset = r.offset;
+			data.bytes = r.bytes;
+			data.urlIndex = -1;
+			data.client = 0;
+
+			m_segments.insert(data);
+		}
+	}
+	else if(!ranges.isNull())
+	{
+		foreach(Segments::Range r, Segments::deserialize(ranges.text()))
+		{
+			Segment data;
+
+			data.offset = r.offset;
+			data.bytes = r.bytes;
+			data.urlIndex = -1;
+			data.client = 0;
+
+			m_segments.insert(data);
+		}
+	}
+	else
+	{
+		// the format used by the older versions
+		QDomElement segment, segments = map.firstChildElement("segments");
+
+		if(!segments.isNull())
+			segment = segments.firstChildElement("segment");
+		while(!segment.isNull())
+		{
+			Segment data;
+
+			data.offset = getXMLProperty(segment, "offset").toLongLong();
+			data.bytes = getXMLProperty(segment, "bytes").toLongLong();
+			//data.urlIndex = getXMLProperty(segment, "urlindex").toInt();
+			data.urlIndex = -1;
+			data.client = 0;
+
+			segment = segment.nextSiblingElement("segment");
+			m_segments.insert(data);
+		}
+	}
+
+	if(m_strFile.isEmpty())
+		generateName();
+
+	autoCreateSegment();
+	m_segmentsLock.unlock();
+	
+	Transfer::load(map);
+}
+
+void CurlDownload::save(QDomDocument& doc, QDomNode& map) const
+{
+	Transfer::save(doc, map);
+	
+	setXMLProperty(doc, map, "dir", m_dir.path());
+	setXMLProperty(doc, map, "knowntotal", QString::number(m_nTotal));
+	setXMLProperty(doc, map, "filename", m_strFile);
+	setXMLProperty(doc, map, "autoname", QString::number(m_bAutoName));
+	setXMLProperty(doc, map, "diagnostics", QString::number(diagnostics()));
+	setXMLProperty(doc, map, "hash", m_strHash);
+	if(m_nPieceLength)
+	{
+		QStringList pieces;
+		foreach(QByteArray hash, m_pieceHashes)
+			pieces << QString::fromLatin1(hash);
+
+		setXMLProperty(doc, map, "piecehash", m_strPieceAlgorithm);
+		setXMLProperty(doc, map, "piecelength", QString::number(m_nPieceLength));
+		setXMLProperty(doc, map, "pieces", pieces.join(","));
+	}
+	
+	for(int i=0;i<m_urls.size();i++)
+	{
+		QDomElement sub = doc.createElement("url");
+		//sub.setAttribute("id", QString::number(i));
+		const UrlClient::UrlObject& url = m_urls[i];
+		
+		setXMLProperty(doc, sub, "address", QString(url.url.toString()));
+		setXMLProperty(doc, sub, "effective", QString(url.effective.toEncoded()));
+		setXMLProperty(doc, sub, "referrer", url.strReferrer);
+		setXMLProperty(doc, sub, "proxy", url.proxy.toString());
+		setXMLProperty(doc, sub, "ftpmode", QString::number( (int) url.ftpMode ));
+		setXMLProperty(doc, sub, "bindip", url.strBindAddress);
+		
+		map.appendChild(sub);
+	}
+
+	m_segmentsLock.lockForRead();
+	setXMLProperty(doc, map, "ranges", m_segments.serialize());
+	m_segmentsLock.unlock();
+
+	QString activeSegments;
+	foreach(int index, m_listUserSegments.isEmpty() ? m_listActiveSegments : m_listUserSegments)
+	{
+		if(!activeSegments.isEmpty())
+			activeSegments += ',';
+		activeSegments += QString::number(index);
+	}
+	setXMLProperty(doc, map, "activesegments", activeSegments);
+}
+
+void CurlDownload::autoCreateSegment()
+{
+	QFileInfo fi(filePath());
+
+	if(!fi.exists())
+	{
+		m_segments.clear();
+		return;
+	}
+
+	if(m_segments.isEmpty())
+	{
+		Segment s;
+
+		s.offset = s.bytes = 0;
+		s.urlIndex = 0;
+		s.client = 0;
+
+		s.bytes = fi.size();
+		if (s.bytes)
+			m_segments.insert(s);
+	}
+	else
+	{
+		// check for segments beyond the EOF (truncated file)
+		Segments::iterator it;
+
+		while (!m_segments.isEmpty())
+		{
+			it = m_segments.end();
+			if ((--it).key() < fi.size())
+				break;
+			m_segments.erase(it);
+		}
+
+		it = m_segments.preceding(fi.size());
+		if (it != m_segments.end() && it->offset + it->bytes > fi.size())
+			m_segments.setBytes(it, fi.size() - it->offset);
+	}
+}
+
+void CurlDownload::updateSegmentProgress()
+{
+	m_segmentsLock.lockForWrite();
+	for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+	{
+		if(it->client != 0)
+			m_segments.setBytes(it, segmentProgress(it));
+	}
+	m_segmentsLock.unlock();
+}
+
+void CurlDownload::fillContextMenu(QMenu& menu)
+{
+	QAction* a;
+	
+	//a = menu.addAction(tr("Switch mirror"));
+	//connect(a, SIGNAL(triggered()), this, SLOT(switchMirror()));
+	
+	a = menu.addAction(tr("Compute hash..."));
+	connect(a, SIGNAL(triggered()), this, SLOT(computeHash()));
+	
+	a = menu.addAction(tr("Protocol diagnostics"));
+	a->setCheckable(true);
+	a->setChecked(diagnostics());
+	connect(a, SIGNAL(toggled(bool)), this, SLOT(setDiagnostics(bool)));
+	
+	a = menu.addAction(tr("Show protocol trace..."));
+	connect(a, SIGNAL(triggered()), this, SLOT(showProtocolTrace()));
+}
+
+/*
 void CurlDownload::switchMirror()
 {
 	int prev,cur;
@@ -657,6 +1328,30 @@ void CurlDownload::computeHash()
 	dlg.exec();
 }
 
+void CurlDownload::setDiagnostics(bool on)
+{
+	m_trace.setEnabled(on);
+	markDirty();
+	enterLogMessage(on ? tr("Protocol diagnostics enabled for new connections") : tr("Protocol diagnostics disabled"));
+}
+
+void CurlDownload::showProtocolTrace()
+{
+	QDialog* dlg = new QDialog(getMainWindow());
+	QVBoxLayout* layout = new QVBoxLayout(dlg);
+	QPlainTextEdit* text = new QPlainTextEdit(dlg);
+	
+	text->setReadOnly(true);
+	text->setLineWrapMode(QPlainTextEdit::NoWrap);
+	text->setPlainText(protocolTrace());
+	layout->addWidget(text);
+	
+	dlg->setWindowTitle(tr("Protocol trace - %1").arg(name()));
+	dlg->setAttribute(Qt::WA_DeleteOnClose);
+	dlg->resize(700, 450);
+	dlg->show();
+}
+
 QString CurlDownload::filePath() const
 {
 	return m_dir.filePath(name());
@@ -665,7 +1360,7 @@ QString CurlDownload::filePath() const
 void CurlDownload::setSpeedLimits(int down, int)
 {
 	if(m_master != 0)
-		m_master->setMaxDown(down);
+		CurlPoller::instance()->setTransferLimits(m_master, down, 0);
 }
 
 
@@ -691,20 +1386,14 @@ QString CurlDownload::remoteURI() const
 }
 
 
-void CurlDownload::simplifySegments(QList<CurlDownload::Segment>& retval)
+void CurlDownload::releaseSegment(Segments::iterator it)
 {
-	qSort(retval);
-
-	for(int i=1;i<retval.size();i++)
-	{
-		qlonglong pos = retval[i-1].offset+retval[i-1].bytes;
-		if(retval[i].offset <= pos && !retval[i-1].client && !retval[i].client)
-		{
-			retval[i].bytes += retval[i].offset - retval[i-1].offset;
-			retval[i].offset = retval[i-1].offset;
-			retval.removeAt(--i);
-		}
-	}
+	if (it->client)
+		m_segments.setBytes(it, segmentProgress(it));
+	m_segments.setClient(it, (UrlClient*) 0);
+	it->urlIndex = -1;
+	it->color = Qt::black;
+	m_segments.merge(it);
 }
 
 void CurlDownload::fixActiveSegmentsList()
@@ -721,6 +1410,25 @@ void CurlDownload::fixActiveSegmentsList()
 		m_listActiveSegments << 0;
 }
 
+void CurlDownload::urlRemoved(int index)
+{
+	QList<int>* lists[] = { &m_listActiveSegments, &m_listUserSegments };
+	
+	markDirty();
+	
+	for (int l = 0; l < 2; l++)
+	{
+		for (int i = 0; i < lists[l]->size(); i++)
+		{
+			int& n = (*lists[l])[i];
+			if (n > index)
+				n--;
+			else if (n == index)
+				lists[l]->removeAt(i--);
+		}
+	}
+}
+
 void CurlDownload::clientRenameTo(QString name)
 {
 	UrlClient* client = static_cast<UrlClient*>(sender());
@@ -738,15 +1446,32 @@ void CurlDownload::clientRenameTo(QString name)
 		setTargetName(name);
 }
 
-void CurlDownload::clientLogMessage(QString msg)
+void CurlDownload::clientRangesConfirmed(qlonglong total)
 {
 	UrlClient* client = static_cast<UrlClient*>(sender());
-	enterLogMessage(QString("0x%1 - %2").arg(long(client), 0, 16).arg(msg));
+	MirrorScores::instance()->recordRanges(client->sourceObject()->url.host(), true);
+
+	// the other segments may be started right away
+	if (!m_nTotal && total > 0 && isActive() && m_master)
+		clientTotalSizeKnown(total);
 }
 
 void CurlDownload::clientTotalSizeKnown(qlonglong bytes)
 {
 	qDebug() << "CurlDownload::clientTotalSizeKnown()" << bytes << "segs:" << m_listActiveSegments.size();
+
+	if (!preallocate(bytes))
+	{
+		setState(Failed);
+		return;
+	}
+
+	m_segmentsLock.lockForWrite();
+	m_segments.setTotal(bytes);
+	m_segmentsLock.unlock();
+	if(m_pieces)
+		m_pieces->setTotal(bytes);
+
 	if (!m_nTotal && m_listActiveSegments.size() > 1)
 	{
 		qDebug() << "Starting aditional segments";
@@ -768,46 +1493,52 @@ void CurlDownload::clientRangesUnsupported()
 	//    segments
 
 	UrlClient* client = static_cast<UrlClient*>(sender());
+	MirrorScores::instance()->recordRanges(client->sourceObject()->url.host(), false);
+
+	if (client == m_probe)
+	{
+		// the first segment finds out on its own
+		stopProbe();
+		return;
+	}
 
 	m_segmentsLock.lockForWrite();
 	bool allfailed = true;
 	int urlIndex = 0;
 
-	// TODO: copy pasted from clientDone(), find a better way...
-	for(int i=0;i<m_segments.size();i++)
+	if (UrlClient* owner = racedClient(client))
 	{
-		if(m_segments[i].client == client)
-		{
-			m_segments[i].bytes = client->progress();
-			m_segments[i].client = 0;
-			urlIndex = m_segments[i].urlIndex;
-			m_segments[i].urlIndex = -1;
-			m_segments[i].color = Qt::black;
-		}
+		// just drop the racer, the segment keeps on going
+		urlIndex = m_racers[owner].urlIndex;
+		stopRacer(owner);
+		m_segmentsLock.unlock();
+		m_listActiveSegments.removeOne(urlIndex);
+		return;
 	}
 
-	simplifySegments(m_segments);
-
-	for(int i=0;i<m_segments.size();i++)
+	Segments::iterator it = m_segments.findClient(client);
+	if (it != m_segments.end())
 	{
-		if(m_segments[i].client != 0)
-		{
-			allfailed = false;
-			break;
-		}
+		urlIndex = it->urlIndex;
+		releaseSegment(it);
 	}
+	stopRacer(client);
+
+	allfailed = !m_segments.hasActive();
 
 	m_segmentsLock.unlock();
 
-	m_master->removeTransfer(client);
 	client->stop();
+	CurlPoller::instance()->removeTransfer(client);
 
 	if (allfailed)
 	{
 		if (m_segments.size() == 1)
 		{
 			// restart the download from 0
-			m_segments[0].bytes = 0;
+			m_segmentsLock.lockForWrite();
+			m_segments.setBytes(m_segments.begin(), 0);
+			m_segmentsLock.unlock();
 			startSegment(urlIndex);
 		}
 		else
@@ -834,7 +1565,20 @@ void CurlDownload::clientDone(QString error)
 		return;
 
 	UrlClient* client = static_cast<UrlClient*>(sender());
-	int urlIndex = 0;
+
+	recordClient(client, !error.isNull(), client == m_probe);
+
+	if (client == m_probe)
+	{
+		stopProbe();
+		return;
+	}
+
+	// the client of the segment, differs if the client is a racer
+	UrlClient* owner;
+	// the other side of the race
+	UrlClient* partner = 0;
+	int urlIndex = 0, partnerIndex = -1;
 
 	updateSegmentProgress();
 
@@ -842,46 +1586,88 @@ void CurlDownload::clientDone(QString error)
 
 	qDebug() << "---------- CurlDownload::clientDone():" << error << client;
 
-	for(int i=0;i<m_segments.size();i++)
+	owner = racedClient(client);
+	if (owner)
+	{
+		urlIndex = m_racers[owner].urlIndex;
+
+		if (!error.isNull())
+		{
+			// a failed racer changes nothing, the segment is still being downloaded
+			m_racers.remove(owner);
+			m_segmentsLock.unlock();
+
+			client->stop();
+			CurlPoller::instance()->removeTransfer(client);
+			m_listActiveSegments.removeOne(urlIndex);
+			return;
+		}
+
+		// the racer has won
+		partner = owner;
+	}
+	else
 	{
-		if(m_segments[i].client == client)
+		owner = client;
+		if (m_racers.contains(owner))
 		{
-			m_segments[i].bytes = client->progress();
-			m_segments[i].client = 0;
-			urlIndex = m_segments[i].urlIndex;
-			m_segments[i].urlIndex = -1;
-			m_segments[i].color = Qt::black;
+			partner = m_racers[owner].client;
+			partnerIndex = m_racers[owner].urlIndex;
 		}
 	}
 
-	simplifySegments(m_segments);
+	Segments::iterator it = m_segments.findClient(owner);
+	if (it != m_segments.end())
+	{
+		int down, up;
+
+		if (owner == client)
+			urlIndex = it->urlIndex;
+		else
+			partnerIndex = it->urlIndex;
+
+		client->speeds(down, up);
+		if (down > 0)
+			m_urlSpeeds[urlIndex] = down;
+		// the progress of both racers counts
+		releaseSegment(it);
+	}
+	m_racers.remove(owner);
 
 	m_segmentsLock.unlock();
 
-	m_master->removeTransfer(client);
 	client->stop();
+	CurlPoller::instance()->removeTransfer(client);
 	//client->deleteLater();
 
+	if (partner)
+	{
+		// the duplicate is cancelled, whatever it has written is the same data
+		partner->stop();
+		CurlPoller::instance()->removeTransfer(partner);
+	}
+
 	qulonglong d = done();
 	if( (d == total() && d) || (!total() && error.isNull()))
 	{
-		checkFileContents();
-		setState(Completed);
+		// the tail of the file may still be waiting in the write-behind queue and the hashes
+		// may have much of the file left to read back, none of it is waited for on this thread
+		if(!m_verifier)
+		{
+			// dropped by checkPieces()
+			if(!m_hasher && !m_strHash.isEmpty() && getSettingsValue("httpftp/verify_hash").toBool())
+				m_hasher = StreamingHash::create(m_strHash, filePath());
+
+			m_verifier = new VerifyThread(filePath(), d, m_hasher, m_pieces);
+			connect(m_verifier, SIGNAL(verified()), this, SLOT(verificationDone()));
+			connect(m_verifier, SIGNAL(finished()), m_verifier, SLOT(deleteLater()));
+			m_verifier->start(QThread::LowPriority);
+		}
 	}
 	else if(!error.isNull())
 	{
 		m_segmentsLock.lockForRead();
-		bool allfailed = true;
-
-		for(int i=0;i<m_segments.size();i++)
-		{
-			if(m_segments[i].client != 0)
-			{
-				allfailed = false;
-				break;
-			}
-		}
-
+		bool allfailed = !m_segments.hasActive();
 		m_segmentsLock.unlock();
 
 		if(allfailed)
@@ -894,31 +1680,55 @@ void CurlDownload::clientDone(QString error)
 			// TODO: show error
 			// TODO: Replace segment?
 			m_listActiveSegments.removeOne(urlIndex);
+
+			// with other connections still running, the server doesn't want one more
+			if (client->refused() && getSettingsValue("httpftp/autotune").toBool())
+				m_tuner.refused(client->sourceObject()->url.host(), m_listActiveSegments.size() + 1);
+			if (partnerIndex != -1)
+				startSegment(partnerIndex);
 		}
 	}
 	else
 	{
 		// The segment has been completed and the download is still incomplete
-		// We need to find another free spot or split an allocated one
-		//int down, up;
-		//speeds(down, up);
-
-		// Only if it has a meaning
-		if (total()-done()*2 >= (qlonglong) getSettingsValue("httpftp/minsegsize").toInt() || m_listActiveSegments.size() == 1)
-			startSegment(urlIndex);
-		else
-			m_listActiveSegments.removeOne(urlIndex);
+		// We need to find another free spot or steal a part of an allocated one,
+		// startSegment() drops the URL if nothing is worth it
+		startSegment(switchUrl(urlIndex));
+		if (partnerIndex != -1)
+			startSegment(switchUrl(partnerIndex));
 	}
 }
 
-void CurlDownload::startSegment(int urlIndex)
+void CurlDownload::verificationDone()
+{
+	if(sender() != m_verifier)
+		return;
+	m_verifier = 0;
+
+	if(!isActive() || !m_master)
+		return;
+
+	// the corrupt pieces may have been found by the timer in the meantime
+	if(checkPieces() || (total() && done() != total()))
+		return;
+	if(!verifyHash())
+		return;
+	if(m_journal)
+		m_journal->discard();
+	checkFileContents();
+	setState(Completed);
+}
+
+void CurlDownload::startSegment(int urlIndex, bool granted)
 {
+	// the slot is held by the new client, given back if none is started
+	QString host = m_urls[urlIndex].url.host();
+	if (!granted && !HostGovernor::instance()->acquire(host, this))
+		return;
+
 	QWriteLocker l(&m_segmentsLock);
 	qDebug() << "----------- CurlDownload::startSegment():" << urlIndex;
 
-	// 1) find free spots, prefer unallocated free spots
-	QList<FreeSegment> freeSegs, freeSegsUnallocated;
-	qlonglong lastEnd = 0;
 	Segment seg;
 	qlonglong bytes;
 
@@ -932,76 +1742,43 @@ void CurlDownload::startSegment(int urlIndex)
 	if (!m_nTotal)
 	{
 		bytes = -1;
-		seg.offset = (!m_segments.isEmpty()) ? m_segments[0].bytes : 0;
+		seg.offset = (!m_segments.isEmpty()) ? m_segments.begin()->bytes : 0;
 	}
 	// No priority mode for downloads with a single thread
 	else if (!getSettingsValue("httpftp/priority_mode", false).toBool() || m_listActiveSegments.isEmpty())
 	{
-		for(int i=0;i<m_segments.size();i++)
-		{
-			if (m_segments[i].offset > lastEnd)
-			{
-				FreeSegment fs(lastEnd, m_segments[i].offset-lastEnd);
-				if(i == 0 || !m_segments[i-1].client)
-					freeSegsUnallocated << fs;
-				else
-				{
-					fs.affectedClient = m_segments[i-1].client;
-					freeSegs << fs;
-				}
-			}
-			lastEnd = m_segments[i].offset + m_segments[i].bytes;
-		}
-		if (lastEnd < m_nTotal)
-		{
-			FreeSegment fs(lastEnd, m_nTotal - lastEnd);
-			if (!m_segments.isEmpty() && m_segments[m_segments.size()-1].client)
-			{
-				fs.affectedClient = m_segments[m_segments.size()-1].client;
-				freeSegs << fs;
-			}
-			else
-				freeSegsUnallocated << fs;
-		}
-
-		// 2) sort them
-		qSort(freeSegs.begin(), freeSegs.end());
-		qSort(freeSegsUnallocated.begin(), freeSegsUnallocated.end());
+		// 1) prefer free spots no active segment is heading into
+		Segments::Range unallocated = m_segments.findGap(false, false);
 
-		if (!freeSegsUnallocated.isEmpty())
+		if (unallocated.bytes)
 		{
-			// 3) use the smallest unallocated segment
-			seg.offset = freeSegsUnallocated[0].offset;
-			bytes = freeSegsUnallocated[0].bytes;
+			// 2) use the smallest unallocated segment
+			seg.offset = unallocated.offset;
+			bytes = unallocated.bytes;
 		}
-		else if(!freeSegs.isEmpty())
+		else
 		{
-			// 4) split the biggest free spot into halves
-			FreeSegment& fs = freeSegs[freeSegs.size()-1];
-			//int odd = fs.bytes % 2;
-			qlonglong half = fs.bytes / 2;
+			// 3) take over the tail of the slowest segment
+			FreeSegment fs = stealableRange(urlIndex);
 
-			if (half <= getSettingsValue("httpftp/minsegsize").toInt())
+			if (!fs.bytes)
 			{
-				// remove the desired urlIndex from the list of active URLs
-				m_listActiveSegments.removeOne(urlIndex);
+				// too little is left to be split, race the slowest segment instead
+				// or remove the desired urlIndex from the list of active URLs
+				if (!fs.affectedClient || !startRacer(urlIndex, host))
+				{
+					if (fs.affectedClient)
+						m_listActiveSegments.removeOne(urlIndex);
+					HostGovernor::instance()->release(host);
+				}
 				return;
 			}
 
-			// notify the active thread of the change
-			qlonglong from = fs.affectedClient->rangeFrom();
-			qlonglong to = fs.affectedClient->rangeTo();
-			if (to == -1)
-				to = m_nTotal;
-			fs.affectedClient->setRange(from, to = to - half);
+			// notify the active thread of the change, it stops once it gets there
+			fs.affectedClient->setRange(fs.affectedClient->rangeFrom(), fs.offset);
 
-			seg.offset = to;
-			bytes = half;
-		}
-		else
-		{
-			// This should never happen
-			return;
+			seg.offset = fs.offset;
+			bytes = fs.bytes;
 		}
 	}
 	else
@@ -1009,33 +1786,21 @@ void CurlDownload::startSegment(int urlIndex)
 		// Find the first free spot smaller than seglim
 		// Try not to create a new freeseg bigger than 5*seglim
 		const int seglim = getSettingsValue("httpftp/minsegsize").toInt();
+		QList<FreeSegment> freeSegs;
 
-		for(int i=0;i<m_segments.size();i++)
-		{
-			if (m_segments[i].offset > lastEnd)
-			{
-				FreeSegment fs(lastEnd, m_segments[i].offset-lastEnd);
-				if(i > 0 && m_segments[i-1].client)
-					fs.affectedClient = m_segments[i-1].client;
-				if (fs.bytes >= seglim || !fs.affectedClient)
-					freeSegs << fs;
-			}
-			lastEnd = m_segments[i].offset + m_segments[i].bytes;
-		}
-		if (lastEnd < m_nTotal)
+		// already ordered by offset
+		foreach (Segments::Range gap, m_segments.gaps())
 		{
-			FreeSegment fs(lastEnd, m_nTotal - lastEnd);
-			if (m_segments[m_segments.size()-1].client)
-				fs.affectedClient = m_segments[m_segments.size()-1].client;
-			qDebug() << "Lastseg affectedClient:" << fs.affectedClient;
+			FreeSegment fs = freeSegment(gap);
 			if (fs.bytes >= seglim || !fs.affectedClient)
 				freeSegs << fs;
 		}
 
 		if (freeSegs.isEmpty())
+		{
+			HostGovernor::instance()->release(host);
 			return; // This should never happen
-
-		qSort(freeSegs.begin(), freeSegs.end(), FreeSegment::compareByOffset);
+		}
 
 		// Take the first one
 		// If it's an allocated space, take it only if bytes >= seglim*5
@@ -1096,31 +1861,439 @@ void CurlDownload::startSegment(int urlIndex)
 	// start a new download thread
 	qDebug() << "Start new seg: " << seg.offset << seg.offset+bytes;
 	startSegment(seg, bytes);
-	m_segments << seg;
+	m_segments.insert(seg);
+
+	if (seg.client)
+		seg.client->setHostSlot(host);
+	else
+		HostGovernor::instance()->release(host);
 }
 
-void CurlDownload::stopSegment(int index, bool restarting)
+void CurlDownload::hostGranted(QString host)
+{
+	if (!HostGovernor::instance()->claim(this, host))
+		return;
+
+	// the URLs may have been edited or removed since the request, an active one is preferred
+	int urlIndex = -1;
+	foreach (int index, m_listActiveSegments)
+	{
+		if (index < m_urls.size() && m_urls[index].url.host() == host)
+		{
+			urlIndex = index;
+			break;
+		}
+	}
+	for (int i = 0; i < m_urls.size() && urlIndex == -1; i++)
+	{
+		if (m_urls[i].url.host() == host)
+			urlIndex = i;
+	}
+
+	if (!isActive() || !m_master || urlIndex == -1)
+	{
+		HostGovernor::instance()->release(host);
+		return;
+	}
+
+	startSegment(urlIndex, true);
+}
+
+CurlDownload::FreeSegment CurlDownload::stealableRange(int urlIndex)
 {
-	Segment& s = m_segments[index];
-	if (!s.client)
+	const qlonglong minsegsize = getSettingsValue("httpftp/minsegsize").toInt();
+	FreeSegment victim(0, 0);
+	double victimEta = -1;
+	int victimSpeed = 0;
+
+	for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+	{
+		// a raced segment must keep its range
+		if (!it->client || m_racers.contains(it->client))
+			continue;
+
+		qlonglong to = it->client->rangeTo();
+		if (to == -1)
+			to = m_nTotal;
+
+		int down, up;
+		it->client->speeds(down, up);
+
+		// a connection that hasn't received anything yet is as good as stalled
+		qlonglong remaining = to - it->offset - it->bytes;
+		double eta = double(remaining) / qMax(down, 1);
+
+		if (remaining > 0 && eta > victimEta)
+		{
+			victim = FreeSegment(it->offset + it->bytes, remaining);
+			victim.affectedClient = it->client;
+			victimEta = eta;
+			victimSpeed = down;
+		}
+	}
+
+	if (!victim.affectedClient)
+		return victim;
+
+	// the new connection is expected to be as fast as the URL has been so far
+	int speed = m_urlSpeeds.value(urlIndex);
+	qlonglong steal;
+
+	if (speed > 0 && victimSpeed > 0)
+		steal = qlonglong(double(victim.bytes) * speed / (speed + victimSpeed));
+	else
+		steal = victim.bytes / 2;
+
+	// the victim keeps on writing until it learns about its new range
+	steal = qMin(steal, victim.bytes - minsegsize);
+
+	if (steal <= minsegsize)
+	{
+		victim.bytes = 0;
+		return victim;
+	}
+
+	victim.offset += victim.bytes - steal;
+	victim.bytes = steal;
+	return victim;
+}
+
+void CurlDownload::balanceSegments()
+{
+	const int floor = getSettingsValue("httpftp/min_speed").toInt() * 1024;
+	const time_t now = time(0);
+	QList<UrlClient*> slow;
+	bool anyFast = false;
+	int active = 0;
+
+	if (!isActive() || !m_master)
+		return;
+
+	m_segmentsLock.lockForRead();
+	for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+	{
+		if (!it->client)
+			continue;
+
+		int down, up;
+		it->client->speeds(down, up);
+		active++;
+
+		if (down > 0)
+		{
+			m_urlSpeeds[it->urlIndex] = down;
+			MirrorScores::instance()->recordSpeed(m_urls[it->urlIndex].url.host(), down);
+		}
+
+		if (down >= floor)
+			anyFast = true;
+		else if (now - it->started >= SPEED_FLOOR_GRACE)
+			slow << it->client;
+	}
+	m_segmentsLock.unlock();
+
+	tuneConnections(active);
+
+	if (floor <= 0 || slow.isEmpty())
 		return;
+
+	// the speed limit makes every connection look slow
+	if (m_nDownLimitInt > 0 && m_nDownLimitInt / active < floor)
+		return;
+
+	foreach(UrlClient* client, slow)
+	{
+		int down, up;
+		client->speeds(down, up);
+
+		// if all of them are slow, it's the line that's slow, not the connections
+		if (anyFast || !down)
+			restartSegment(client);
+	}
+}
+
+void CurlDownload::restartSegment(UrlClient* client)
+{
+	QWriteLocker l(&m_segmentsLock);
+
 	updateSegmentProgress();
-	s.urlIndex = -1;
-	m_master->removeTransfer(s.client);
-	s.client->stop();
-	s.client = 0;
-	simplifySegments(m_segments);
 
-	bool hasActive = false;
-	for (int i=0;i<m_segments.size();i++)
+	Segments::iterator it = m_segments.findClient(client);
+	if (it == m_segments.end())
+		return;
+
+	int urlIndex = it->urlIndex;
+	qDebug() << "Restarting a slow segment at" << it->offset + it->bytes;
+
+	releaseSegment(it);
+	stopRacer(client);
+	client->stop();
+	CurlPoller::instance()->removeTransfer(client);
+
+	startSegment(urlIndex);
+}
+
+int CurlDownload::pickUrl(int fallback) const
+{
+	if (m_urls.size() < 2 || !getSettingsValue("httpftp/mirror_selection").toBool())
+		return fallback;
+
+	QList<QUrl> urls;
+	foreach(const UrlClient::UrlObject& obj, m_urls)
+		urls << obj.url;
+
+	return MirrorScores::instance()->pick(urls, fallback);
+}
+
+int CurlDownload::switchUrl(int urlIndex)
+{
+	int picked = pickUrl(urlIndex);
+	int slot = m_listActiveSegments.indexOf(urlIndex);
+
+	if (picked != urlIndex && slot != -1)
+	{
+		qDebug() << "Switching a connection from mirror" << urlIndex << "to" << picked;
+		m_listActiveSegments[slot] = picked;
+	}
+	return picked;
+}
+
+void CurlDownload::recordClient(UrlClient* client, bool failed, bool probe)
+{
+	MirrorScores* scores = MirrorScores::instance();
+	QString host = client->sourceObject()->url.host();
+	int down, up;
+
+	scores->recordResult(host, failed);
+	scores->recordLatency(host, client->firstByteTime());
+	HostGovernor::instance()->learnAddress(host, client->primaryAddress());
+
+	// a single byte says nothing about the speed
+	client->speeds(down, up);
+	if (!failed && !probe)
+		scores->recordSpeed(host, down);
+}
+
+void CurlDownload::startProbe()
+{
+	if (!getSettingsValue("httpftp/fast_start").toBool() || m_probe)
+		return;
+
+	int urlIndex = m_listActiveSegments[0];
+	if (!m_urls[urlIndex].url.scheme().startsWith("http"))
+		return;
+
+	Segments::iterator it = m_segments.begin();
+	while (it != m_segments.end() && !it->client)
+		it++;
+	if (it == m_segments.end())
+		return;
+
+	// not worth waiting for
+	QString host = m_urls[urlIndex].url.host();
+	if (!HostGovernor::instance()->tryAcquire(host))
+		return;
+
+	// the byte is written by whichever of the two gets it first
+	m_probe = startClient(urlIndex, it->client->rangeFrom(), 1, it->client);
+	if (m_probe)
+		m_probe->setHostSlot(host);
+	else
+		HostGovernor::instance()->release(host);
+}
+
+void CurlDownload::stopProbe()
+{
+	if (!m_probe)
+		return;
+
+	m_probe->stop();
+	CurlPoller::instance()->removeTransfer(m_probe);
+	m_probe = 0;
+}
+
+void CurlDownload::queueChanged(Queue* q)
+{
+	// the segments draw from their download's buckets
+	if (m_master)
+		m_master->setShapingQueue(q);
+	if (m_warmGroup)
+		m_warmGroup->setShapingQueue(q);
+}
+
+void CurlDownload::tuneConnections(int active)
+{
+	// not while racing for the last bytes
+	if (!getSettingsValue("httpftp/autotune").toBool() || !m_nTotal || !m_racers.isEmpty())
+		return;
+
+	int down, up;
+	speeds(down, up);
+
+	// more connections won't help against the speed limit
+	if (m_nDownLimitInt > 0 && down >= m_nDownLimitInt * 9 / 10)
+		return;
+
+	switch (m_tuner.sample(down, active))
 	{
-		if (m_segments[i].client)
+	case ConnectionTuner::Add:
+	{
+		int urlIndex = m_listActiveSegments.isEmpty() ? 0 : m_listActiveSegments[0];
+		int best = 0;
+
+		// the fastest mirror gets the new connection
+		for (QHash<int,int>::const_iterator it = m_urlSpeeds.constBegin(); it != m_urlSpeeds.constEnd(); it++)
 		{
-			hasActive = true;
+			if (it.value() > best && it.key() < m_urls.size())
+			{
+				best = it.value();
+				urlIndex = it.key();
+			}
+		}
+
+		urlIndex = pickUrl(urlIndex);
+		qDebug() << "Auto-tuning: adding a connection to" << active;
+		m_listActiveSegments << urlIndex;
+		startSegment(urlIndex);
+		break;
+	}
+	case ConnectionTuner::Remove:
+	{
+		if (active <= 1)
 			break;
+
+		QWriteLocker l(&m_segmentsLock);
+		int index = 0, slowest = -1, slowestSpeed = 0;
+
+		for (Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++, index++)
+		{
+			if (!it->client)
+				continue;
+
+			int down, up;
+			it->client->speeds(down, up);
+			if (slowest < 0 || down < slowestSpeed)
+			{
+				slowest = index;
+				slowestSpeed = down;
+			}
+		}
+
+		if (slowest >= 0)
+		{
+			qDebug() << "Auto-tuning: removing a connection from" << active;
+			m_listActiveSegments.removeOne(m_segments[slowest].urlIndex);
+			stopSegment(slowest);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+bool CurlDownload::startRacer(int urlIndex, QString slotHost)
+{
+	if (!getSettingsValue("httpftp/endgame").toBool())
+		return false;
+
+	Segments::iterator victim = m_segments.end();
+	double victimEta = 0;
+
+	for(Segments::iterator it = m_segments.begin(); it != m_segments.end(); it++)
+	{
+		if (!it->client || m_racers.contains(it->client))
+			continue;
+
+		qlonglong to = it->client->rangeTo();
+		if (to == -1)
+			to = m_nTotal;
+
+		int down, up;
+		it->client->speeds(down, up);
+
+		qlonglong remaining = to - it->offset - it->bytes;
+		double eta = double(remaining) / qMax(down, 1);
+
+		if (remaining > 0 && eta > victimEta)
+		{
+			victim = it;
+			victimEta = eta;
 		}
 	}
-	if (!hasActive && !restarting)
+
+	// a segment about to finish isn't worth another connection
+	if (victim == m_segments.end() || victimEta < ENDGAME_MIN_TIME)
+		return false;
+
+	qlonglong from = victim->offset + victim->bytes;
+	qlonglong to = victim->client->rangeTo();
+	if (to == -1)
+		to = m_nTotal;
+
+	qDebug() << "Endgame: racing the segment at" << victim->offset << "from" << from << "to" << to;
+
+	Racer racer;
+	racer.client = startClient(urlIndex, from, to - from, victim->client);
+	racer.urlIndex = urlIndex;
+
+	if (racer.client)
+	{
+		racer.client->setHostSlot(slotHost);
+		m_racers[victim->client] = racer;
+	}
+	else
+		HostGovernor::instance()->release(slotHost);
+	return true;
+}
+
+UrlClient* CurlDownload::racedClient(UrlClient* racer) const
+{
+	for(QHash<UrlClient*, Racer>::const_iterator it = m_racers.constBegin(); it != m_racers.constEnd(); it++)
+	{
+		if (it.value().client == racer)
+			return it.key();
+	}
+	return 0;
+}
+
+void CurlDownload::stopRacer(UrlClient* client)
+{
+	if (!m_racers.contains(client))
+		return;
+
+	UrlClient* racer = m_racers.take(client).client;
+	racer->stop();
+	CurlPoller::instance()->removeTransfer(racer);
+}
+
+qlonglong CurlDownload::segmentProgress(Segments::iterator it) const
+{
+	qlonglong progress = it->client->progress();
+
+	if (m_racers.contains(it->client))
+	{
+		const UrlClient* racer = m_racers[it->client].client;
+		progress = qMax(progress, racer->rangeFrom() + racer->progress() - it->offset);
+	}
+	return progress;
+}
+
+void CurlDownload::stopSegment(int index, bool restarting)
+{
+	Segments::iterator it = m_segments.begin();
+	it += index;
+	if (!it->client)
+		return;
+
+	UrlClient* client = it->client;
+	updateSegmentProgress();
+	releaseSegment(it);
+	stopRacer(client);
+	client->stop();
+	CurlPoller::instance()->removeTransfer(client);
+
+	if (!m_segments.hasActive() && !restarting)
 		setState(Paused);
 }
 
@@ -1129,9 +2302,9 @@ QColor CurlDownload::allocateSegmentColor()
 	for(size_t i=0;i<sizeof(g_colors)/sizeof(g_colors[0]);i++)
 	{
 		bool bFound = false;
-		for(int j=0;j<m_segments.size();j++)
+		for(Segments::const_iterator it = m_segments.begin(); it != m_segments.end(); it++)
 		{
-			if(m_segments[j].client && m_segments[j].color == g_colors[i])
+			if(it->client && it->color == g_colors[i])
 			{
 				bFound = true;
 				break;
@@ -30,14 +30,23 @@ respects for all of the code used other than "OpenSSL".
 #include <fatrat.h>
 #include "engines/CurlUser.h"
 #include "engines/UrlClient.h"
+#include "engines/SegmentMap.h"
+#include "engines/ConnectionTuner.h"
+#include "engines/ProtocolTrace.h"
 #include <QHash>
+#include <QMap>
 #include <QUuid>
 #include <QDir>
 #include <QUrl>
 #include <QTimer>
+#include <ctime>
 #include "StaticTransferMessage.h"
 
-class CurlPollingMaster;
+class CurlTransferGroup;
+class ResumeJournal;
+class StreamingHash;
+class PieceHashes;
+class VerifyThread;
 
 class CurlDownload : public StaticTransferMessage<Transfer>
 {
@@ -53,6 +62,9 @@ public:
 	virtual QString myClass() const { return "GeneralDownload"; }
 	virtual QString name() const;
 	virtual void speeds(int& down, int& up) const;
+	virtual bool isShaped() const { return true; }
+	virtual void queueChanged(Queue* q);
+	virtual void warmUp();
 	virtual qulonglong total() const;
 	virtual qulonglong done() const;
 	virtual void load(const QDomNode& map);
@@ -69,28 +81,74 @@ public:
 	virtual void fillContextMenu(QMenu& menu);
 	virtual QString remoteURI() const;
 	virtual QObject* createDetailsWidget(QWidget* w);
+	
+	// The hash the file is verified against on completion, as "<algorithm>:<hex digest>"
+	void setExpectedHash(QString hash) { m_strHash = hash; }
+	QString expectedHash() const { return m_strHash; }
+	// Hashes of the pieces the file is split into, each piece is verified as soon as it's written
+	void setPieceHashes(QString algorithm, qlonglong length, QList<QByteArray> hashes);
+	
+	Q_INVOKABLE bool diagnostics() const { return m_trace.isEnabled(); }
+	Q_INVOKABLE QString protocolTrace() const { return m_trace.format(); }
+public slots:
+	// Records the protocol lines of the connections started from now on
+	void setDiagnostics(bool on);
 protected:
 	QString filePath() const;
 private slots:
 	//void switchMirror();
 	void computeHash();
+	void showProtocolTrace();
 	void clientRenameTo(QString name);
-	void clientLogMessage(QString msg);
 	void clientDone(QString error);
 	void clientTotalSizeKnown(qlonglong bytes);
 	void clientFailure(QString err);
 	void clientRangesUnsupported();
+	void clientRangesConfirmed(qlonglong total);
 	void updateSegmentProgress();
+	// Restarts connections that have fallen below the speed floor
+	void balanceSegments();
+	void sidecarFetched(QString error);
+	// The completed file has been written and hashed by the VerifyThread
+	void verificationDone();
+	// Downloads the corrupt pieces again, returns true if there were any
+	bool checkPieces();
+	// A segment start has got its HostGovernor slot, it goes to any URL of the host
+	void hostGranted(QString host);
+	void warmUpDone(QString error);
 private:
 	void generateName();
 	void init2(QString uri, QString dest);
 	void setTargetName(QString newFileName);
 	void processHeaders();
 	void checkFileContents();
+	// Reserves the disk space for the whole file, fails early if there isn't enough of it
+	bool preallocate(qlonglong bytes);
+	// Starts hashing the file if its hash is known, looks for a sidecar file otherwise
+	void startHash();
+	// Gives the new hash what has been written so far and passes it to the running connections
+	void seedHash();
+	// Tries the next sidecar file next to the first URL
+	void fetchSidecar();
+	void stopSidecar();
+	// Returns false if the transfer has failed due to a mismatch
+	bool verifyHash();
+	void startPieces();
+	// Stops the warm-up request, the group is kept for changeActive() unless dropping it all
+	void stopWarmUp(bool dropGroup);
+	// The URL index the data at the offset has been downloaded from during this session, -1 if unknown
+	int urlWritten(qlonglong offset) const;
+	// The best scoring mirror on another host, takes over the active segment slot of the URL
+	int avoidUrl(int urlIndex);
 	
 	static int seek_function(int file, curl_off_t offset, int origin);
 	static size_t process_header(const char* ptr, size_t size, size_t nmemb, CurlDownload* This);
 	static int curl_debug_callback(CURL*, curl_infotype, char* text, size_t bytes, CurlDownload* This);
+#ifdef WITH_WEBINTERFACE
+	// XML-RPC: the connection statistics of every host, see CurlShare::hostStats()
+	// and HostGovernor::connections()
+	static QVariant getHostStats(QList<QVariant>& args);
+#endif
 protected:
 	// Represents a written segment, i.e. what's really been written to the on-disk file
 	struct Segment
@@ -104,8 +162,9 @@ protected:
 		// pointer to a UrlClient instance, if the segment is active
 		UrlClient* client;
 		QColor color;
+		// when the client has been started
+		time_t started;
 
-		bool operator<(const Segment& s2) const;
 		operator QString() const
 		{
 			return QString("(struct Segment): offset: %1; bytes: %2; urlIndex: %3").arg(offset).arg(bytes).arg(urlIndex);
@@ -119,22 +178,54 @@ protected:
 		qlonglong offset;
 		qlonglong bytes;
 		UrlClient* affectedClient;
-
-		bool operator<(const FreeSegment& s2) const;
-		static bool compareByOffset(const FreeSegment& s1, const FreeSegment& s2);
 	};
+	typedef SegmentMap<Segment> Segments;
 
 	void autoCreateSegment();
-	static void simplifySegments(QList<Segment>& in);
+	// Marks the segment as no longer active and merges it with its neighbours
+	void releaseSegment(Segments::iterator it);
+	FreeSegment freeSegment(const Segments::Range& gap);
+	// The tail of the segment that would take the longest to finish, split by the speeds so that
+	// both connections finish at once. Returns an empty FreeSegment if it's not worth it.
+	FreeSegment stealableRange(int urlIndex);
+	void restartSegment(UrlClient* client);
+	// Adds or removes a connection as the tuner sees fit
+	void tuneConnections(int active);
+	// The mirror for a new connection as per the mirror scores, the fallback if the selection is disabled
+	int pickUrl(int fallback) const;
+	// Moves the active segment slot of the URL to the mirror picked by pickUrl()
+	int switchUrl(int urlIndex);
+	// Feeds the mirror scores with what the finished client has seen
+	void recordClient(UrlClient* client, bool failed, bool probe);
+	// Endgame: races the segment that would take the longest to finish, returns false if it's not worth it.
+	// The racer takes over the HostGovernor slot.
+	bool startRacer(int urlIndex, QString slotHost);
+	// The segment whose client is being raced by the given one, 0 if it isn't a racer
+	UrlClient* racedClient(UrlClient* racer) const;
+	// Cancels the racer of a segment's client, if there is one
+	void stopRacer(UrlClient* client);
+	// Includes the progress of the racer
+	qlonglong segmentProgress(Segments::iterator it) const;
+	// Fast start: asks for the first byte alongside the first segment to learn the size and
+	// the support for ranges as soon as possible
+	void startProbe();
+	void stopProbe();
+	// Returns 0 on failure
+	UrlClient* startClient(int urlIndex, qlonglong offset, qlonglong bytes, UrlClient* raceWith = 0);
 	void fixActiveSegmentsList();
+	// Renumbers the lists of active segments once the URL at the index has been removed
+	void urlRemoved(int index);
 	QColor allocateSegmentColor();
 	void startSegment(Segment& seg, qlonglong bytes);
-	void startSegment(int urlIndex);
+	// Waits for a HostGovernor slot unless it's been granted already
+	void startSegment(int urlIndex, bool granted = false);
 	void stopSegment(int index, bool restarting = false);
 protected:
 	QDir m_dir;
 	long long m_nTotal;
 	mutable long long m_nStart;
+	// how much of the file has been reserved on the disk
+	long long m_nPreallocated;
 	
 	QString m_strFile;
 	bool m_bAutoName;
@@ -142,12 +233,49 @@ protected:
 	char m_errorBuffer[CURL_ERROR_SIZE];
 	
 	QList<UrlClient::UrlObject> m_urls;
-	QList<Segment> m_segments;
+	Segments m_segments;
 	mutable QReadWriteLock m_segmentsLock;
-	CurlPollingMaster* m_master;
-	QTimer m_timer;
+	CurlTransferGroup* m_master;
+	// open while the transfer is active
+	ResumeJournal* m_journal;
+	QTimer m_timer, m_balanceTimer;
 	UrlClient* m_nameChanger;
+	// the last known speed of every URL index
+	QHash<int,int> m_urlSpeeds;
+	struct Racer
+	{
+		UrlClient* client;
+		int urlIndex;
+	};
+	// racing clients keyed by the clients of the segments they race
+	QHash<UrlClient*, Racer> m_racers;
+	UrlClient* m_probe;
+	ConnectionTuner m_tuner;
+	ProtocolTrace m_trace;
 	QList<int> m_listActiveSegments;
+	// the segments configured by the user while the tuner changes the active ones
+	QList<int> m_listUserSegments;
+	// the expected hash and its streaming computation while active
+	QString m_strHash;
+	StreamingHash* m_hasher;
+	// looks for <url>.sha256 and <url>.md5 with the first URL's settings, once per session
+	UrlClient* m_sidecar;
+	UrlClient::UrlObject m_sidecarSource;
+	int m_nSidecar;
+	// finishes the checks once all the data has arrived
+	VerifyThread* m_verifier;
+	// piece hashes (hex) and their verification while active
+	QString m_strPieceAlgorithm;
+	qlonglong m_nPieceLength;
+	QList<QByteArray> m_pieceHashes;
+	PieceHashes* m_pieces;
+	// client start offset -> URL index
+	QMap<qlonglong, int> m_writtenBy;
+	// the group becomes m_master on activation, its polling thread has the connection cached
+	CurlTransferGroup* m_warmGroup;
+	UrlClient* m_warmClient;
+	// when the connection has been opened, monotonic msecs
+	qint64 m_nWarmTime;
 	
 	friend class HttpOptsWidget;
 	friend class HttpUrlOptsDlg;
@@ -26,356 +26,168 @@ respects for all of the code used other than "OpenSSL".
 
 
 #include "CurlPoller.h"
-#include "CurlPollingMaster.h"
+#include "CurlTransferGroup.h"
+#include "Settings.h"
 #include <QtDebug>
-#include <cassert>
 
 CurlPoller* CurlPoller::m_instance = 0;
 
 int CurlPoller::m_nTransferTimeout = 20;
 
+static const int MAX_AUTO_SHARDS = 4;
+
 CurlPoller::CurlPoller()
-	: m_bAbort(false), m_timeout(0), m_usersLock(QMutex::Recursive)
 {
-	m_curlTimeout = 0;
 	curl_global_init(CURL_GLOBAL_SSL);
-	m_curlm = curl_multi_init();
-	m_poller = Poller::createInstance(this);
+	m_share = new CurlShare;
 	
-	curl_multi_setopt(m_curlm, CURLMOPT_SOCKETFUNCTION, socket_callback);
-	curl_multi_setopt(m_curlm, CURLMOPT_SOCKETDATA, static_cast<CurlPoller*>(this));
+	int shards = getSettingsValue("httpftp/poller_threads").toInt();
+	if(shards <= 0)
+		shards = qMin(QThread::idealThreadCount(), MAX_AUTO_SHARDS);
+	if(shards <= 0)
+		shards = 1;
 	
-	if(!m_instance)
+	qDebug() << "CurlPoller: starting" << shards << "polling threads";
+	
+	for(int i=0;i<shards;i++)
 	{
-		m_instance = this;
-		start();
+		CurlPollerShard* shard = new CurlPollerShard(m_share);
+		m_shards << shard;
+		m_load[shard] = 0;
+		shard->start();
 	}
+	
+	if(!m_instance)
+		m_instance = this;
 }
 
 CurlPoller::~CurlPoller()
 {
-	m_bAbort = true;
-	
-	if(isRunning())
-		wait();
+	foreach(CurlPollerShard* shard, m_shards)
+		shard->stop();
+	qDeleteAll(m_shards);
+	m_shards.clear();
+	delete m_share;
 	
 	if (this == m_instance)
 		m_instance = 0;
-	curl_multi_cleanup(m_curlm);
 	curl_global_cleanup();
 }
 
-bool operator<(const timeval& t1, const timeval& t2)
-{
-	if(t1.tv_sec < t2.tv_sec)
-		return true;
-	else if(t1.tv_sec > t2.tv_sec)
-		return false;
-	else
-		return t1.tv_usec < t2.tv_usec;
-}
-
-
-void CurlPoller::pollingCycle(bool oneshot)
+CurlPollerShard* CurlPoller::pickShard()
 {
-	Poller::Event events[30];
-	int dummy;
-	timeval tvNow;
-	QList<CurlStat*> timedOut;
-
-	int numEvents = m_poller->wait(!oneshot ? m_timeout : 0, events, sizeof(events) / sizeof(events[0]));
-
-	m_usersLock.lock();
-	if(!numEvents)
-	{
-		curl_multi_socket_action(m_curlm, CURL_SOCKET_TIMEOUT, 0, &dummy);
-	}
-
-	for(int i=0;i<numEvents;i++)
-	{
-		int socket = events[i].socket;
-		if(!m_masters.contains(socket))
-		{
-			int mask = 0;
-
-			if(events[i].flags & Poller::PollerIn)
-				mask |= CURL_CSELECT_IN;
-			if(events[i].flags & Poller::PollerOut)
-				mask |= CURL_CSELECT_OUT;
-			if(events[i].flags & (Poller::PollerError | Poller::PollerHup))
-				mask |= CURL_CSELECT_ERR;
-
-			curl_multi_socket_action(m_curlm, socket, mask, &dummy);
-		}
-		else
-			m_masters[socket]->pollingCycle(true);
-	}
-
-	gettimeofday(&tvNow, 0);
-
-	if(m_curlTimeout <= 0 || m_curlTimeout > 500)
-		m_timeout = 500;
-	else
-		m_timeout = m_curlTimeout;
-
-	while (!m_queueToDelete.isEmpty())
-	{
-		CurlUser* c = m_queueToDelete.dequeue();
-		CURL* handle = c->curlHandle();
-
-		qDebug() << "Deleting a queued CURL object:" << c << handle;
-		assert(!m_users.contains(handle));
-
-		for(sockets_hash::iterator it = m_sockets.begin(); it != m_sockets.end(); it++)
-		{
-			if (it.value().second == c)
-				m_socketsToRemove << it.key();
-		}
-
-		curl_multi_remove_handle(m_curlm, handle);
-		curl_easy_cleanup(handle);
-		delete c;
-		assert(!m_queueToDelete.contains(c));
-	}
-
-	for(int i = 0; i < m_socketsToRemove.size(); i++)
-		m_sockets.remove(m_socketsToRemove[i]);
-	m_socketsToRemove.clear();
-
-	for(sockets_hash::iterator it = m_socketsToAdd.begin(); it != m_socketsToAdd.end(); it++)
-		m_sockets[it.key()] = it.value();
-	m_socketsToAdd.clear();
-
-	for(sockets_hash::iterator it = m_sockets.begin(); it != m_sockets.end(); it++)
-	{
-		int mask = 0;
-		int msec = -1;
-		CurlStat* user = it.value().second;
-
-		if(!user->idleCycle(tvNow))
-			timedOut << user;
-
-		if(user->hasNextReadTime())
-		{
-			if(user->nextReadTime() < tvNow)
-				mask |= CURL_CSELECT_IN;
-			timeval tv = user->nextReadTime();
-			msec = (tv.tv_sec-tvNow.tv_sec)*1000 + (tv.tv_usec-tvNow.tv_usec)/1000;
-		}
-		if(user->hasNextWriteTime())
-		{
-			if(user->nextWriteTime() < tvNow)
-				mask |= CURL_CSELECT_OUT;
-			int mmsec;
-			timeval tv = user->nextWriteTime();
-			mmsec = (tv.tv_sec-tvNow.tv_sec)*1000 + (tv.tv_usec-tvNow.tv_usec)/1000;
-
-			if(mmsec < msec || msec < 0)
-				msec = mmsec;
-		}
-
-		if(mask)
-			curl_multi_socket_action(m_curlm, it.key(), mask, &dummy);
-
-		int& flags = it.value().first;
-		if(msec > 0)
-		{
-			if(msec < m_timeout)
-				m_timeout = msec;
-			if (! (flags & Poller::PollerOneShot))
-			{
-				m_poller->removeSocket(it.key());
-				flags |= Poller::PollerOneShot;
-			}
-		}
-		else
-		{
-			if(user->performsLimiting())
-			{
-				flags |= Poller::PollerOneShot;
-			}
-			else if(flags & Poller::PollerOneShot)
-				flags ^= Poller::PollerOneShot;
-			else
-				continue;
-			m_poller->addSocket(it.key(), flags);
-		}
-	}
-
-	while(CURLMsg* msg = curl_multi_info_read(m_curlm, &dummy))
-	{
-		qDebug() << "CURL message:" << msg->msg;
-		if(msg->msg != CURLMSG_DONE)
-			continue;
-
-		CurlUser* user = m_users[msg->easy_handle];
-
-		if(user)
-			user->transferDone(msg->data.result);
-	}
-
-	foreach(CurlStat* stat, timedOut)
-	{
-		if(CurlUser* user = dynamic_cast<CurlUser*>(stat))
-			user->transferDone(CURLE_OPERATION_TIMEDOUT);
-	}
-
-	for(QMap<int, CurlPollingMaster*>::const_iterator it = m_masters.begin(); it != m_masters.end(); it++)
+	// the least loaded shard wins
+	CurlPollerShard* best = m_shards[0];
+	
+	for(int i=1;i<m_shards.size();i++)
 	{
-		CurlPoller* p = it.value();
-		p->checkErrors(tvNow);
+		if(m_load[m_shards[i]] < m_load[best])
+			best = m_shards[i];
 	}
-
-	m_usersLock.unlock();
+	
+	return best;
 }
 
-void CurlPoller::checkErrors(timeval tvNow)
+void CurlPoller::release(CurlPollerShard* shard)
 {
-	QMutexLocker l(&m_usersLock);
-	QList<CurlStat*> timedOut;
-	int dummy;
+	if(m_load[shard] > 0)
+		m_load[shard]--;
+}
 
-	for(sockets_hash::iterator it = m_sockets.begin(); it != m_sockets.end(); it++)
+void CurlPoller::addTransfer(CurlUser* obj)
+{
+	QMutexLocker locker(&m_lock);
+	
+	CurlPollerShard* shard = m_userShards.value(obj);
+	if(!shard)
 	{
-		CurlStat* user = it.value().second;
-
-		if(!user->idleCycle(tvNow))
-			timedOut << user;
-	}
-
-	while(CURLMsg* msg = curl_multi_info_read(m_curlm, &dummy))
-	{
-		qDebug() << "CURL message:" << msg->msg;
-		if(msg->msg != CURLMSG_DONE)
-			continue;
-
-		CurlUser* user = m_users[msg->easy_handle];
-
-		if(user)
-			user->transferDone(msg->data.result);
+		shard = m_groupShards.value(obj->segmentMaster());
+		if(!shard)
+			shard = pickShard();
+		m_load[shard]++;
+		m_userShards[obj] = shard;
 	}
+	shard->addTransfer(obj);
+}
 
-	foreach(CurlStat* stat, timedOut)
+void CurlPoller::removeTransfer(CurlUser* obj, bool nodeep)
+{
+	QMutexLocker locker(&m_lock);
+	
+	CurlPollerShard* shard = m_userShards.take(obj);
+	if(!shard)
 	{
-		if(CurlUser* user = dynamic_cast<CurlUser*>(stat))
-			user->transferDone(CURLE_OPERATION_TIMEDOUT);
+		qDebug() << "CurlPoller::removeTransfer - unknown transfer" << obj;
+		return;
 	}
+	
+	release(shard);
+	shard->removeTransfer(obj, nodeep);
 }
 
-void CurlPoller::run()
+void CurlPoller::addTransfer(CurlTransferGroup* obj)
 {
-	curl_multi_setopt(m_curlm, CURLMOPT_TIMERFUNCTION, timer_callback);
-	curl_multi_setopt(m_curlm, CURLMOPT_TIMERDATA, &m_curlTimeout);
-
-	while(!m_bAbort)
-		pollingCycle(false);
+	QMutexLocker locker(&m_lock);
+	
+	if(m_groupShards.contains(obj))
+		return;
+	
+	// the group itself doesn't add to the load, its transfers will
+	m_groupShards[obj] = pickShard();
 }
 
-void CurlPoller::epollEnable(int socket, int events)
+void CurlPoller::removeTransfer(CurlTransferGroup* obj)
 {
-	m_poller->addSocket(socket, events);
+	QMutexLocker locker(&m_lock);
+	
+	CurlPollerShard* shard = m_groupShards.take(obj);
+	if(!shard)
+		return;
+	
+	shard->removeTransfer(obj);
 }
 
-int CurlPoller::timer_callback(CURLM* multi, long newtimeout, long* timeout)
+void CurlPoller::pauseTransfer(CurlUser* obj, bool pause)
 {
-	*timeout = newtimeout;
-	return 0;
+	QMutexLocker locker(&m_lock);
+	
+	if(CurlPollerShard* shard = m_userShards.value(obj))
+		shard->pauseTransfer(obj, pause);
 }
 
-int CurlPoller::socket_callback(CURL* easy, curl_socket_t s, int action, CurlPoller* This, void* socketp)
+void CurlPoller::setTransferLimits(CurlTransferGroup* obj, int down, int up)
 {
-	int flags = Poller::PollerOneShot | Poller::PollerError | Poller::PollerHup;
-	
-	if(action == CURL_POLL_IN || action == CURL_POLL_INOUT)
-		flags |= Poller::PollerIn;
-	if(action == CURL_POLL_OUT || action == CURL_POLL_INOUT)
-		flags |= Poller::PollerOut;
+	QMutexLocker locker(&m_lock);
 	
-	if(action == CURL_POLL_REMOVE)
-	{
-		qDebug() << "CurlPoller::socket_callback - remove";
-		
-		This->m_socketsToRemove << s;
-		return This->m_poller->removeSocket(s);
-	}
-	else
-	{
-		qDebug() << "CurlPoller::socket_callback - add/mod" << s << flags;
-		
-		This->m_socketsToAdd[s] = QPair<int,CurlStat*>(flags, static_cast<CurlStat*>(This->m_users[easy]));
-		
-		return This->m_poller->addSocket(s, flags);
-	}
+	if(CurlPollerShard* shard = m_groupShards.value(obj))
+		shard->setTransferLimits(obj, down, up);
 }
 
-void CurlPoller::addTransfer(CurlUser* obj)
+int CurlPoller::transferCount() const
 {
-	QMutexLocker locker(&m_usersLock);
-	
-	CURL* handle = obj->curlHandle();
-	qDebug() << "CurlPoller::addTransfer" << obj << handle;
+	QMutexLocker locker(&m_lock);
+	int count = 0;
 	
-	obj->resetStatistics();
-	m_users[handle] = obj;
-	curl_multi_add_handle(m_curlm, handle);
+	foreach(CurlPollerShard* shard, m_shards)
+		count += shard->transferCount();
+	return count;
 }
 
-void CurlPoller::removeTransfer(CurlUser* obj, bool nodeep)
+void CurlPoller::speeds(int& down, int& up) const
 {
-	QMutexLocker locker(&m_usersLock);
-	
-	qDebug() << "CurlPoller::removeTransfer" << obj << obj->curlHandle();
+	QMutexLocker locker(&m_lock);
 	
-	CURL* handle = obj->curlHandle();
-	if(handle != 0)
+	down = up = 0;
+	foreach(CurlPollerShard* shard, m_shards)
 	{
-		if (!nodeep)
-		{
-			assert(!m_queueToDelete.contains(obj));
-			m_queueToDelete.enqueue(obj);
-			m_users.remove(handle);
-			assert(!m_users.contains(handle));
-		}
-		else
-		{
-			CurlUserShallow* s = new CurlUserShallow(handle);
-			m_queueToDelete.enqueue(s);
-			m_users.remove(handle);
-		}
+		int d, u;
+		shard->totalSpeeds(d, u);
+		down += d;
+		up += u;
 	}
 }
 
-/*void CurlPoller::removeSafely(CURL* curl)
-{
-	QMutexLocker locker(&m_usersLock);
-	m_queueToDelete.enqueue(curl);
-}*/
-
 void CurlPoller::setTransferTimeout(int timeout)
 {
 	m_nTransferTimeout = timeout;
 }
-
-void CurlPoller::addTransfer(CurlPollingMaster* obj)
-{
-	QMutexLocker locker(&m_usersLock);
-
-	int handle = obj->handle();
-	int mask = Poller::PollerError | Poller::PollerHup | Poller::PollerIn | Poller::PollerOut;
-
-	qDebug() << "Adding a polling master" << handle << obj;
-	m_masters[handle] = obj;
-	m_sockets[handle] = QPair<int,CurlStat*>(mask, obj);
-	m_poller->addSocket(handle, mask);
-}
-
-void CurlPoller::removeTransfer(CurlPollingMaster* obj)
-{
-	QMutexLocker locker(&m_usersLock);
-
-	int handle = obj->handle();
-	m_masters.remove(handle);
-	m_sockets.remove(handle);
-	m_poller->removeSocket(handle);
-}
-
@@ -27,18 +27,22 @@ respects for all of the code used other than "OpenSSL".
 
 #ifndef CURL_POLLER
 #define CURL_POLLER
-#include <QThread>
 #include <QMutex>
-#include <QMap>
 #include <QHash>
-#include <QQueue>
+#include <QList>
 #include <curl/curl.h>
 #include "engines/CurlUser.h"
-#include "poller/Poller.h"
+#include "engines/CurlPollerShard.h"
+#include "engines/CurlShare.h"
 
-class CurlPollingMaster;
+class CurlTransferGroup;
 
-class CurlPoller : public QThread
+// Distributes transfers across a pool of polling threads (shards).
+// Every transfer stays bound to the shard it has been added to until it's removed.
+// Transfers belonging to a group (see CurlUser::setSegmentMaster()) are always put
+// into the shard of their group.
+// None of the methods wait for the polling threads.
+class CurlPoller
 {
 public:
 	CurlPoller();
@@ -47,45 +51,37 @@ public:
 	void addTransfer(CurlUser* obj);
 	// will handle the underlying CURL* too
 	void removeTransfer(CurlUser* obj, bool nodeep = false);
-	//void removeSafely(CURL* curl);
-	void addTransfer(CurlPollingMaster* obj);
-	void removeTransfer(CurlPollingMaster* obj);
+	void addTransfer(CurlTransferGroup* obj);
+	// the group gets deleted after its transfers have been removed
+	void removeTransfer(CurlTransferGroup* obj);
+	void pauseTransfer(CurlUser* obj, bool pause);
+	void setTransferLimits(CurlTransferGroup* obj, int down, int up);
 	
-	void run();
-	void checkErrors(timeval tvNow);
+	int shardCount() const { return m_shards.size(); }
+	CurlShare* share() { return m_share; }
+	int transferCount() const;
+	void speeds(int& down, int& up) const;
 	
 	static CurlPoller* instance() { return m_instance; }
 protected:
-	void epollEnable(int socket, int events);
-	void pollingCycle(bool oneshot);
-	static int socket_callback(CURL* easy, curl_socket_t s, int action, CurlPoller* This, void* socketp);
-	static int timer_callback(CURLM* multi, long newtimeout, long* timeout);
+	CurlPollerShard* pickShard();
+	void release(CurlPollerShard* shard);
 	static void setTransferTimeout(int timeout);
 	static int getTransferTimeout() { return m_nTransferTimeout; }
 protected:
 	static CurlPoller* m_instance;
 	static int m_nTransferTimeout;
-
-	bool m_bAbort;
-	CURLM* m_curlm;
-	Poller* m_poller;
-	int m_curlTimeout;
-	long m_timeout;
-	
-	typedef QMap<int, QPair<int,CurlStat*> > sockets_hash;
-	
-	QMap<CURL*, CurlUser*> m_users;
-	QMap<int, CurlPollingMaster*> m_masters;
-	sockets_hash m_sockets;
-	QMutex m_usersLock;
-	QQueue<CurlUser*> m_queueToDelete;
 	
-	QList<int> m_socketsToRemove;
-	sockets_hash m_socketsToAdd;
+	CurlShare* m_share;
+	QList<CurlPollerShard*> m_shards;
+	// number of transfers assigned to each shard
+	QHash<CurlPollerShard*, int> m_load;
+	QHash<CurlUser*, CurlPollerShard*> m_userShards;
+	QHash<CurlStat*, CurlPollerShard*> m_groupShards;
+	mutable QMutex m_lock;
 
 	friend class HttpFtpSettings;
 	friend class CurlDownload;
-	friend class CurlPollingMaster;
 	friend class CurlUser;
 };
 
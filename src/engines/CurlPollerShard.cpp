@@ -0,0 +1,464 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2010 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "config.h"
+#include "CurlPollerShard.h"
+#include "CurlTransferGroup.h"
+#include "CurlShare.h"
+#include "Settings.h"
+#include "RuntimeException.h"
+#include <QtDebug>
+#include <unistd.h>
+#include <fcntl.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#	include <sys/eventfd.h>
+#endif
+
+CurlPollerShard::CurlPollerShard(CurlShare* share)
+	: m_bAbort(false), m_share(share), m_timeout(0), m_nextHousekeeping(0)
+{
+	m_curlTimeout = 0;
+	m_curlm = curl_multi_init();
+	m_poller = Poller::createInstance(this);
+	
+	curl_multi_setopt(m_curlm, CURLMOPT_SOCKETFUNCTION, socket_callback);
+	curl_multi_setopt(m_curlm, CURLMOPT_SOCKETDATA, static_cast<CurlPollerShard*>(this));
+	
+	// connections are kept in the multi handle's cache after a transfer ends,
+	// so that restarted segments can pick them up again
+	int cache = getSettingsValue("httpftp/connection_cache").toInt();
+	if(cache > 0)
+		curl_multi_setopt(m_curlm, CURLMOPT_MAXCONNECTS, long(cache));
+#if LIBCURL_VERSION_NUM >= 0x072b00
+	// segments going to the same HTTP/2 server become streams of a single connection
+	if(getSettingsValue("httpftp/http2").toBool())
+		curl_multi_setopt(m_curlm, CURLMOPT_PIPELINING, long(CURLPIPE_MULTIPLEX));
+#endif
+#if LIBCURL_VERSION_NUM >= 0x071e00
+	int perHost = getSettingsValue("httpftp/max_host_connections").toInt();
+	if(perHost > 0)
+		curl_multi_setopt(m_curlm, CURLMOPT_MAX_HOST_CONNECTIONS, long(perHost));
+#endif
+
+#ifdef HAVE_SYS_EVENTFD_H
+	m_wakeFds[0] = m_wakeFds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(m_wakeFds[0] < 0)
+		throw RuntimeException("eventfd() failed");
+#else
+	if(pipe(m_wakeFds))
+		throw RuntimeException("pipe() failed");
+	for(int i=0;i<2;i++)
+	{
+		fcntl(m_wakeFds[i], F_SETFL, fcntl(m_wakeFds[i], F_GETFL) | O_NONBLOCK);
+		fcntl(m_wakeFds[i], F_SETFD, FD_CLOEXEC);
+	}
+#endif
+	m_poller->addSocket(m_wakeFds[0], Poller::PollerIn);
+}
+
+CurlPollerShard::~CurlPollerShard()
+{
+	stop();
+	
+	// get rid of whatever hasn't been processed yet
+	processCommands();
+	curl_multi_cleanup(m_curlm);
+	
+	m_poller->removeSocket(m_wakeFds[0]);
+	close(m_wakeFds[0]);
+	if(m_wakeFds[1] != m_wakeFds[0])
+		close(m_wakeFds[1]);
+}
+
+void CurlPollerShard::stop()
+{
+	m_bAbort = true;
+	
+	if(isRunning())
+	{
+		wakeUp();
+		wait();
+	}
+}
+
+void CurlPollerShard::wakeUp()
+{
+	// only the first caller after the last wakeup has to make a syscall
+	if(!m_wakePending.testAndSetOrdered(0, 1))
+		return;
+	
+#ifdef HAVE_SYS_EVENTFD_H
+	eventfd_write(m_wakeFds[1], 1);
+#else
+	char c = 0;
+	if(write(m_wakeFds[1], &c, 1) < 0)
+		qDebug() << "CurlPollerShard::wakeUp - write() failed";
+#endif
+}
+
+void CurlPollerShard::queueCommand(const Command& cmd)
+{
+	m_commands.push(cmd);
+	wakeUp();
+}
+
+void CurlPollerShard::pollingCycle()
+{
+	Poller::Event events[30];
+	int dummy;
+	qint64 now;
+	QList<CurlStat*> timedOut;
+	QSet<int> pending;
+
+	int numEvents = m_poller->wait(m_timeout, events, sizeof(events) / sizeof(events[0]));
+
+	processCommands();
+
+	if(!numEvents)
+	{
+		curl_multi_socket_action(m_curlm, CURL_SOCKET_TIMEOUT, 0, &dummy);
+	}
+
+	for(int i=0;i<numEvents;i++)
+	{
+		int socket = events[i].socket;
+		int mask = 0;
+
+		if(socket == m_wakeFds[0])
+			continue;
+
+		if(events[i].flags & Poller::PollerIn)
+			mask |= CURL_CSELECT_IN;
+		if(events[i].flags & Poller::PollerOut)
+			mask |= CURL_CSELECT_OUT;
+		if(events[i].flags & (Poller::PollerError | Poller::PollerHup))
+			mask |= CURL_CSELECT_ERR;
+
+		curl_multi_socket_action(m_curlm, socket, mask, &dummy);
+		pending << socket;
+	}
+
+	now = CurlStat::monotonicMsecs();
+
+	for(int i = 0; i < m_socketsToRemove.size(); i++)
+		m_sockets.remove(m_socketsToRemove[i]);
+	m_socketsToRemove.clear();
+
+	for(sockets_hash::iterator it = m_socketsToAdd.begin(); it != m_socketsToAdd.end(); it++)
+	{
+		m_sockets[it.key()] = it.value();
+		pending << it.key();
+	}
+	m_socketsToAdd.clear();
+
+	foreach(int socket, pending)
+	{
+		if(m_sockets.contains(socket))
+			processSocket(socket);
+	}
+
+	unthrottle(now);
+
+	if(now >= m_nextHousekeeping)
+		housekeeping(now, timedOut);
+
+	if(m_curlTimeout <= 0 || m_curlTimeout > 500)
+		m_timeout = 500;
+	else
+		m_timeout = m_curlTimeout;
+
+	m_timeout = qBound<long>(0, m_nextHousekeeping - now, m_timeout);
+	if(!m_throttled.isEmpty())
+		m_timeout = qBound<long>(0, m_throttled.firstKey() - now, m_timeout);
+
+	while(CURLMsg* msg = curl_multi_info_read(m_curlm, &dummy))
+	{
+		qDebug() << "CURL message:" << msg->msg;
+		if(msg->msg != CURLMSG_DONE)
+			continue;
+
+		CurlUser* user = m_users.value(msg->easy_handle);
+
+		if(m_share)
+			m_share->transferDone(msg->easy_handle);
+		if(user)
+			user->transferDone(msg->data.result);
+	}
+
+	foreach(CurlStat* stat, timedOut)
+	{
+		if(CurlUser* user = dynamic_cast<CurlUser*>(stat))
+			user->transferDone(CURLE_OPERATION_TIMEDOUT);
+	}
+
+}
+
+void CurlPollerShard::processCommands()
+{
+	Command cmd;
+	char buf[8];
+
+	// drain the wakeup fd first, so that no push can get lost in between
+	m_wakePending.storeRelease(0);
+	while(read(m_wakeFds[0], buf, sizeof buf) > 0)
+		;
+
+	while(m_commands.pop(cmd))
+	{
+		switch(cmd.type)
+		{
+		case Command::AddUser:
+		{
+			CURL* handle = cmd.user->curlHandle();
+			qDebug() << "CurlPollerShard: adding" << cmd.user << handle;
+
+			cmd.user->resetStatistics();
+			cmd.user->m_shard = this;
+			if(m_share)
+				m_share->attach(handle);
+			m_users[handle] = cmd.user;
+			curl_multi_add_handle(m_curlm, handle);
+			break;
+		}
+		case Command::RemoveUser:
+			doRemoveUser(cmd);
+			break;
+		case Command::RemoveGroup:
+			delete cmd.stat;
+			break;
+		case Command::PauseUser:
+		{
+			// the user may be gone already, don't touch it unless it's still ours
+			if(m_users.value(cmd.handle) == cmd.user)
+				curl_easy_pause(cmd.handle, cmd.flag ? CURLPAUSE_ALL : CURLPAUSE_CONT);
+			break;
+		}
+		case Command::SetLimits:
+			cmd.stat->setMaxDown(cmd.down);
+			cmd.stat->setMaxUp(cmd.up);
+			break;
+		}
+	}
+
+	m_nTransfers.storeRelease(m_users.size());
+}
+
+void CurlPollerShard::doRemoveUser(const Command& cmd)
+{
+	CURL* handle = cmd.handle;
+	if(!handle)
+		return;
+
+	qDebug() << "CurlPollerShard: removing" << cmd.user << handle;
+	m_users.remove(handle);
+	removeThrottled(cmd.user);
+
+	// the sockets are left alone, other streams may still use the connection;
+	// curl reports those it closes through socket_callback()
+	curl_multi_remove_handle(m_curlm, handle);
+	curl_easy_cleanup(handle);
+
+	if(!cmd.flag)
+		delete cmd.user;
+}
+
+void CurlPollerShard::housekeeping(qint64 now, QList<CurlStat*>& timedOut)
+{
+	int down = 0, up = 0;
+
+	// this is done per transfer rather than per socket, because
+	// multiplexed transfers share a single socket
+	for(QMap<CURL*, CurlUser*>::const_iterator it = m_users.begin(); it != m_users.end(); it++)
+	{
+		int d, u;
+		CurlUser* user = it.value();
+
+		// being held back by the shaper or a slow disk doesn't make a transfer idle
+		if(!user->idleCycle(now) && !user->m_nThrottledUntil && !user->m_bWritePaused)
+			timedOut << user;
+
+		user->speeds(d, u);
+		down += d;
+		up += u;
+	}
+
+	m_nSpeedDown.storeRelease(down);
+	m_nSpeedUp.storeRelease(up);
+	m_nextHousekeeping = now + 1000;
+}
+
+void CurlPollerShard::processSocket(int socket)
+{
+	int& flags = m_sockets[socket].flags;
+
+	// the limits are enforced by pausing the transfers, the socket may be polled all the time
+	if(flags & Poller::PollerOneShot)
+	{
+		flags ^= Poller::PollerOneShot;
+		m_poller->addSocket(socket, flags);
+	}
+}
+
+void CurlPollerShard::throttle(CurlUser* obj, int msecs)
+{
+	removeThrottled(obj);
+	obj->m_nThrottledUntil = CurlStat::monotonicMsecs() + msecs;
+	m_throttled.insert(obj->m_nThrottledUntil, obj);
+}
+
+void CurlPollerShard::removeThrottled(CurlUser* user)
+{
+	if(user->m_nThrottledUntil)
+	{
+		m_throttled.remove(user->m_nThrottledUntil, user);
+		user->m_nThrottledUntil = 0;
+	}
+}
+
+void CurlPollerShard::unthrottle(qint64 now)
+{
+	QList<CurlUser*> ready;
+
+	while(!m_throttled.isEmpty() && m_throttled.firstKey() <= now)
+	{
+		CurlUser* user = m_throttled.begin().value();
+
+		m_throttled.erase(m_throttled.begin());
+		user->m_nThrottledUntil = 0;
+		ready << user;
+	}
+
+	// the callbacks may be called from within curl_easy_pause() and throttle the transfer again
+	foreach(CurlUser* user, ready)
+		curl_easy_pause(user->curlHandle(), CURLPAUSE_CONT);
+}
+
+void CurlPollerShard::run()
+{
+	curl_multi_setopt(m_curlm, CURLMOPT_TIMERFUNCTION, timer_callback);
+	curl_multi_setopt(m_curlm, CURLMOPT_TIMERDATA, &m_curlTimeout);
+
+	while(!m_bAbort)
+		pollingCycle();
+}
+
+void CurlPollerShard::epollEnable(int socket, int events)
+{
+	m_poller->addSocket(socket, events);
+}
+
+int CurlPollerShard::timer_callback(CURLM* multi, long newtimeout, long* timeout)
+{
+	*timeout = newtimeout;
+	return 0;
+}
+
+int CurlPollerShard::socket_callback(CURL* easy, curl_socket_t s, int action, CurlPollerShard* This, void* socketp)
+{
+	int flags = Poller::PollerOneShot | Poller::PollerError | Poller::PollerHup;
+	
+	if(action == CURL_POLL_IN || action == CURL_POLL_INOUT)
+		flags |= Poller::PollerIn;
+	if(action == CURL_POLL_OUT || action == CURL_POLL_INOUT)
+		flags |= Poller::PollerOut;
+	
+	if(action == CURL_POLL_REMOVE)
+	{
+		qDebug() << "CurlPollerShard::socket_callback - remove";
+		
+		This->m_socketsToAdd.remove(s);
+		This->m_socketsToRemove << s;
+		return This->m_poller->removeSocket(s);
+	}
+	else
+	{
+		qDebug() << "CurlPollerShard::socket_callback - add/mod" << s << flags;
+		
+		// the descriptor may have been reused right after being closed
+		This->m_socketsToRemove.removeAll(s);
+		This->m_socketsToAdd[s] = SocketInfo(flags);
+		
+		return This->m_poller->addSocket(s, flags);
+	}
+}
+
+void CurlPollerShard::addTransfer(CurlUser* obj)
+{
+	Command cmd = Command();
+	cmd.type = Command::AddUser;
+	cmd.user = obj;
+	queueCommand(cmd);
+}
+
+void CurlPollerShard::removeTransfer(CurlUser* obj, bool nodeep)
+{
+	Command cmd = Command();
+	cmd.type = Command::RemoveUser;
+	cmd.user = obj;
+	cmd.handle = obj->curlHandle();
+	cmd.flag = nodeep;
+	queueCommand(cmd);
+}
+
+void CurlPollerShard::removeTransfer(CurlTransferGroup* obj)
+{
+	Command cmd = Command();
+	cmd.type = Command::RemoveGroup;
+	cmd.stat = obj;
+	queueCommand(cmd);
+}
+
+void CurlPollerShard::pauseTransfer(CurlUser* obj, bool pause)
+{
+	Command cmd = Command();
+	cmd.type = Command::PauseUser;
+	cmd.user = obj;
+	cmd.handle = obj->curlHandle();
+	cmd.flag = pause;
+	queueCommand(cmd);
+}
+
+void CurlPollerShard::setTransferLimits(CurlStat* obj, int down, int up)
+{
+	Command cmd = Command();
+	cmd.type = Command::SetLimits;
+	cmd.stat = obj;
+	cmd.down = down;
+	cmd.up = up;
+	queueCommand(cmd);
+}
+
+int CurlPollerShard::transferCount() const
+{
+	return m_nTransfers.loadAcquire();
+}
+
+void CurlPollerShard::totalSpeeds(int& down, int& up) const
+{
+	down = m_nSpeedDown.loadAcquire();
+	up = m_nSpeedUp.loadAcquire();
+}
@@ -0,0 +1,142 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2010 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef CURLPOLLERSHARD_H
+#define CURLPOLLERSHARD_H
+#include <QThread>
+#include <QAtomicInt>
+#include <QMap>
+#include <QSet>
+#include <curl/curl.h>
+#include "engines/CurlUser.h"
+#include "poller/Poller.h"
+#include "util/MpscQueue.h"
+
+class CurlTransferGroup;
+class CurlShare;
+
+// A single polling thread with its own multi handle, poller and socket map.
+// CurlPoller distributes transfers across several of these.
+//
+// All the public methods only queue a command and wake the polling thread up,
+// so they never block. The commands are carried out at the start of the next cycle.
+class CurlPollerShard : public QThread
+{
+public:
+	CurlPollerShard(CurlShare* share = 0);
+	~CurlPollerShard();
+	
+	void addTransfer(CurlUser* obj);
+	// will handle the underlying CURL* too
+	void removeTransfer(CurlUser* obj, bool nodeep = false);
+	// deletes the group once all the transfers queued for removal before it are gone
+	void removeTransfer(CurlTransferGroup* obj);
+	void pauseTransfer(CurlUser* obj, bool pause);
+	void setTransferLimits(CurlStat* obj, int down, int up);
+	// Pauses the transfer for the given msecs, only to be called from the polling thread
+	// (a curl callback) after the transfer has been paused by its callback
+	void throttle(CurlUser* obj, int msecs);
+	
+	// the number of transfers handled by this shard
+	int transferCount() const;
+	// refreshed by the polling thread once a second
+	void totalSpeeds(int& down, int& up) const;
+	
+	void run();
+	void stop();
+protected:
+	struct Command
+	{
+		enum Type { AddUser, RemoveUser, RemoveGroup, PauseUser, SetLimits };
+		
+		Type type;
+		CurlUser* user;
+		// captured when queuing the removal, the user may be gone by then
+		CURL* handle;
+		CurlStat* stat;
+		int down, up;
+		// nodeep for RemoveUser, pause for PauseUser
+		bool flag;
+	};
+	
+	void queueCommand(const Command& cmd);
+	void wakeUp();
+	// runs in the polling thread
+	void processCommands();
+	void doRemoveUser(const Command& cmd);
+	// idle checks of all transfers and speed totals, once a second
+	void housekeeping(qint64 now, QList<CurlStat*>& timedOut);
+	
+	// Sockets are tracked apart from the transfers, multiplexed transfers share them.
+	// Only curl knows when a socket goes away, see socket_callback().
+	struct SocketInfo
+	{
+		SocketInfo(int f = 0) : flags(f) {}
+		
+		int flags;
+	};
+	
+	void epollEnable(int socket, int events);
+	void pollingCycle();
+	// makes curl's one-shot registration of a socket that fired a persistent one
+	void processSocket(int socket);
+	// unpauses the throttled transfers whose time has come
+	void unthrottle(qint64 now);
+	void removeThrottled(CurlUser* user);
+	static int socket_callback(CURL* easy, curl_socket_t s, int action, CurlPollerShard* This, void* socketp);
+	static int timer_callback(CURLM* multi, long newtimeout, long* timeout);
+protected:
+	bool m_bAbort;
+	CURLM* m_curlm;
+	CurlShare* m_share;
+	Poller* m_poller;
+	long m_curlTimeout;
+	long m_timeout;
+	
+	typedef QMap<int, SocketInfo> sockets_hash;
+	typedef QMultiMap<qint64, CurlUser*> throttled_map;
+	
+	// only ever touched from the polling thread
+	QMap<CURL*, CurlUser*> m_users;
+	sockets_hash m_sockets;
+	// transfers paused by the shaper, ordered by the time they may go on
+	throttled_map m_throttled;
+	
+	QList<int> m_socketsToRemove;
+	sockets_hash m_socketsToAdd;
+	
+	MpscQueue<Command> m_commands;
+	// eventfd (or a pipe) used to interrupt Poller::wait()
+	int m_wakeFds[2];
+	QAtomicInt m_wakePending;
+	
+	// published for other threads
+	QAtomicInt m_nTransfers, m_nSpeedDown, m_nSpeedUp;
+	qint64 m_nextHousekeeping;
+};
+
+#endif
@@ -0,0 +1,88 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "CurlShare.h"
+#include <QUrl>
+#include <QtDebug>
+
+CurlShare::CurlShare()
+{
+	m_share = curl_share_init();
+	
+	curl_share_setopt(m_share, CURLSHOPT_LOCKFUNC, lock_function);
+	curl_share_setopt(m_share, CURLSHOPT_UNLOCKFUNC, unlock_function);
+	curl_share_setopt(m_share, CURLSHOPT_USERDATA, this);
+	curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(m_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+CurlShare::~CurlShare()
+{
+	if(curl_share_cleanup(m_share) != CURLSHE_OK)
+		qDebug() << "CurlShare: the share is still in use";
+}
+
+void CurlShare::attach(CURL* curl)
+{
+	curl_easy_setopt(curl, CURLOPT_SHARE, m_share);
+}
+
+void CurlShare::transferDone(CURL* curl)
+{
+	char* url = 0;
+	long connects = 0;
+	
+	curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+	curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+	
+	if(!url)
+		return;
+	
+	QString host = QUrl(QString::fromUtf8(url)).host();
+	
+	QMutexLocker l(&m_statsLock);
+	HostStats& stats = m_hostStats[host];
+	
+	stats.transfers++;
+	stats.connects += connects;
+}
+
+QHash<QString, CurlShare::HostStats> CurlShare::hostStats() const
+{
+	QMutexLocker l(&m_statsLock);
+	return m_hostStats;
+}
+
+void CurlShare::lock_function(CURL*, curl_lock_data data, curl_lock_access, CurlShare* This)
+{
+	This->m_locks[data].lock();
+}
+
+void CurlShare::unlock_function(CURL*, curl_lock_data data, CurlShare* This)
+{
+	This->m_locks[data].unlock();
+}
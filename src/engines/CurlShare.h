@@ -0,0 +1,69 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef CURLSHARE_H
+#define CURLSHARE_H
+#include <QMutex>
+#include <QHash>
+#include <QString>
+#include <curl/curl.h>
+
+// DNS and TLS session caches shared by all transfers in all polling threads.
+// Connections themselves are pooled by each shard's multi handle, libcurl can't
+// share them between threads.
+class CurlShare
+{
+public:
+	CurlShare();
+	~CurlShare();
+	
+	void attach(CURL* curl);
+	// to be called when a transfer has finished, records whether it had to connect
+	void transferDone(CURL* curl);
+	
+	struct HostStats
+	{
+		HostStats() : transfers(0), connects(0) {}
+		
+		// finished transfers
+		qint64 transfers;
+		// new connections they had to make, the rest have been reused
+		qint64 connects;
+	};
+	QHash<QString, HostStats> hostStats() const;
+private:
+	static void lock_function(CURL* curl, curl_lock_data data, curl_lock_access access, CurlShare* This);
+	static void unlock_function(CURL* curl, curl_lock_data data, CurlShare* This);
+private:
+	CURLSH* m_share;
+	QMutex m_locks[CURL_LOCK_DATA_LAST];
+	
+	mutable QMutex m_statsLock;
+	QHash<QString, HostStats> m_hostStats;
+};
+
+#endif
@@ -25,160 +25,117 @@ respects for all of the code used other than "OpenSSL".
 */
 
 #include "CurlStat.h"
+#include "Queue.h"
+#include <time.h>
 #include <QtDebug>
 
-const int CurlStat::MAX_STATS = 5;
-
-bool operator<(const timeval& t1, const timeval& t2);
+// the length of a sample
+static const qint64 SAMPLE_MSECS = 250;
+// a new sample makes for 1/SAMPLE_WEIGHT of the speed, i.e. the speed
+// follows the changes within about two seconds
+static const int SAMPLE_WEIGHT = 8;
+// after so many empty samples the speed has dropped to zero anyway
+static const qint64 MAX_SAMPLES = 64;
 
 CurlStat::CurlStat()
+	: m_downBucket(TokenBucket::global(false)), m_upBucket(TokenBucket::global(true))
 {
-	m_down.max = m_up.max = 0;
-	m_down.stats = new timedata_pair[MAX_STATS];
-	m_up.stats = new timedata_pair[MAX_STATS];
-	m_down.nextStat = m_up.nextStat = 0;
 	resetStatistics();
 }
 
 CurlStat::~CurlStat()
 {
-	delete [] m_down.stats;
-	delete [] m_up.stats;
 }
 
-timeval CurlStat::lastOperation() const
+qint64 CurlStat::monotonicMsecs()
 {
-	if(m_down.lastOp < m_up.lastOp)
-		return m_up.lastOp;
-	else
-		return m_down.lastOp;
+	timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return qint64(ts.tv_sec)*1000 + ts.tv_nsec/1000000;
 }
 
-void CurlStat::timeProcess(SpeedData& data, size_t bytes)
+qint64 CurlStat::lastOperation() const
 {
-	timeval tvNow;
-	gettimeofday(&tvNow, 0);
+	return qMax(m_down.lastOp, m_up.lastOp);
+}
 
-	if(isNull(data.last))
-		data.last = tvNow;
-	else
-	{
-		long usec = (tvNow.tv_sec-data.last.tv_sec)*1000000LL + (tvNow.tv_usec-data.last.tv_usec);
-		data.accum.first += usec;
-		data.accum.second += bytes;
-
-		if(data.accum.first > 1000000LL)
-		{
-			//if (!data.accum.second)
-			//	qDebug() << "Pushing 0 bytes from accum, time " << data.accum.first;
-			data.nextStat %= MAX_STATS;
-			data.stats[data.nextStat++] = data.accum;
-
-			data.accum = timedata_pair(0,0);
-		}
-
-		if(data.max > 0)
-		{
-			long delta = bytes*1000000LL/data.max - usec/2;
-
-			if(delta > 0)
-			{
-				delta *= 2;
-				delta -= 50000;
-				if (isNull(data.next))
-					data.next = tvNow;
-				delta = qMin<long>(delta, 2000000); // prevent download stalling
-				data.next.tv_sec += delta/1000000LL;
-				data.next.tv_usec += delta%1000000LL;
-			}
-		}
-		else
-			memset(&data.next, 0, sizeof data.next);
-
-		data.last = tvNow;
-	}
+void CurlStat::timeProcess(SpeedData& data, size_t bytes)
+{
+	const qint64 now = monotonicMsecs();
+	const qint64 elapsed = now - data.sampleStart;
 
+	data.sampleBytes += bytes;
 	if(bytes)
-		data.lastOp = tvNow;
-}
+		data.lastOp = now;
 
-void CurlStat::resetStatistics()
-{
-	m_down.accum = m_up.accum = timedata_pair(0,0);
+	if(elapsed < SAMPLE_MSECS)
+		return;
 
-	memset(&m_down.last, 0, sizeof(m_down.last));
-	memset(&m_up.last, 0, sizeof(m_up.last));
+	// a long gap counts as that many samples of the average speed over it
+	qint64 sample = data.sampleBytes * 1000 / elapsed;
+	qint64 rate = data.rate.loadAcquire();
+	qint64 samples = qMin(elapsed / SAMPLE_MSECS, MAX_SAMPLES);
 
-	memset(&m_down.next, 0, sizeof m_down.next);
-	memset(&m_up.next, 0, sizeof m_up.next);
+	for(qint64 i = 0; i < samples; i++)
+		rate += (sample - rate) / SAMPLE_WEIGHT;
 
-	memset(m_down.stats, 0, sizeof(*m_down.stats)*MAX_STATS);
-	memset(m_up.stats, 0, sizeof(*m_up.stats)*MAX_STATS);
+	// the division never gets all the way down to zero on its own
+	if(!sample && rate < SAMPLE_WEIGHT)
+		rate = 0;
 
-	gettimeofday(&m_down.lastOp, 0);
-	m_up.lastOp = m_down.lastOp;
+	data.rate.storeRelease(int(rate));
+	data.sampleStart = now;
+	data.sampleBytes = 0;
 }
 
-int CurlStat::computeSpeed(const timedata_pair* data)
+void CurlStat::resetStatistics()
 {
-	long long time = 0, bytes = 0;
+	const qint64 now = monotonicMsecs();
+	SpeedData* data[] = { &m_down, &m_up };
 
-	for(int i=0;i<MAX_STATS;i++)
+	for(int i = 0; i < 2; i++)
 	{
-		time += data[i].first;
-		bytes += data[i].second;
+		data[i]->sampleStart = data[i]->lastOp = now;
+		data[i]->sampleBytes = 0;
+		data[i]->rate.storeRelease(0);
 	}
-
-	if(time)
-		return double(bytes)/(double(time)/1000000);
-	else
-		return 0;
-}
-
-bool CurlStat::isNull(const timeval& t)
-{
-	return !t.tv_sec && !t.tv_usec;
 }
 
 void CurlStat::speeds(int& down, int& up) const
 {
-	down = computeSpeed(m_down.stats);
-	up = computeSpeed(m_up.stats);
+	down = m_down.rate.loadAcquire();
+	up = m_up.rate.loadAcquire();
 }
 
-bool CurlStat::hasNextReadTime() const
-{
-	return !isNull(m_down.next);
-}
-
-bool CurlStat::hasNextWriteTime() const
-{
-	return !isNull(m_up.next);
-}
-
-timeval CurlStat::nextReadTime() const
-{
-	return m_down.next;
-}
-
-timeval CurlStat::nextWriteTime() const
+void CurlStat::setMaxUp(int bytespersec)
 {
-	return m_up.next;
+	m_upBucket.setLimit(bytespersec);
 }
 
-bool CurlStat::performsLimiting() const
+void CurlStat::setMaxDown(int bytespersec)
 {
-	return m_up.max || m_down.max;
+	m_downBucket.setLimit(bytespersec);
 }
 
-void CurlStat::setMaxUp(int bytespersec)
+void CurlStat::setShapingQueue(Queue* q)
 {
-	m_up.max = bytespersec;
+	m_downBucket.setParent(q ? q->bucket(false) : TokenBucket::global(false));
+	m_upBucket.setParent(q ? q->bucket(true) : TokenBucket::global(true));
 }
 
-void CurlStat::setMaxDown(int bytespersec)
+void CurlStat::setShapingParent(CurlStat* parent)
 {
-	m_down.max = bytespersec;
+	if(!parent)
+		setShapingQueue(0);
+	else
+	{
+		m_downBucket.setParent(&parent->m_downBucket);
+		m_upBucket.setParent(&parent->m_upBucket);
+	}
 }
 
 void CurlStat::timeProcessDown(size_t bytes)
@@ -26,9 +26,10 @@ respects for all of the code used other than "OpenSSL".
 
 #ifndef CURLSTAT_H
 #define CURLSTAT_H
-#include <QPair>
-#include <sys/time.h>
-#include <QReadWriteLock>
+#include <QAtomicInt>
+#include "util/TokenBucket.h"
+
+class Queue;
 
 class CurlStat
 {
@@ -36,43 +37,47 @@ public:
 	CurlStat();
 	virtual ~CurlStat();
 
+	// lock-free, may be called from any thread
 	void speeds(int& down, int& up) const;
 	void setMaxUp(int bytespersec);
 	void setMaxDown(int bytespersec);
 
-	bool hasNextReadTime() const;
-	bool hasNextWriteTime() const;
-	timeval nextReadTime() const;
-	timeval nextWriteTime() const;
-
-	bool performsLimiting() const;
-
-	timeval lastOperation() const;
+	// Puts the transfer under the queue's limits, the global ones if there's no queue
+	void setShapingQueue(Queue* q);
+	// Puts the transfer under the other's limits, e.g. a segment under its download,
+	// the global ones if there's no parent
+	void setShapingParent(CurlStat* parent);
+	// Msecs to wait before receiving or sending any more data, 0 if it may go on
+	int downWait() { return m_downBucket.wait(); }
+	int upWait() { return m_upBucket.wait(); }
+
+	// in monotonicMsecs() time
+	qint64 lastOperation() const;
 	void resetStatistics();
 
-	virtual bool idleCycle(const timeval& tvNow) = 0;
+	virtual bool idleCycle(qint64 now) = 0;
 
-	typedef QPair<long long,long> timedata_pair;
+	// A cheap monotonic clock in msecs, not affected by changes of the system time.
+	// The resolution is that of the scheduler tick.
+	static qint64 monotonicMsecs();
 
 	struct SpeedData
 	{
-		timedata_pair* stats;
-		timeval last, next, lastOp;
-		timedata_pair accum;
-		int max;
-		int nextStat;
+		// the bytes seen since the start of the current sample
+		qint64 sampleStart, sampleBytes;
+		qint64 lastOp;
+		// EWMA of the samples in bytes per second, published for other threads
+		QAtomicInt rate;
 	};
-
-	static const int MAX_STATS;
 protected:
-	static int computeSpeed(const timedata_pair* data);
+	// only ever called from a single thread (the polling one)
 	static void timeProcess(SpeedData& data, size_t bytes);
-	static bool isNull(const timeval& t);
 
 	void timeProcessDown(size_t bytes);
 	void timeProcessUp(size_t bytes);
 protected:
 	SpeedData m_down, m_up;
+	TokenBucket m_downBucket, m_upBucket;
 
 	friend class CurlUser;
 	friend class UrlClient;
@@ -2,7 +2,7 @@
 FatRat download manager
 http://fatrat.dolezel.info
 
-Copyright (C) 2006-2008 Lubos Dolezel <lubos a dolezel.info>
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
 
 This program is free software; you can redistribute it and/or
 modify it under the terms of the GNU General Public License
@@ -24,20 +24,13 @@ executables. You must obey the GNU General Public License in all
 respects for all of the code used other than "OpenSSL".
 */
 
-#ifndef CURLPOLLINGMASTER_H
-#define CURLPOLLINGMASTER_H
-#include "CurlPoller.h"
-#include "CurlStat.h"
 
-class CurlPoller;
-class CurlStat;
+#include "CurlTransferGroup.h"
 
-class CurlPollingMaster : public CurlPoller, public CurlStat
+bool CurlTransferGroup::idleCycle(qint64)
 {
-public:
-	void doWork();
-	int handle();
-	virtual bool idleCycle(const timeval& tvNow);
-};
-
-#endif
+	timeProcessDown(0);
+	timeProcessUp(0);
+	
+	return true;
+}
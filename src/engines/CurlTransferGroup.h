@@ -0,0 +1,41 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef CURLTRANSFERGROUP_H
+#define CURLTRANSFERGROUP_H
+#include "CurlStat.h"
+
+// Speed statistics and limits shared by several transfers, e.g. the segments of a single download.
+// All of the transfers of a group live in the same CurlPollerShard, which is also
+// the only thread updating the group.
+class CurlTransferGroup : public CurlStat
+{
+public:
+	virtual bool idleCycle(qint64 now);
+};
+
+#endif
@@ -90,6 +90,7 @@ void CurlUpload::init(QString source, QString target)
 void CurlUpload::setObject(QString source)
 {
 	m_strSource = source;
+	markDirty();
 }
 
 int CurlUpload::seek_function(QFile* file, curl_off_t offset, int origin)
@@ -204,6 +205,7 @@ void CurlUpload::changeActive(bool nowActive)
 		else
 			curl_easy_setopt(m_curl, CURLOPT_PROXY, "");
 		
+		setShapingQueue(myQueue());
 		CurlPoller::instance()->addTransfer(this);
 	}
 	else
@@ -238,7 +240,7 @@ int CurlUpload::curl_debug_callback(CURL*, curl_infotype type, char* text, size_
 
 void CurlUpload::setSpeedLimits(int, int up)
 {
-	m_up.max = up;
+	setMaxUp(up);
 }
 
 void CurlUpload::speeds(int& down, int& up) const
@@ -19,10 +19,11 @@ along with this program; if not, see <http://www.gnu.org/licenses/>.
 
 #include "CurlUser.h"
 #include "CurlPoller.h"
+#include "CurlPollerShard.h"
 #include <QtDebug>
 
 CurlUser::CurlUser()
-	: m_master(0)
+	: m_master(0), m_bWritePaused(false), m_shard(0), m_nThrottledUntil(0)
 {
 }
 
@@ -33,10 +34,21 @@ CurlUser::~CurlUser()
 size_t CurlUser::read_function(char *ptr, size_t size, size_t nmemb, CurlUser* This)
 {
 	size_t bytes = 0;
+
+	// over the limit, curl asks again once the shard unpauses the transfer
+	if (int wait = This->upWait())
+	{
+		if (This->m_shard)
+			This->m_shard->throttle(This, wait);
+		return CURL_READFUNC_PAUSE;
+	}
+
 	if (ptr)
 		bytes = This->readData(ptr, size*nmemb);
 
 	This->timeProcessUp(size*nmemb);
+	// the buckets of the group and the queue are drawn from too
+	This->m_upBucket.consume(bytes);
 
 	if(This->m_master != 0)
 		This->m_master->timeProcessUp(size*nmemb);
@@ -47,10 +59,24 @@ size_t CurlUser::read_function(char *ptr, size_t size, size_t nmemb, CurlUser* T
 size_t CurlUser::write_function(const char* ptr, size_t size, size_t nmemb, CurlUser* This)
 {
 	bool ok = true;
+
+	// over the limit, curl passes the same data again once the shard unpauses the transfer
+	if (int wait = This->downWait())
+	{
+		if (This->m_shard)
+			This->m_shard->throttle(This, wait);
+		return CURL_WRITEFUNC_PAUSE;
+	}
+
+	This->m_bWritePaused = false;
 	if (ptr)
 		ok = This->writeData(ptr, size*nmemb);
 
+	if (This->m_bWritePaused)
+		return CURL_WRITEFUNC_PAUSE;
+
 	This->timeProcessDown(size*nmemb);
+	This->m_downBucket.consume(size*nmemb);
 
 	if(This->m_master != 0)
 		This->m_master->timeProcessDown(size*nmemb);
@@ -61,6 +87,7 @@ size_t CurlUser::write_function(const char* ptr, size_t size, size_t nmemb, Curl
 void CurlUser::setSegmentMaster(CurlStat* master)
 {
 	m_master = master;
+	setShapingParent(master);
 }
 
 CurlStat* CurlUser::segmentMaster() const
@@ -68,17 +95,19 @@ CurlStat* CurlUser::segmentMaster() const
 	return m_master;
 }
 
-bool CurlUser::idleCycle(const timeval& tvNow)
+bool CurlUser::idleCycle(qint64 now)
 {
-	int seconds = tvNow.tv_sec - lastOperation().tv_sec;
+	qint64 seconds = (now - lastOperation()) / 1000;
+
+	if(m_master != 0)
+		m_master->idleCycle(now);
 
 	if(seconds > CurlPoller::getTransferTimeout())
 		return false;
-	else if(seconds > 1)
-	{
-		timeProcessDown(0);
-		timeProcessUp(0);
-	}
+
+	// closes the current sample, so that the speed drops even if no data comes
+	timeProcessDown(0);
+	timeProcessUp(0);
 	return true;
 }
 
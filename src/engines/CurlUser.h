@@ -25,6 +25,8 @@ along with this program; if not, see <http://www.gnu.org/licenses/>.
 #include <QList>
 #include <QPair>
 
+class CurlPollerShard;
+
 class CurlUser : public CurlStat
 {
 public:
@@ -35,7 +37,7 @@ public:
 	virtual bool writeData(const char* buffer, size_t bytes);
 	virtual void transferDone(CURLcode result) = 0;
 	virtual CURL* curlHandle() = 0;
-	virtual bool idleCycle(const timeval& tvNow);
+	virtual bool idleCycle(qint64 now);
 
 	static size_t read_function(char *ptr, size_t size, size_t nmemb, CurlUser* This);
 	static size_t write_function(const char* ptr, size_t size, size_t nmemb, CurlUser* This);
@@ -44,8 +46,15 @@ protected:
 	CurlStat* segmentMaster() const;
 
 	friend class CurlPoller;
+	friend class CurlPollerShard;
 protected:
 	CurlStat* m_master;
+	// set by writeData() to have the transfer paused, the data is then passed again after unpausing
+	bool m_bWritePaused;
+	// the shard polling the transfer and when it unpauses the transfer after hitting a limit
+	// (CurlStat::monotonicMsecs())
+	CurlPollerShard* m_shard;
+	qint64 m_nThrottledUntil;
 };
 
 class CurlUserShallow : public CurlUser
@@ -0,0 +1,758 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "config.h"
+#include "DiskWriter.h"
+#include "CurlPoller.h"
+#include "ResumeJournal.h"
+#include "StreamingHash.h"
+#include "PieceHashes.h"
+#include "Settings.h"
+#ifdef HAVE_LIBURING_H
+#	include "UringDiskWriter.h"
+#endif
+#include <QtDebug>
+#include <QFile>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_PWRITEV
+#	include <sys/uio.h>
+#endif
+
+#ifndef POSIX_LINUX
+#	define pwrite64 pwrite
+#	define pwritev64 pwritev
+#	define fdatasync fsync
+#endif
+
+DiskWriter* DiskWriter::m_instance = 0;
+
+static const size_t BUFFER_ALIGNMENT = 4096;
+
+DiskWriter* DiskWriter::createInstance()
+{
+	DiskWriter* writer = 0;
+	
+#ifdef HAVE_LIBURING_H
+	if(getSettingsValue("httpftp/io_uring").toBool())
+		writer = UringDiskWriter::create();
+#endif
+	if(!writer)
+		writer = new DiskWriter;
+	
+	writer->start();
+	return writer;
+}
+
+DiskWriter::DiskWriter()
+	: m_bAbort(false), m_nQueued(0), m_bNewHashes(false)
+{
+	m_nBufferSize = getSettingsValue("httpftp/write_buffer_size").toInt() * 1024;
+	if(m_nBufferSize < BUFFER_ALIGNMENT)
+		m_nBufferSize = BUFFER_ALIGNMENT;
+	m_nBufferSize -= m_nBufferSize % BUFFER_ALIGNMENT;
+	
+	m_nMaxQueued = getSettingsValue("httpftp/write_queue").toInt();
+	if(m_nMaxQueued < 2)
+		m_nMaxQueued = 2;
+	
+	m_nCheckpointInterval = qMax(1, getSettingsValue("httpftp/journal_interval").toInt()) * 1000;
+	m_clock.start();
+	m_nextCheckpoint = m_nCheckpointInterval;
+	
+	if(!m_instance)
+		m_instance = this;
+}
+
+DiskWriter::~DiskWriter()
+{
+	stop();
+	
+	foreach(Buffer* buf, m_pool)
+	{
+		free(buf->data);
+		delete buf;
+	}
+	m_pool.clear();
+	
+	if(this == m_instance)
+		m_instance = 0;
+}
+
+void DiskWriter::stop()
+{
+	m_lock.lock();
+	m_bAbort = true;
+	m_cond.wakeAll();
+	m_lock.unlock();
+	
+	wait();
+}
+
+DiskWriter::Stream* DiskWriter::openStream(int fd, qlonglong offset, CurlUser* user, ResumeJournal* journal,
+	StreamingHash* hash, PieceHashes* pieces)
+{
+	Stream* stream = new Stream(this, fd, offset, user, journal, hash, pieces);
+	
+	QMutexLocker locker(&m_lock);
+	m_streams << stream;
+	return stream;
+}
+
+void DiskWriter::sync(QString path)
+{
+	struct stat st;
+	
+	if(stat(QFile::encodeName(path).constData(), &st) != 0)
+		return;
+	
+	QMutexLocker locker(&m_lock);
+	while(hasPending(st.st_dev, st.st_ino))
+		m_drained.wait(&m_lock);
+}
+
+void DiskWriter::attachHash(QString path, StreamingHash* hash)
+{
+	struct stat st;
+	
+	if(stat(QFile::encodeName(path).constData(), &st) != 0)
+		return;
+	
+	QMutexLocker locker(&m_lock);
+	foreach(Stream* stream, m_streams)
+	{
+		if(stream->m_dev != st.st_dev || stream->m_ino != st.st_ino)
+			continue;
+		
+		int barrier = stream->m_nSubmitted;
+		
+		// the data in the current buffer of an open stream goes out with the next buffer
+		// it submits, or with the marker if it's closed
+		if(stream->m_user)
+		{
+			hash->ref();
+			if(stream->m_newHash)
+				stream->m_newHash->deref();
+			stream->m_newHash = hash;
+			m_bNewHashes = true;
+			barrier++;
+		}
+		
+		if(stream->m_nSubmitted - stream->m_nPending < barrier)
+		{
+			hash->ref();
+			hash->hold();
+			stream->m_holds << qMakePair(hash, barrier);
+		}
+	}
+}
+
+void DiskWriter::switchHashes()
+{
+	if(!m_bNewHashes)
+		return;
+	
+	// nothing of the streams is being written right now
+	foreach(Stream* stream, m_streams)
+	{
+		if(!stream->m_newHash)
+			continue;
+		
+		if(stream->m_hash)
+			stream->m_hash->deref();
+		stream->m_hash = stream->m_newHash;
+		stream->m_newHash = 0;
+	}
+	m_bNewHashes = false;
+}
+
+void DiskWriter::releaseHashes(Stream* stream)
+{
+	const int written = stream->m_nSubmitted - stream->m_nPending;
+	
+	for(int i=0;i<stream->m_holds.size();)
+	{
+		if(stream->m_holds[i].second > written)
+		{
+			i++;
+			continue;
+		}
+		
+		StreamingHash* hash = stream->m_holds.takeAt(i).first;
+		hash->release();
+		hash->deref();
+	}
+}
+
+bool DiskWriter::hasPending(dev_t dev, ino_t ino) const
+{
+	foreach(Stream* stream, m_streams)
+	{
+		if(stream->m_nPending && stream->m_dev == dev && stream->m_ino == ino)
+			return true;
+	}
+	return false;
+}
+
+DiskWriter::Buffer* DiskWriter::allocBuffer(Stream* stream)
+{
+	Buffer* buf = 0;
+	
+	m_lock.lock();
+	if(!m_pool.isEmpty())
+		buf = m_pool.takeLast();
+	m_lock.unlock();
+	
+	if(!buf)
+	{
+		void* data;
+		if(posix_memalign(&data, BUFFER_ALIGNMENT, m_nBufferSize) != 0)
+			throw std::bad_alloc();
+		buf = new Buffer;
+		buf->data = static_cast<char*>(data);
+	}
+	
+	buf->used = 0;
+	buf->offset = stream->m_offset;
+	buf->stream = stream;
+	return buf;
+}
+
+void DiskWriter::freeBuffer(Buffer* buf)
+{
+	// keep just as many buffers around as may be queued
+	if(m_pool.size() < m_nMaxQueued)
+		m_pool << buf;
+	else
+	{
+		free(buf->data);
+		delete buf;
+	}
+}
+
+bool DiskWriter::mayQueue(Stream* stream)
+{
+	QMutexLocker locker(&m_lock);
+	
+	if(m_nQueued < m_nMaxQueued)
+		return true;
+	
+	if(!m_waiting.contains(stream))
+		m_waiting << stream;
+	return false;
+}
+
+void DiskWriter::submit(Buffer* buf)
+{
+	QMutexLocker locker(&m_lock);
+	
+	m_queue << buf;
+	m_nQueued++;
+	buf->stream->m_nPending++;
+	buf->stream->m_nSubmitted++;
+	m_cond.wakeOne();
+}
+
+void DiskWriter::closeStream(Stream* stream)
+{
+	QMutexLocker locker(&m_lock);
+	
+	if(stream->m_current)
+	{
+		freeBuffer(stream->m_current);
+		stream->m_current = 0;
+	}
+	
+	stream->m_user = 0;
+	m_waiting.removeAll(stream);
+	
+	// the file gets synced and closed by the writer thread after the last buffer
+	Buffer* marker = new Buffer;
+	marker->data = 0;
+	marker->used = 0;
+	marker->offset = stream->m_offset;
+	marker->stream = stream;
+	
+	m_queue << marker;
+	m_nQueued++;
+	stream->m_nPending++;
+	stream->m_nSubmitted++;
+	m_cond.wakeOne();
+}
+
+void DiskWriter::wakeWaiting()
+{
+	// leave some slack so that the transfers don't get paused again right away
+	if(m_waiting.isEmpty() || m_nQueued > m_nMaxQueued/2)
+		return;
+	
+	CurlPoller* poller = CurlPoller::instance();
+	foreach(Stream* stream, m_waiting)
+	{
+		if(stream->m_user && poller)
+			poller->pauseTransfer(stream->m_user, false);
+	}
+	m_waiting.clear();
+}
+
+int DiskWriter::collectBatches(Batch* batches, Stream** streams)
+{
+	int count = 0;
+	// no more buffers of the stream may be taken in this round
+	bool full[MaxBatches];
+	// where the batch ends
+	qlonglong end[MaxBatches];
+	
+	// at most one batch per stream, buffers of a stream are queued in the order of their offsets
+	for(int i=0;i<m_queue.size();)
+	{
+		Buffer* buf = m_queue[i];
+		Stream* stream = buf->stream;
+		int b = 0;
+		
+		while(b < count && streams[b] != stream)
+			b++;
+		
+		if(b == count)
+		{
+			if(count == MaxBatches)
+			{
+				i++;
+				continue;
+			}
+			
+			count++;
+			full[b] = false;
+			end[b] = buf->offset;
+			streams[b] = stream;
+			batches[b].fd = stream->m_fd;
+			batches[b].offset = buf->offset;
+			batches[b].count = 0;
+			batches[b].sync = false;
+			// a failed stream isn't written to anymore, the transfer is going to be stopped anyway
+			batches[b].error = stream->m_error;
+		}
+		
+		Batch& batch = batches[b];
+		// a skipped part of the stream can't be written as a part of the same batch
+		if(batch.count == MaxCoalesce || (buf->data && buf->offset != end[b]))
+			full[b] = true;
+		if(full[b] || batch.sync)
+		{
+			i++;
+			continue;
+		}
+		
+		m_queue.removeAt(i);
+		
+		if(buf->data)
+		{
+			batch.buffers[batch.count++] = buf;
+			end[b] += buf->used;
+		}
+		else
+		{
+			batch.sync = true;
+			delete buf;
+		}
+	}
+	
+	return count;
+}
+
+bool DiskWriter::needsCheckpoint() const
+{
+	foreach(Stream* stream, m_streams)
+	{
+		if(stream->m_journal && !stream->m_error && !stream->m_unjournaled.isEmpty())
+			return true;
+	}
+	return false;
+}
+
+void DiskWriter::checkpoint()
+{
+	QList<ResumeJournal*> journals;
+	
+	m_lock.lock();
+	QList<Stream*> streams = m_streams;
+	m_lock.unlock();
+	
+	// streams are only deleted by this thread, m_unjournaled and m_error are only changed by it too
+	foreach(Stream* stream, streams)
+	{
+		if(!stream->m_journal || stream->m_error || stream->m_unjournaled.isEmpty())
+			continue;
+		
+		// the data must be on the disk before the journal claims it is
+		if(fdatasync(stream->m_fd) != 0)
+		{
+			qDebug() << "DiskWriter: fdatasync failed:" << strerror(errno);
+			continue;
+		}
+		
+		recordWritten(stream);
+		
+		if(!journals.contains(stream->m_journal))
+			journals << stream->m_journal;
+	}
+	
+	foreach(ResumeJournal* journal, journals)
+		journal->commit();
+}
+
+void DiskWriter::finishStream(Stream* stream, const Batch& batch)
+{
+	if(stream->m_journal)
+	{
+		// the batch has been synced by the backend already
+		if(!batch.error && !stream->m_error)
+		{
+			addWritten(stream, batch);
+			recordWritten(stream);
+			stream->m_journal->commit();
+		}
+		
+		stream->m_journal->deref();
+		stream->m_journal = 0;
+	}
+	if(stream->m_hash)
+	{
+		stream->m_hash->deref();
+		stream->m_hash = 0;
+	}
+	if(stream->m_pieces)
+	{
+		stream->m_pieces->deref();
+		stream->m_pieces = 0;
+	}
+	
+	::close(batch.fd);
+}
+
+void DiskWriter::hashWritten(Stream* stream, const Batch& batch)
+{
+	if(batch.error)
+		return;
+	
+	qlonglong bytes = 0;
+	for(int j=0;j<batch.count;j++)
+	{
+		Buffer* buf = batch.buffers[j];
+		if(stream->m_hash)
+			stream->m_hash->written(buf->offset, buf->data, buf->used);
+		bytes += buf->used;
+	}
+	
+	// the batch is contiguous
+	if(stream->m_pieces && bytes)
+		stream->m_pieces->written(batch.offset, bytes);
+}
+
+void DiskWriter::addWritten(Stream* stream, const Batch& batch)
+{
+	qlonglong bytes = 0;
+	for(int j=0;j<batch.count;j++)
+		bytes += batch.buffers[j]->used;
+	
+	if(!bytes)
+		return;
+	
+	QList<QPair<qlonglong,qlonglong> >& list = stream->m_unjournaled;
+	if(!list.isEmpty() && list.last().first + list.last().second == batch.offset)
+		list.last().second += bytes;
+	else
+		list << qMakePair(batch.offset, bytes);
+}
+
+void DiskWriter::recordWritten(Stream* stream)
+{
+	typedef QPair<qlonglong,qlonglong> Range;
+	
+	foreach(Range r, stream->m_unjournaled)
+		stream->m_journal->record(r.first, r.second);
+	stream->m_unjournaled.clear();
+}
+
+void DiskWriter::run()
+{
+	QMutexLocker locker(&m_lock);
+	Batch batches[MaxBatches];
+	Stream* streams[MaxBatches];
+	
+	while(true)
+	{
+		if(m_clock.elapsed() >= m_nextCheckpoint)
+		{
+			locker.unlock();
+			checkpoint();
+			locker.relock();
+			m_nextCheckpoint = m_clock.elapsed() + m_nCheckpointInterval;
+		}
+		
+		if(m_queue.isEmpty() && !m_bAbort)
+		{
+			// don't wake up periodically just to find out there's nothing to record
+			if(needsCheckpoint())
+				m_cond.wait(&m_lock, qMax<qint64>(m_nextCheckpoint - m_clock.elapsed(), 1));
+			else
+			{
+				m_cond.wait(&m_lock);
+				m_nextCheckpoint = qMax(m_nextCheckpoint, m_clock.elapsed() + m_nCheckpointInterval);
+			}
+			continue;
+		}
+		if(m_queue.isEmpty())
+			break;
+		
+		switchHashes();
+		int count = collectBatches(batches, streams);
+		
+		locker.unlock();
+		writeBatches(batches, count);
+		for(int i=0;i<count;i++)
+		{
+			hashWritten(streams[i], batches[i]);
+			if(batches[i].sync)
+				finishStream(streams[i], batches[i]);
+		}
+		locker.relock();
+		
+		for(int i=0;i<count;i++)
+		{
+			Batch& batch = batches[i];
+			Stream* stream = streams[i];
+			
+			if(batch.error && !stream->m_error)
+			{
+				qDebug() << "DiskWriter: write failed:" << strerror(batch.error);
+				stream->m_error = batch.error;
+			}
+			
+			// the closing batch has been recorded by finishStream() already
+			if(stream->m_journal && !stream->m_error && !batch.sync)
+				addWritten(stream, batch);
+			
+			for(int j=0;j<batch.count;j++)
+			{
+				if(!stream->m_error)
+					stream->m_nWritten += batch.buffers[j]->used;
+				freeBuffer(batch.buffers[j]);
+			}
+			
+			int done = batch.count + (batch.sync ? 1 : 0);
+			m_nQueued -= done;
+			stream->m_nPending -= done;
+			
+			if(!stream->m_holds.isEmpty())
+				releaseHashes(stream);
+			
+			if(batch.sync)
+			{
+				if(stream->m_newHash)
+					stream->m_newHash->deref();
+				m_streams.removeAll(stream);
+				delete stream;
+			}
+		}
+		
+		wakeWaiting();
+		
+		// sync() waits for particular files
+		m_drained.wakeAll();
+	}
+}
+
+void DiskWriter::writeBatches(Batch* batches, int count)
+{
+	for(int i=0;i<count;i++)
+	{
+		Batch& batch = batches[i];
+		if(batch.error)
+			continue;
+		
+		if(batch.count)
+			batch.error = writeBuffers(batch.fd, batch.offset, batch.buffers, batch.count);
+		if(!batch.error && batch.sync && fdatasync(batch.fd) != 0)
+			batch.error = errno;
+	}
+}
+
+int DiskWriter::writeBuffers(int fd, qlonglong offset, Buffer** bufs, int count)
+{
+#ifdef HAVE_PWRITEV
+	struct iovec iov[MaxCoalesce];
+	int first = 0;
+	
+	for(int i=0;i<count;i++)
+	{
+		iov[i].iov_base = bufs[i]->data;
+		iov[i].iov_len = bufs[i]->used;
+	}
+	
+	while(first < count)
+	{
+		ssize_t written = pwritev64(fd, iov+first, count-first, offset);
+		
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return errno;
+		}
+		else if(!written)
+			return EIO;
+		
+		offset += written;
+		
+		// skip what has been written already, a short write leaves a partial buffer
+		while(first < count && size_t(written) >= iov[first].iov_len)
+			written -= iov[first++].iov_len;
+		if(first < count)
+		{
+			iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+			iov[first].iov_len -= written;
+		}
+	}
+#else
+	for(int i=0;i<count;i++)
+	{
+		const char* data = bufs[i]->data;
+		size_t left = bufs[i]->used;
+		
+		while(left > 0)
+		{
+			ssize_t written = pwrite64(fd, data, left, offset);
+			
+			if(written < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				return errno;
+			}
+			else if(!written)
+				return EIO;
+			
+			data += written;
+			left -= written;
+			offset += written;
+		}
+	}
+#endif
+	return 0;
+}
+
+DiskWriter::Stream::Stream(DiskWriter* writer, int fd, qlonglong offset, CurlUser* user, ResumeJournal* journal,
+	StreamingHash* hash, PieceHashes* pieces)
+	: m_writer(writer), m_fd(fd), m_offset(offset), m_current(0), m_journal(journal), m_hash(hash), m_pieces(pieces),
+	m_user(user), m_nPending(0), m_error(0), m_nWritten(0), m_nSubmitted(0), m_newHash(0)
+{
+	struct stat st;
+	
+	if(fstat(fd, &st) == 0)
+	{
+		m_dev = st.st_dev;
+		m_ino = st.st_ino;
+	}
+	else
+		m_dev = m_ino = 0;
+	
+	if(m_journal)
+		m_journal->ref();
+	if(m_hash)
+		m_hash->ref();
+	if(m_pieces)
+		m_pieces->ref();
+}
+
+bool DiskWriter::Stream::write(const char* data, size_t bytes)
+{
+	size_t bufferSize = m_writer->m_nBufferSize;
+	size_t room = m_current ? bufferSize - m_current->used : 0;
+	
+	// decided up front, curl passes the very same data again after unpausing
+	if(bytes > room && !m_writer->mayQueue(this))
+		return false;
+	
+	while(bytes > 0)
+	{
+		if(!m_current)
+			m_current = m_writer->allocBuffer(this);
+		
+		size_t chunk = qMin(bytes, bufferSize - m_current->used);
+		memcpy(m_current->data + m_current->used, data, chunk);
+		
+		m_current->used += chunk;
+		m_offset += chunk;
+		data += chunk;
+		bytes -= chunk;
+		
+		if(m_current->used == bufferSize)
+			flush();
+	}
+	
+	return true;
+}
+
+void DiskWriter::Stream::flush()
+{
+	if(m_current && m_current->used)
+	{
+		m_writer->submit(m_current);
+		m_current = 0;
+	}
+}
+
+void DiskWriter::Stream::seek(qlonglong offset)
+{
+	if(offset == m_offset)
+		return;
+	flush();
+	m_offset = offset;
+}
+
+void DiskWriter::Stream::close()
+{
+	flush();
+	m_writer->closeStream(this);
+}
+
+int DiskWriter::Stream::error() const
+{
+	QMutexLocker locker(&m_writer->m_lock);
+	return m_error;
+}
+
+qlonglong DiskWriter::Stream::written() const
+{
+	QMutexLocker locker(&m_writer->m_lock);
+	return m_nWritten;
+}
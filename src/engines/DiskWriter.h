@@ -0,0 +1,214 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef DISKWRITER_H
+#define DISKWRITER_H
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QList>
+#include <QPair>
+#include <QElapsedTimer>
+#include <QString>
+#include <sys/types.h>
+
+class CurlUser;
+class ResumeJournal;
+class StreamingHash;
+class PieceHashes;
+
+// Write-behind stage between the polling threads and the disk.
+// Downloaded data is copied into pooled, page-aligned buffers and written out
+// by a dedicated thread with positional writes, so a slow disk never blocks
+// the polling threads. Consecutive buffers of a stream are coalesced into
+// a single write and a closed stream is synced to the disk before its file is closed.
+// Once too much data is waiting to be written, Stream::write() refuses to take
+// any more and the caller is expected to pause its transfer. The transfer gets
+// unpaused via CurlPoller::pauseTransfer() when there's room again.
+// Streams with a ResumeJournal get their written data synced and recorded
+// in the journal every httpftp/journal_interval seconds.
+// Streams with a StreamingHash pass it all the data once it has been written,
+// streams with PieceHashes report the written ranges to it.
+class DiskWriter : public QThread
+{
+public:
+	// Picks the best backend the system supports, the writer is already running
+	static DiskWriter* createInstance();
+	virtual ~DiskWriter();
+	
+	class Stream;
+	// The stream takes over the file descriptor and writes from the given offset on.
+	// The user is unpaused when the stream may write again, pass 0 if it isn't needed.
+	// The journal and the hashes are referenced until the stream has been closed.
+	Stream* openStream(int fd, qlonglong offset, CurlUser* user, ResumeJournal* journal = 0,
+		StreamingHash* hash = 0, PieceHashes* pieces = 0);
+	// Waits until the data queued so far for the file has been written, other files' data isn't waited for
+	void sync(QString path);
+	// Hands the hash to the streams of the file that are still open, replacing theirs. Whatever they haven't
+	// written yet is passed to it. The hash is held (see StreamingHash::hold()) until the data the streams
+	// of the file had been given before has been written.
+	void attachHash(QString path, StreamingHash* hash);
+	
+	static DiskWriter* instance() { return m_instance; }
+protected:
+	DiskWriter();
+	
+	// the most buffers merged into a single write
+	enum { MaxCoalesce = 32 };
+	// the most streams handled in one round
+	enum { MaxBatches = 32 };
+	
+	struct Buffer
+	{
+		// 0 for the marker closing the stream
+		char* data;
+		size_t used;
+		qlonglong offset;
+		Stream* stream;
+	};
+	// Consecutive buffers of a single stream
+	struct Batch
+	{
+		int fd;
+		qlonglong offset;
+		Buffer* buffers[MaxCoalesce];
+		int count;
+		// the stream is being closed, sync it after writing
+		bool sync;
+		// errno, set by the backend
+		int error;
+	};
+	
+	virtual void run();
+	// Makes the thread finish the queue and exit, to be called by subclasses before they release their resources
+	void stop();
+	// Called without m_lock held, must fill in Batch::error
+	virtual void writeBatches(Batch* batches, int count);
+	// The plain blocking way
+	static int writeBuffers(int fd, qlonglong offset, Buffer** bufs, int count);
+	
+	int collectBatches(Batch* batches, Stream** streams);
+	Buffer* allocBuffer(Stream* stream);
+	// m_lock must be held
+	void freeBuffer(Buffer* buf);
+	// Decides whether the stream may queue another buffer, registers it for unpausing otherwise
+	bool mayQueue(Stream* stream);
+	void submit(Buffer* buf);
+	void closeStream(Stream* stream);
+	// m_lock must be held
+	void wakeWaiting();
+	// m_lock must be held
+	bool needsCheckpoint() const;
+	// Whether a stream of the file has buffers left to write, m_lock must be held
+	bool hasPending(dev_t dev, ino_t ino) const;
+	// Syncs the data written so far and records it in the journals, called without m_lock held
+	void checkpoint();
+	// Gives the streams the hashes passed to attachHash(), m_lock must be held
+	void switchHashes();
+	// Releases the hashes that have been waiting for the stream's data, m_lock must be held
+	static void releaseHashes(Stream* stream);
+	// Records the rest of a closed stream and closes its file, called without m_lock held
+	void finishStream(Stream* stream, const Batch& batch);
+	// Used by the writer thread only
+	static void addWritten(Stream* stream, const Batch& batch);
+	static void recordWritten(Stream* stream);
+	// Called without m_lock held
+	static void hashWritten(Stream* stream, const Batch& batch);
+public:
+	// Not thread safe, every stream is expected to be fed from a single thread at a time.
+	class Stream
+	{
+	public:
+		// Either takes all the data or none of it (returns false) if the write queue is full
+		bool write(const char* data, size_t bytes);
+		// Queues a partially filled buffer
+		void flush();
+		// Continues writing at another offset, the data in between is written by someone else
+		void seek(qlonglong offset);
+		// Flushes and releases the stream, the file gets synced and closed once all data has been written.
+		// The stream must not be used afterwards.
+		void close();
+		// errno of a failed write, 0 if everything's fine
+		int error() const;
+		// Bytes actually written to the disk
+		qlonglong written() const;
+	private:
+		Stream(DiskWriter* writer, int fd, qlonglong offset, CurlUser* user, ResumeJournal* journal,
+			StreamingHash* hash, PieceHashes* pieces);
+		
+		DiskWriter* m_writer;
+		int m_fd;
+		// identify the file for sync()
+		dev_t m_dev;
+		ino_t m_ino;
+		qlonglong m_offset;
+		Buffer* m_current;
+		ResumeJournal* m_journal;
+		StreamingHash* m_hash;
+		PieceHashes* m_pieces;
+		// written but not recorded in the journal yet (offset, bytes), used by the writer thread only
+		QList<QPair<qlonglong,qlonglong> > m_unjournaled;
+		
+		// the following are guarded by DiskWriter::m_lock
+		CurlUser* m_user;
+		int m_nPending;
+		int m_error;
+		qlonglong m_nWritten;
+		// buffers and markers queued so far
+		int m_nSubmitted;
+		// to replace m_hash, see attachHash()
+		StreamingHash* m_newHash;
+		// held until this many buffers and markers have been written
+		QList<QPair<StreamingHash*,int> > m_holds;
+		
+		friend class DiskWriter;
+	};
+protected:
+	static DiskWriter* m_instance;
+	
+	bool m_bAbort;
+	size_t m_nBufferSize;
+	int m_nMaxQueued;
+	// ms
+	int m_nCheckpointInterval;
+	QElapsedTimer m_clock;
+	qint64 m_nextCheckpoint;
+	
+	mutable QMutex m_lock;
+	QWaitCondition m_cond, m_drained;
+	QList<Buffer*> m_queue;
+	QList<Buffer*> m_pool;
+	QList<Stream*> m_waiting;
+	// streams that haven't been finished yet
+	QList<Stream*> m_streams;
+	// buffers submitted but not written yet, including those being written right now
+	int m_nQueued;
+	// a stream has got a hash to switch to
+	bool m_bNewHashes;
+};
+
+#endif
@@ -110,14 +110,7 @@ void HttpOptsWidget::accepted()
 					}
 				}
 			}
-			for(QList<int>::iterator it = m_download->m_listActiveSegments.begin();
-			it != m_download->m_listActiveSegments.end(); it++)
-			{
-				if (*it == op.index)
-					it = m_download->m_listActiveSegments.erase(it);
-				else if (*it > op.index)
-					*it--;
-			}
+			m_download->urlRemoved(op.index);
 			break;
 		}
 	}
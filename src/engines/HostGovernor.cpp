@@ -0,0 +1,209 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "config.h"
+#include "HostGovernor.h"
+#include "Settings.h"
+#include <QMetaObject>
+#include <QtDebug>
+
+HostGovernor* HostGovernor::m_instance = 0;
+
+HostGovernor::HostGovernor()
+{
+	m_instance = this;
+}
+
+HostGovernor::~HostGovernor()
+{
+	m_instance = 0;
+}
+
+bool HostGovernor::isFree(const QString& host) const
+{
+	const int hostLimit = getSettingsValue("httpftp/host_connections").toInt();
+	const int addressLimit = getSettingsValue("httpftp/address_connections").toInt();
+	
+	if(hostLimit > 0 && m_hosts.value(host) >= hostLimit)
+		return false;
+	
+	QString address = m_addresses.value(host);
+	if(addressLimit > 0 && !address.isEmpty())
+	{
+		int count = 0;
+		for(QHash<QString,QString>::const_iterator it = m_addresses.constBegin(); it != m_addresses.constEnd(); it++)
+		{
+			if(it.value() == address)
+				count += m_hosts.value(it.key());
+		}
+		if(count >= addressLimit)
+			return false;
+	}
+	
+	return true;
+}
+
+void HostGovernor::take(const QString& host)
+{
+	m_hosts[host]++;
+}
+
+bool HostGovernor::acquire(QString host, QObject* owner)
+{
+	QMutexLocker l(&m_lock);
+	
+	// the queued requests go first
+	if(!m_waiting.contains(host) && isFree(host))
+	{
+		take(host);
+		return true;
+	}
+	
+	Waiting& waiting = m_waiting[host];
+	if(!waiting.requests.contains(owner))
+		waiting.owners << owner;
+	waiting.requests[owner]++;
+	
+	qDebug() << "HostGovernor: a connection to" << host << "has to wait," << m_hosts.value(host) << "open";
+	return false;
+}
+
+bool HostGovernor::tryAcquire(QString host)
+{
+	QMutexLocker l(&m_lock);
+	
+	if(m_waiting.contains(host) || !isFree(host))
+		return false;
+	
+	take(host);
+	return true;
+}
+
+void HostGovernor::release(QString host)
+{
+	QMutexLocker l(&m_lock);
+	QHash<QString,int>::iterator it = m_hosts.find(host);
+	
+	if(it == m_hosts.end())
+		return;
+	if(--it.value() <= 0)
+		m_hosts.erase(it);
+	
+	grantWaiting();
+}
+
+bool HostGovernor::claim(QObject* owner, QString host)
+{
+	QMutexLocker l(&m_lock);
+	QHash<QObject*, QStringList>::iterator it = m_granted.find(owner);
+	
+	if(it == m_granted.end() || !it->removeOne(host))
+		return false;
+	if(it->isEmpty())
+		m_granted.erase(it);
+	return true;
+}
+
+void HostGovernor::cancel(QObject* owner)
+{
+	QMutexLocker l(&m_lock);
+	QStringList granted = m_granted.take(owner);
+	
+	foreach(QString host, granted)
+	{
+		QHash<QString,int>::iterator it = m_hosts.find(host);
+		if(it != m_hosts.end() && --it.value() <= 0)
+			m_hosts.erase(it);
+	}
+	
+	for(QHash<QString,Waiting>::iterator it = m_waiting.begin(); it != m_waiting.end();)
+	{
+		it->owners.removeAll(owner);
+		it->requests.remove(owner);
+		
+		if(it->owners.isEmpty())
+			it = m_waiting.erase(it);
+		else
+			it++;
+	}
+	
+	if(!granted.isEmpty())
+		grantWaiting();
+}
+
+void HostGovernor::learnAddress(QString host, QString address)
+{
+	QMutexLocker l(&m_lock);
+	
+	if(!address.isEmpty())
+		m_addresses[host] = address;
+}
+
+void HostGovernor::grantWaiting()
+{
+	// another host may be waiting for the same address
+	for(QHash<QString,Waiting>::iterator it = m_waiting.begin(); it != m_waiting.end();)
+	{
+		Waiting& waiting = *it;
+		
+		while(!waiting.owners.isEmpty() && isFree(it.key()))
+		{
+			QObject* owner = waiting.owners.takeFirst();
+			
+			// round-robin, the owner waits for its next turn
+			if(--waiting.requests[owner] <= 0)
+				waiting.requests.remove(owner);
+			else
+				waiting.owners << owner;
+			
+			take(it.key());
+			m_granted[owner] << it.key();
+			QMetaObject::invokeMethod(owner, "hostGranted", Qt::QueuedConnection, Q_ARG(QString, it.key()));
+		}
+		
+		if(waiting.owners.isEmpty())
+			it = m_waiting.erase(it);
+		else
+			it++;
+	}
+}
+
+QMap<QString,int> HostGovernor::connections() const
+{
+	QMutexLocker l(&m_lock);
+	QMap<QString,int> retval;
+	
+	for(QHash<QString,int>::const_iterator it = m_hosts.constBegin(); it != m_hosts.constEnd(); it++)
+		retval[it.key()] = it.value();
+	return retval;
+}
+
+int HostGovernor::connections(QString host) const
+{
+	QMutexLocker l(&m_lock);
+	return m_hosts.value(host);
+}
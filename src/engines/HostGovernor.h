@@ -0,0 +1,95 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef HOSTGOVERNOR_H
+#define HOSTGOVERNOR_H
+#include <QObject>
+#include <QMutex>
+#include <QHash>
+#include <QMap>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+// Caps the connections open to a host (and to an address shared by several host names)
+// across all downloads, so that many transfers from the same server don't trip its limits.
+// Segment starts over the cap wait in a queue and are granted round-robin over the transfers,
+// as the connections are closed. To be used from the main thread only.
+class HostGovernor : public QObject
+{
+Q_OBJECT
+public:
+	HostGovernor();
+	~HostGovernor();
+	
+	static HostGovernor* instance() { return m_instance; }
+	
+	// Takes a connection slot for the host. If there's none free, the request is queued and
+	// the owner's hostGranted(QString) slot is invoked with the host once it gets one, the owner
+	// has to claim() it then. The grant is keyed by the host only, as the owner's URLs may change
+	// in the meantime - the owner releases it if it has nothing to use it for anymore.
+	bool acquire(QString host, QObject* owner);
+	// Returns false if the granted slot has been taken back by cancel() in the meantime
+	bool claim(QObject* owner, QString host);
+	// Takes a slot only if there's one free right now
+	bool tryAcquire(QString host);
+	void release(QString host);
+	// Drops the queued requests of the owner and the slots it hasn't claimed yet,
+	// must be called before the owner is deleted
+	void cancel(QObject* owner);
+	// The address the host name resolves to, as seen by a connection
+	void learnAddress(QString host, QString address);
+	
+	// Open connections per host, published over XML-RPC (see CurlDownload::getHostStats())
+	QMap<QString,int> connections() const;
+	int connections(QString host) const;
+private:
+	bool isFree(const QString& host) const;
+	void take(const QString& host);
+	// Hands the free slots over to the queued requests
+	void grantWaiting();
+private:
+	static HostGovernor* m_instance;
+	
+	struct Waiting
+	{
+		// the owners in the order they're served
+		QList<QObject*> owners;
+		// the number of queued requests of every owner
+		QHash<QObject*, int> requests;
+	};
+	
+	mutable QMutex m_lock;
+	QHash<QString,int> m_hosts;
+	QHash<QString,QString> m_addresses;
+	QHash<QString,Waiting> m_waiting;
+	// slots granted but not claimed yet, by owner
+	QHash<QObject*, QStringList> m_granted;
+};
+
+#endif
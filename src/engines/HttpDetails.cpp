@@ -65,6 +65,9 @@ void HttpDetails::addSegment()
 	QAction* act = static_cast<QAction*>(sender());
 	int urlIndex = act->data().toInt();
 	m_download->m_listActiveSegments << urlIndex;
+	if (!m_download->m_listUserSegments.isEmpty())
+		m_download->m_listUserSegments << urlIndex;
+	m_download->markDirty();
 	if (m_download->isActive() && m_download->total())
 		m_download->startSegment(urlIndex);
 	refresh();
@@ -82,6 +85,8 @@ void HttpDetails::deleteSegment()
 		m_download->stopSegment(segIndex);
 	}
 	m_download->m_listActiveSegments.removeOne(urlIndex);
+	m_download->m_listUserSegments.removeOne(urlIndex);
+	m_download->markDirty();
 	delete item;
 }
 
@@ -107,6 +112,7 @@ void HttpDetails::addUrl()
 
 	listUrls->addItem(dlg.m_strURL);
 	m_download->m_urls << obj;
+	m_download->markDirty();
 }
 
 void HttpDetails::editUrl()
@@ -142,6 +148,7 @@ void HttpDetails::editUrl()
 		obj.strBindAddress = dlg.m_strBindAddress;
 
 		listUrls->item(row)->setText(dlg.m_strURL);
+		m_download->markDirty();
 
 		if (m_download->isActive())
 		{
@@ -194,14 +201,7 @@ void HttpDetails::deleteUrl()
 					s.urlIndex--;
 			}
 		}
-		for (int i = 0; i < m_download->m_listActiveSegments.size(); i++)
-		{
-			int& n = m_download->m_listActiveSegments[i];
-			if (n > row)
-				n--;
-			else if (n == row)
-				m_download->m_listActiveSegments.removeAt(i--);
-		}
+		m_download->urlRemoved(row);
 	}
 }
 
@@ -431,6 +431,7 @@ void HttpDetails::mirrorSearch()
 					m_download->m_urls << obj;
 				}
 			}
+			m_download->markDirty();
 			refresh();
 		}
 	}
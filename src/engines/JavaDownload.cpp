@@ -144,7 +144,7 @@ void JavaDownload::changeActive(bool bActive)
 				s.client = 0;
 
 				m_segments.clear();
-				m_segments << s;
+				m_segments.insert(s);
 			}
 
 			assert(!m_strOriginal.isEmpty());
@@ -184,6 +184,7 @@ void JavaDownload::setObject(QString newdir)
 	if(isActive())
 		CurlDownload::setObject(newdir);
 	m_strTarget = newdir;
+	markDirty();
 }
 
 qulonglong JavaDownload::done() const
@@ -269,7 +270,7 @@ void JavaDownload::startDownload(QString url, QList<QNetworkCookie> cookies, QSt
 			s.client = 0;
 
 			m_segments.clear();
-			m_segments << s;
+			m_segments.insert(s);
 		}
 
 		m_urls[0].cookies = cookies;
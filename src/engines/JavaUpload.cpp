@@ -153,6 +153,7 @@ void JavaUpload::init(QString source, QString target)
 void JavaUpload::setObject(QString source)
 {
 	m_strSource = source;
+	markDirty();
 	m_nTotal = QFileInfo(source).size();
 	
 	// derive name
@@ -199,7 +200,7 @@ void JavaUpload::changeActive(bool nowActive)
 
 void JavaUpload::setSpeedLimits(int, int up)
 {
-	m_up.max = up;
+	setMaxUp(up);
 }
 
 void JavaUpload::speeds(int& down, int& up) const
@@ -380,6 +381,7 @@ void JavaUpload::startUpload(QString url, QList<JavaUpload::MimePart>& parts, qi
 	curl_easy_setopt(m_curl, CURLOPT_URL, ba.constData());
 	curl_easy_setopt(m_curl, CURLOPT_HTTPPOST, m_postData);
 	
+	setShapingQueue(myQueue());
 	CurlPoller::instance()->addTransfer(this);
 }
 
@@ -59,6 +59,8 @@ public:
 	
 	virtual void changeActive(bool nowActive);
 	virtual void setSpeedLimits(int, int up);
+	virtual bool isShaped() const { return true; }
+	virtual void queueChanged(Queue* q) { setShapingQueue(q); }
 	
 	virtual QString object() const { return m_strSource; }
 	virtual QString myClass() const { return m_strClass; }
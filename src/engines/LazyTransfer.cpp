@@ -0,0 +1,270 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "LazyTransfer.h"
+#include "Queue.h"
+#include <QDomDocument>
+#include <QXmlStreamReader>
+#include <QTimer>
+#include <QThread>
+#include <QtDebug>
+
+// How soon the engine object tries again to take over a locked queue, in milliseconds
+static const int TAKEOVER_RETRY = 100;
+
+LazyTransfer::LazyTransfer()
+	: m_nTotal(0), m_nDone(0), m_primaryMode(Download), m_real(0)
+{
+}
+
+LazyTransfer::~LazyTransfer()
+{
+	// it may still be shown in the details or a menu
+	if(m_real)
+		m_real->deleteLater();
+}
+
+LazyTransfer* LazyTransfer::create(const QByteArray& element)
+{
+	QXmlStreamReader reader(element);
+	
+	if(!reader.readNextStartElement())
+		return 0;
+	
+	QXmlStreamAttributes attrs = reader.attributes();
+	QString cls = attrs.value("class").toString();
+	State state = string2state(attrs.value("state").toString());
+	Mode primaryMode = Mode(attrs.value("primarymode").toString().toInt());
+	
+	if(!attrs.hasAttribute("name") || state == Active || state == ForcedActive)
+		return 0;
+	if(getEngineID(cls, primaryMode) < 0)
+		return 0;
+	
+	LazyTransfer* t = new LazyTransfer;
+	
+	t->m_element = element;
+	t->m_strClass = cls;
+	t->m_strName = attrs.value("name").toString();
+	t->m_strObject = attrs.value("object").toString();
+	t->m_strDataPath = attrs.value("datapath").toString();
+	t->m_strDataDir = attrs.value("datadir").toString();
+	t->m_nTotal = attrs.value("total").toString().toULongLong();
+	t->m_nDone = attrs.value("done").toString().toULongLong();
+	t->m_mode = Mode(attrs.value("mode").toString().toInt());
+	t->m_primaryMode = primaryMode;
+	t->m_state = t->m_lastState = state;
+	
+	// what Transfer::load() would read, the engine's own properties are skipped over
+	while(reader.readNextStartElement())
+	{
+		QStringRef tag = reader.name();
+		
+		if(tag == "downlimit")
+			t->m_nDownLimit = t->m_nDownLimitInt = reader.readElementText().toInt();
+		else if(tag == "uplimit")
+			t->m_nUpLimit = t->m_nUpLimitInt = reader.readElementText().toInt();
+		else if(tag == "comment")
+			t->m_strComment = reader.readElementText();
+		else if(tag == "timerunning")
+			t->m_nTimeRunning = reader.readElementText().toLongLong();
+		else if(tag == "uuid")
+			t->m_uuid = QUuid(reader.readElementText());
+		else if(tag == "action")
+		{
+			bool completed = reader.attributes().value("state") == "Completed";
+			QString command = reader.readElementText();
+			
+			if(completed)
+				t->m_strCommandCompleted = command;
+		}
+		else
+			reader.skipCurrentElement();
+	}
+	
+	if(reader.hasError() || t->m_uuid.isNull())
+	{
+		qDebug() << "LazyTransfer::create(): loading in full," << reader.errorString();
+		delete t;
+		return 0;
+	}
+	
+	return t;
+}
+
+void LazyTransfer::saveSummary(const Transfer* t, QDomElement& elem)
+{
+	elem.setAttribute("name", t->name());
+	elem.setAttribute("state", state2string(t->state()));
+	elem.setAttribute("total", QString::number(t->total()));
+	elem.setAttribute("done", QString::number(t->done()));
+	elem.setAttribute("object", t->object());
+	elem.setAttribute("datapath", t->dataPath(true));
+	elem.setAttribute("datadir", t->dataPath(false));
+	elem.setAttribute("mode", QString::number(int(t->mode())));
+	elem.setAttribute("primarymode", QString::number(int(t->primaryMode())));
+}
+
+Transfer* LazyTransfer::engineObject(Transfer* t)
+{
+	LazyTransfer* lazy = qobject_cast<LazyTransfer*>(t);
+	
+	if(lazy && lazy->m_real)
+		return lazy->m_real;
+	return t;
+}
+
+Transfer* LazyTransfer::materialize()
+{
+	if(m_real)
+		return m_real;
+	
+	// the engine object gets its timers and children in this thread, see TransferFactory::materialize()
+	Q_ASSERT(QThread::currentThread() == thread());
+	qDebug() << "Materializing" << m_strName;
+	
+	QDomDocument doc;
+	doc.setContent(m_element);
+	
+	m_real = Transfer::createInstance(m_strClass);
+	
+	// it's been in the loaded state all along, there's nothing to announce
+	bool local = m_real->m_bLocal;
+	m_real->m_bLocal = true;
+	m_real->load(doc.documentElement());
+	m_real->m_bLocal = local;
+	
+	QMetaObject::invokeMethod(this, "takeOver", Qt::QueuedConnection);
+	return m_real;
+}
+
+void LazyTransfer::takeOver()
+{
+	Queue* q = myQueue();
+	if(!q || !m_real)
+		return;
+	
+	// whoever has the queue locked may still be using this object
+	if(!q->tryReplace(this, m_real))
+	{
+		QTimer::singleShot(TAKEOVER_RETRY, this, SLOT(takeOver()));
+		return;
+	}
+	
+	Transfer* real = m_real;
+	m_real = 0;
+	
+	// the generic properties might have been changed since it was loaded
+	real->setUserSpeedLimits(m_nDownLimit, m_nUpLimit);
+	real->m_strComment = m_strComment;
+	real->m_strCommandCompleted = m_strCommandCompleted;
+	real->m_nTimeRunning = m_nTimeRunning;
+	real->markDirty();
+	
+	if(real->state() != m_state)
+		real->setState(m_state);
+}
+
+void LazyTransfer::changeActive(bool nowActive)
+{
+	// the engine object is activated once it has taken over
+	if(nowActive)
+		materialize();
+}
+
+void LazyTransfer::warmUp()
+{
+	// the engine object warms up on its own once it's in the queue
+	materialize();
+}
+
+void LazyTransfer::setObject(QString object)
+{
+	materialize()->setObject(object);
+}
+
+QString LazyTransfer::object() const
+{
+	return m_real ? m_real->object() : m_strObject;
+}
+
+QString LazyTransfer::name() const
+{
+	return m_real ? m_real->name() : m_strName;
+}
+
+QString LazyTransfer::dataPath(bool bDirect) const
+{
+	if(m_real)
+		return m_real->dataPath(bDirect);
+	return bDirect ? m_strDataPath : m_strDataDir;
+}
+
+qulonglong LazyTransfer::total() const
+{
+	return m_real ? m_real->total() : m_nTotal;
+}
+
+qulonglong LazyTransfer::done() const
+{
+	return m_real ? m_real->done() : m_nDone;
+}
+
+void LazyTransfer::save(QDomDocument& doc, QDomNode& map) const
+{
+	QDomDocument stored;
+	stored.setContent(m_element);
+	
+	// the engine's properties are kept as they were, the generic ones are written anew
+	for(QDomElement e = stored.documentElement().firstChildElement(); !e.isNull(); e = e.nextSiblingElement())
+	{
+		QString tag = e.tagName();
+		
+		if(tag == "state" || tag == "downlimit" || tag == "uplimit" || tag == "comment"
+			|| tag == "timerunning" || tag == "uuid" || tag == "action")
+			continue;
+		
+		map.appendChild(doc.importNode(e, true));
+	}
+	
+	Transfer::save(doc, map);
+}
+
+WidgetHostChild* LazyTransfer::createOptionsWidget(QWidget* w)
+{
+	return materialize()->createOptionsWidget(w);
+}
+
+QObject* LazyTransfer::createDetailsWidget(QWidget* w)
+{
+	return materialize()->createDetailsWidget(w);
+}
+
+void LazyTransfer::fillContextMenu(QMenu& menu)
+{
+	materialize()->fillContextMenu(menu);
+}
@@ -0,0 +1,87 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef LAZYTRANSFER_H
+#define LAZYTRANSFER_H
+#include "Transfer.h"
+#include <QByteArray>
+
+// Stand-in for an inactive transfer read from the queue log, so that the transfers
+// kept around after they've finished cost next to nothing at startup.
+// It shows the summary saved along with the transfer and keeps the rest of the stored element.
+// The engine object is only created once the transfer is activated or inspected;
+// it then takes this one's place in the queue as soon as nobody has the queue locked.
+class LazyTransfer : public Transfer
+{
+Q_OBJECT
+public:
+	virtual ~LazyTransfer();
+	
+	// Returns 0 if the transfer has to be loaded in full,
+	// i.e. if it's active, has no summary or its engine isn't available
+	static LazyTransfer* create(const QByteArray& element);
+	// Adds the summary read by create() to the saved element of any transfer
+	static void saveSummary(const Transfer* t, QDomElement& elem);
+	// The engine object of a lazy transfer that has been materialized, t itself otherwise.
+	// It's in the queue instead of the stand-in once nobody has the queue locked.
+	static Transfer* engineObject(Transfer* t);
+	
+	virtual void init(QString, QString) {}
+	virtual void setObject(QString object);
+	virtual QString object() const;
+	virtual QString myClass() const { return m_strClass; }
+	virtual QString name() const;
+	virtual Mode primaryMode() const { return m_primaryMode; }
+	virtual QString dataPath(bool bDirect = true) const;
+	virtual void speeds(int& down, int& up) const { down = up = 0; }
+	virtual qulonglong total() const;
+	virtual qulonglong done() const;
+	virtual void warmUp();
+	
+	virtual void save(QDomDocument& doc, QDomNode& map) const;
+	
+	virtual WidgetHostChild* createOptionsWidget(QWidget* w);
+	virtual QObject* createDetailsWidget(QWidget* w);
+	virtual void fillContextMenu(QMenu& menu);
+public slots:
+	// Creates and loads the engine object if it doesn't exist yet
+	Transfer* materialize();
+protected slots:
+	void takeOver();
+protected:
+	LazyTransfer();
+	virtual void changeActive(bool nowActive);
+	virtual void setSpeedLimits(int, int) {}
+private:
+	QByteArray m_element;
+	QString m_strClass, m_strName, m_strObject, m_strDataPath, m_strDataDir;
+	qulonglong m_nTotal, m_nDone;
+	Mode m_primaryMode;
+	Transfer* m_real;
+};
+
+#endif
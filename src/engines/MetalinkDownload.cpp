@@ -160,6 +160,40 @@ void MetalinkDownload::save(QDomDocument& doc, QDomNode& map) const
 	setXMLProperty(doc, map, "target", m_strTarget);
 }
 
+void MetalinkDownload::parsePieces(const QDomElement& elem, MetaFile& metaFile)
+{
+	QDomElement hash;
+	int count = 0;
+
+	metaFile.pieceType = elem.attribute("type");
+	metaFile.pieceLength = elem.attribute("length").toLongLong();
+	metaFile.pieces.clear();
+
+	for (hash = elem.firstChildElement("hash"); !hash.isNull(); hash = hash.nextSiblingElement("hash"))
+		count++;
+
+	for (hash = elem.firstChildElement("hash"); !hash.isNull(); hash = hash.nextSiblingElement("hash"))
+	{
+		bool ok;
+		int index = hash.attribute("piece", QString::number(metaFile.pieces.size())).toInt(&ok);
+
+		// the file comes from the network, every piece has its own <hash>
+		if (!ok || index < 0 || index >= count)
+		{
+			metaFile.pieces.clear();
+			return;
+		}
+
+		while (metaFile.pieces.size() <= index)
+			metaFile.pieces << QByteArray();
+		metaFile.pieces[index] = hash.text().trimmed().toLatin1();
+	}
+
+	// with a piece missing, none of them can be located reliably
+	if (metaFile.pieceLength <= 0 || metaFile.pieces.contains(QByteArray()))
+		metaFile.pieces.clear();
+}
+
 void MetalinkDownload::processMetalink(QString fileName)
 {
 	QFile file(fileName);
@@ -189,6 +223,7 @@ void MetalinkDownload::processMetalink(QString fileName)
 		MetaFile metaFile;
 		metaFile.name = dfile.attribute("name");
 		metaFile.fileSize = 0;
+		metaFile.pieceLength = 0;
 
 		metaFile.hasHTTP = metaFile.hasTorrent = false;
 
@@ -236,16 +271,21 @@ void MetalinkDownload::processMetalink(QString fileName)
 			else if (tagName == "hash")
 			{
 				QString htype = elem.attribute("type");
-				//if (htype == "sha-256")
-				//	hashSHA256 = elem.text();
-				//else
-				if (htype == "sha-1")
+				if (htype == "sha-256")
+					metaFile.hashSHA256 = elem.text();
+				else if (htype == "sha-1")
 					metaFile.hashSHA1 = elem.text();
 				else if (htype == "md5")
 					metaFile.hashMD5 = elem.text();
 			}
+			else if (tagName == "pieces")
+				parsePieces(elem, metaFile);
 			else if (tagName == "verification")
 			{
+				QDomElement pieces = elem.firstChildElement("pieces");
+				if (!pieces.isNull())
+					parsePieces(pieces, metaFile);
+
 				QDomElement hash = elem.firstChildElement("hash");
 				while (!hash.isNull())
 				{
@@ -254,12 +294,21 @@ void MetalinkDownload::processMetalink(QString fileName)
 						metaFile.hashMD5 = hash.text();
 					else if (htype == "sha1")
 						metaFile.hashSHA1 = hash.text();
+					else if (htype == "sha256")
+						metaFile.hashSHA256 = hash.text();
 					hash = hash.nextSiblingElement("hash");
 				}
 			}
 
 			snode = snode.nextSibling();
 		}
+
+		// <size> may come after <pieces>
+		if (metaFile.fileSize > 0 && !metaFile.pieces.isEmpty()
+			&& metaFile.pieces.size() != (metaFile.fileSize + metaFile.pieceLength - 1) / metaFile.pieceLength)
+		{
+			metaFile.pieces.clear();
+		}
 		dfile = dfile.nextSiblingElement("file");
 
 		files << metaFile;
@@ -377,6 +426,16 @@ decide:
 
 			if (t)
 			{
+				// verified while it's being downloaded, the strongest hash is used
+				if (!m.hashSHA256.isEmpty())
+					t->setExpectedHash("sha-256:" + m.hashSHA256);
+				else if (!m.hashSHA1.isEmpty())
+					t->setExpectedHash("sha-1:" + m.hashSHA1);
+				else if (!m.hashMD5.isEmpty())
+					t->setExpectedHash("md5:" + m.hashMD5);
+				if (!m.pieces.isEmpty())
+					t->setPieceHashes(m.pieceType, m.pieceLength, m.pieces);
+
 				if (!i)
 					this->replaceItself(t);
 				else
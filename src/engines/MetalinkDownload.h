@@ -84,11 +84,18 @@ protected:
 		QList<Link> urls;
 		qlonglong fileSize;
 		QString comment;
-		QString hashMD5, hashSHA1;
+		QString hashMD5, hashSHA1, hashSHA256;
+		// <pieces>, the hashes are ordered
+		QString pieceType;
+		qlonglong pieceLength;
+		QList<QByteArray> pieces;
 
 		bool hasHTTP, hasTorrent;
 	};
 
+	// Metalink 3 lists the pieces inside <verification> with their indexes, Metalink 4 just in order
+	static void parsePieces(const QDomElement& elem, MetaFile& metaFile);
+
 private:
 	QString m_strMessage, m_strSource, m_strTarget;
 	QNetworkAccessManager* m_network;
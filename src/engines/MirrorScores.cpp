@@ -0,0 +1,261 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#include "config.h"
+#include "MirrorScores.h"
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QDateTime>
+#include <QStringList>
+#include <QtDebug>
+#include <cstdlib>
+
+MirrorScores* MirrorScores::m_instance = 0;
+
+// weight of a new sample
+static const double SAMPLE_WEIGHT = 0.3;
+// the old results count for less and less, errors included
+static const int MAX_SESSIONS = 50;
+// hosts not seen for this long are forgotten
+static const qint64 MAX_AGE = 90*24*60*60;
+// one in so many picks goes to a mirror that hasn't been tried yet
+static const int EXPLORE_RATIO = 4;
+// how often the changed scores are saved, in seconds
+static const qint64 SAVE_INTERVAL = 60;
+
+MirrorScores::MirrorScores()
+{
+	m_instance = this;
+	m_nLastSave = QDateTime::currentDateTime().toTime_t();
+	load();
+}
+
+MirrorScores::~MirrorScores()
+{
+	save();
+	m_instance = 0;
+}
+
+QString MirrorScores::filePath()
+{
+	return QDir::homePath() + QLatin1String(USER_PROFILE_PATH "/mirrorscores");
+}
+
+void MirrorScores::changed()
+{
+	const qint64 now = QDateTime::currentDateTime().toTime_t();
+	
+	m_lock.lock();
+	bool due = now - m_nLastSave >= SAVE_INTERVAL;
+	if (due)
+		m_nLastSave = now;
+	m_lock.unlock();
+	
+	// a crash doesn't lose what the session has learned
+	if (due)
+		save();
+}
+
+MirrorScores::Host& MirrorScores::host(const QString& name)
+{
+	Host& h = m_hosts[name];
+	h.lastUsed = QDateTime::currentDateTime().toTime_t();
+	return h;
+}
+
+void MirrorScores::recordSpeed(QString name, int bytesPerSec)
+{
+	if (name.isEmpty() || bytesPerSec <= 0)
+		return;
+	
+	QMutexLocker l(&m_lock);
+	Host& h = host(name);
+	
+	if (h.speed > 0)
+		h.speed += (bytesPerSec - h.speed) * SAMPLE_WEIGHT;
+	else
+		h.speed = bytesPerSec;
+	
+	l.unlock();
+	changed();
+}
+
+void MirrorScores::recordLatency(QString name, int msecs)
+{
+	if (name.isEmpty() || msecs <= 0)
+		return;
+	
+	QMutexLocker l(&m_lock);
+	Host& h = host(name);
+	
+	if (h.latency > 0)
+		h.latency += (msecs - h.latency) * SAMPLE_WEIGHT;
+	else
+		h.latency = msecs;
+	
+	l.unlock();
+	changed();
+}
+
+void MirrorScores::recordResult(QString name, bool failed)
+{
+	if (name.isEmpty())
+		return;
+	
+	QMutexLocker l(&m_lock);
+	Host& h = host(name);
+	
+	if (h.sessions >= MAX_SESSIONS)
+	{
+		h.sessions /= 2;
+		h.errors /= 2;
+	}
+	
+	h.sessions++;
+	if (failed)
+		h.errors++;
+	
+	l.unlock();
+	changed();
+}
+
+void MirrorScores::recordRanges(QString name, bool supported)
+{
+	if (name.isEmpty())
+		return;
+	
+	QMutexLocker l(&m_lock);
+	host(name).ranges = supported ? 1 : 0;
+	
+	l.unlock();
+	changed();
+}
+
+double MirrorScores::score(QString name) const
+{
+	QMutexLocker l(&m_lock);
+	QHash<QString, Host>::const_iterator it = m_hosts.constFind(name);
+	
+	if (it == m_hosts.constEnd() || it->speed <= 0)
+		return -1;
+	
+	double errorRate = double(it->errors) / (it->sessions + 1);
+	double score = it->speed * (1 - errorRate) / (1 + it->latency / 1000);
+	
+	// a mirror without ranges is good for a single connection at most
+	if (!it->ranges)
+		score /= 10;
+	return score;
+}
+
+int MirrorScores::pick(const QList<QUrl>& urls, int fallback) const
+{
+	QList<int> untried;
+	int best = -1;
+	double bestScore = 0;
+	
+	for (int i = 0; i < urls.size(); i++)
+	{
+		double s = score(urls[i].host());
+		
+		if (s < 0)
+			untried << i;
+		else if (best < 0 || s > bestScore)
+		{
+			best = i;
+			bestScore = s;
+		}
+	}
+	
+	if (!untried.isEmpty() && (best < 0 || qrand() % EXPLORE_RATIO == 0))
+	{
+		if (untried.contains(fallback))
+			return fallback;
+		return untried[qrand() % untried.size()];
+	}
+	
+	return (best < 0) ? fallback : best;
+}
+
+void MirrorScores::load()
+{
+	QFile file(filePath());
+	if (!file.open(QIODevice::ReadOnly))
+		return;
+	
+	const qint64 now = QDateTime::currentDateTime().toTime_t();
+	QTextStream in(&file);
+	
+	while (!in.atEnd())
+	{
+		// host speed latency sessions errors ranges lastused
+		QStringList parts = in.readLine().split('\t');
+		if (parts.size() != 7)
+			continue;
+		
+		Host h;
+		h.speed = parts[1].toDouble();
+		h.latency = parts[2].toDouble();
+		h.sessions = parts[3].toInt();
+		h.errors = parts[4].toInt();
+		h.ranges = parts[5].toInt();
+		h.lastUsed = parts[6].toLongLong();
+		
+		if (now - h.lastUsed < MAX_AGE)
+			m_hosts[parts[0]] = h;
+	}
+}
+
+void MirrorScores::save() const
+{
+	// the old scores stay if it's interrupted
+	QSaveFile file(filePath());
+	QDir().mkpath(QFileInfo(file.fileName()).path());
+	
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+	{
+		qDebug() << "MirrorScores: cannot save" << file.fileName();
+		return;
+	}
+	
+	QMutexLocker l(&m_lock);
+	QTextStream out(&file);
+	
+	for (QHash<QString, Host>::const_iterator it = m_hosts.constBegin(); it != m_hosts.constEnd(); it++)
+	{
+		out << it.key() << '\t' << it->speed << '\t' << it->latency << '\t' << it->sessions << '\t'
+			<< it->errors << '\t' << it->ranges << '\t' << it->lastUsed << '\n';
+	}
+	
+	out.flush();
+	if (!file.commit())
+		qDebug() << "MirrorScores: cannot save" << file.fileName();
+}
@@ -0,0 +1,91 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef MIRRORSCORES_H
+#define MIRRORSCORES_H
+#include <QMutex>
+#include <QHash>
+#include <QString>
+#include <QList>
+#include <QUrl>
+
+// Performance of mirrors as seen by real transfers, kept per host across restarts,
+// saved every now and then as they change and on exit.
+// New connections are steered to the best scoring mirrors, mirrors that haven't
+// been tried yet get a chance every now and then.
+class MirrorScores
+{
+public:
+	MirrorScores();
+	~MirrorScores();
+	
+	static MirrorScores* instance() { return m_instance; }
+	
+	void recordSpeed(QString host, int bytesPerSec);
+	// time to the first byte of a response
+	void recordLatency(QString host, int msecs);
+	void recordResult(QString host, bool failed);
+	void recordRanges(QString host, bool supported);
+	
+	// Expected speed in bytes per second with the errors and the latency taken into account,
+	// -1 if the host hasn't been tried yet
+	double score(QString host) const;
+	// Picks the URL for a new connection, returns the fallback if there's nothing to choose from
+	int pick(const QList<QUrl>& urls, int fallback) const;
+	
+	void save() const;
+private:
+	void load();
+	// Saves the scores once in a while, m_lock must not be held
+	void changed();
+	static QString filePath();
+	
+	struct Host
+	{
+		Host() : speed(0), latency(0), sessions(0), errors(0), ranges(-1), lastUsed(0) {}
+		
+		// EWMA, bytes per second
+		double speed;
+		// EWMA, msecs
+		double latency;
+		int sessions, errors;
+		// -1 = unknown
+		int ranges;
+		qint64 lastUsed;
+	};
+	// m_lock must be held
+	Host& host(const QString& name);
+	
+	static MirrorScores* m_instance;
+	
+	mutable QMutex m_lock;
+	QHash<QString, Host> m_hosts;
+	qint64 m_nLastSave;
+};
+
+#endif
@@ -0,0 +1,299 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "config.h"
+#include "PieceHashes.h"
+#include "StreamingHash.h"
+#include <QtDebug>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+#ifndef O_LARGEFILE
+#	define O_LARGEFILE 0
+#endif
+
+// how much may be read back per written buffer, so that the writer thread doesn't stall for long
+static const qlonglong MAX_CATCHUP = 8*1024*1024;
+static const int READ_BUFFER = 256*1024;
+
+PieceHashes* PieceHashes::create(QString algorithm, qlonglong length, QList<QByteArray> hashes, QString file)
+{
+	QCryptographicHash::Algorithm algo = QCryptographicHash::Md5;
+	
+	if(length <= 0 || hashes.isEmpty())
+		return 0;
+	
+	for(int i=0;i<hashes.size();i++)
+	{
+		QByteArray digest;
+		
+		if(!StreamingHash::parse(algorithm + ':' + QString::fromLatin1(hashes[i]), algo, digest))
+			return 0;
+		hashes[i] = digest;
+	}
+	
+	QByteArray path = file.toUtf8();
+	// the file may not have been created by the download yet
+	int fd = ::open(path.constData(), O_CREAT | O_RDONLY | O_LARGEFILE | O_CLOEXEC, 0666);
+	if(fd < 0)
+	{
+		qDebug() << "PieceHashes: cannot open" << file << strerror(errno);
+		return 0;
+	}
+	
+	return new PieceHashes(algo, length, hashes, fd);
+}
+
+PieceHashes::PieceHashes(QCryptographicHash::Algorithm algorithm, qlonglong length, QList<QByteArray> hashes, int fd)
+	: m_algorithm(algorithm), m_nLength(length), m_nTotal(0), m_hashes(hashes), m_states(hashes.size(), Unknown),
+	  m_partial(algorithm), m_nPartialPiece(-1), m_nPartialPos(0), m_fd(fd), m_nRefs(1)
+{
+}
+
+PieceHashes::~PieceHashes()
+{
+	::close(m_fd);
+}
+
+void PieceHashes::ref()
+{
+	m_nRefs.ref();
+}
+
+void PieceHashes::deref()
+{
+	if(!m_nRefs.deref())
+		delete this;
+}
+
+void PieceHashes::setTotal(qlonglong total)
+{
+	QMutexLocker l(&m_lock);
+	
+	if(total == m_nTotal)
+		return;
+	
+	m_nTotal = total;
+	
+	// the last piece may have been waiting for the size
+	QMap<qlonglong, qlonglong>::iterator it = m_covered.upperBound(total);
+	if(it != m_covered.begin())
+	{
+		--it;
+		queueComplete(total - 1, total, it.key(), it.value());
+	}
+}
+
+qlonglong PieceHashes::pieceEnd(int piece) const
+{
+	qlonglong end = (piece + 1) * m_nLength;
+	
+	if(piece == m_hashes.size() - 1)
+		return m_nTotal ? m_nTotal : -1;
+	return end;
+}
+
+void PieceHashes::cover(qlonglong& from, qlonglong& to)
+{
+	QMap<qlonglong, qlonglong>::iterator it = m_covered.upperBound(from);
+	
+	if(it != m_covered.begin())
+	{
+		QMap<qlonglong, qlonglong>::iterator prev = it - 1;
+		if(prev.value() >= from)
+		{
+			from = prev.key();
+			to = qMax(to, prev.value());
+			m_covered.erase(prev);
+		}
+	}
+	
+	it = m_covered.lowerBound(from);
+	while(it != m_covered.end() && it.key() <= to)
+	{
+		to = qMax(to, it.value());
+		it = m_covered.erase(it);
+	}
+	
+	m_covered.insert(from, to);
+}
+
+void PieceHashes::uncover(qlonglong from, qlonglong to)
+{
+	QMap<qlonglong, qlonglong>::iterator it = m_covered.upperBound(from);
+	
+	if(it != m_covered.begin())
+		--it;
+	
+	while(it != m_covered.end() && it.key() < to)
+	{
+		qlonglong start = it.key(), end = it.value();
+		
+		if(end <= from)
+		{
+			++it;
+			continue;
+		}
+		
+		it = m_covered.erase(it);
+		if(start < from)
+			m_covered.insert(start, from);
+		if(end > to)
+		{
+			m_covered.insert(to, end);
+			break;
+		}
+	}
+}
+
+void PieceHashes::queueComplete(qlonglong offset, qlonglong end, qlonglong from, qlonglong to)
+{
+	int first = offset / m_nLength;
+	int last = qMin<qlonglong>((end - 1) / m_nLength, m_hashes.size() - 1);
+	
+	for(int i=first;i<=last;i++)
+	{
+		qlonglong pieceEnd = this->pieceEnd(i);
+		
+		if(m_states[i] != Unknown || pieceEnd < 0)
+			continue;
+		if(i * m_nLength >= from && pieceEnd <= to)
+		{
+			m_states[i] = Queued;
+			m_queue << i;
+		}
+	}
+}
+
+void PieceHashes::written(qlonglong offset, qlonglong bytes)
+{
+	QMutexLocker l(&m_lock);
+	qlonglong from = offset, to = offset + bytes;
+	
+	if(bytes <= 0)
+		return;
+	
+	cover(from, to);
+	queueComplete(offset, offset + bytes, from, to);
+	verifyQueued(MAX_CATCHUP);
+}
+
+void PieceHashes::present(qlonglong offset, qlonglong bytes)
+{
+	QMutexLocker l(&m_lock);
+	qlonglong from = offset, to = offset + bytes;
+	
+	if(bytes <= 0)
+		return;
+	
+	cover(from, to);
+	queueComplete(offset, offset + bytes, from, to);
+}
+
+void PieceHashes::flush()
+{
+	QMutexLocker l(&m_lock);
+	verifyQueued(-1);
+}
+
+QList<int> PieceHashes::takeCorrupt()
+{
+	QMutexLocker l(&m_lock);
+	QList<int> retval = m_corrupt;
+	
+	m_corrupt.clear();
+	return retval;
+}
+
+bool PieceHashes::hasCorrupt()
+{
+	QMutexLocker l(&m_lock);
+	return !m_corrupt.isEmpty();
+}
+
+void PieceHashes::verifyQueued(qlonglong budget)
+{
+	while(!m_queue.isEmpty() && budget != 0)
+	{
+		if(verify(m_queue.first(), budget))
+			m_queue.removeFirst();
+	}
+}
+
+bool PieceHashes::verify(int piece, qlonglong& budget)
+{
+	QByteArray buf(READ_BUFFER, Qt::Uninitialized);
+	const qlonglong end = pieceEnd(piece);
+	
+	if(m_nPartialPiece != piece)
+	{
+		m_partial.reset();
+		m_nPartialPiece = piece;
+		m_nPartialPos = piece * m_nLength;
+	}
+	
+	while(m_nPartialPos < end)
+	{
+		if(!budget)
+			return false;
+		
+		qlonglong chunk = qMin<qlonglong>(buf.size(), end - m_nPartialPos);
+		if(budget > 0)
+			chunk = qMin(chunk, budget);
+		
+		ssize_t r = pread64(m_fd, buf.data(), chunk, m_nPartialPos);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+		{
+			// tried again once more data is written into it
+			qDebug() << "PieceHashes: read failed at" << m_nPartialPos;
+			m_states[piece] = Unknown;
+			m_nPartialPiece = -1;
+			return true;
+		}
+		
+		m_partial.addData(buf.constData(), r);
+		m_nPartialPos += r;
+		if(budget > 0)
+			budget -= r;
+	}
+	
+	m_nPartialPiece = -1;
+	
+	if(m_partial.result().toHex() == m_hashes[piece])
+		m_states[piece] = Verified;
+	else
+	{
+		m_states[piece] = Unknown;
+		uncover(piece * m_nLength, end);
+		m_corrupt << piece;
+	}
+	return true;
+}
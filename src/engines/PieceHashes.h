@@ -0,0 +1,104 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef PIECEHASHES_H
+#define PIECEHASHES_H
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QVector>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QCryptographicHash>
+
+// Verifies the pieces of a download (as listed in Metalink) as soon as each of them
+// has been written completely, so that a corrupt piece can be downloaded again on its own.
+// The DiskWriter reports the written ranges, complete pieces are read back from the file
+// (usually still in the page cache) a few megabytes at a time, a long piece over several buffers.
+class PieceHashes
+{
+public:
+	// The hashes are hex encoded, the algorithm is named as in Metalink.
+	// Returns 0 if the algorithm or a hash isn't valid or the file cannot be opened.
+	static PieceHashes* create(QString algorithm, qlonglong length, QList<QByteArray> hashes, QString file);
+	
+	void ref();
+	// The object is deleted once the last reference is gone
+	void deref();
+	
+	// The last piece can only be verified once the size is known
+	void setTotal(qlonglong total);
+	// Called by the DiskWriter thread with ranges that are already on the disk
+	void written(qlonglong offset, qlonglong bytes);
+	// Data that had been written before the object was created, verified along with the new data
+	void present(qlonglong offset, qlonglong bytes);
+	// Verifies all complete pieces that are still waiting, the data must have been written already
+	// (see DiskWriter::sync()). It may take long, it's not meant for the GUI thread.
+	void flush();
+	// The corrupt pieces found since the last call, they are no longer considered written
+	QList<int> takeCorrupt();
+	bool hasCorrupt();
+	
+	qlonglong pieceLength() const { return m_nLength; }
+	int count() const { return m_hashes.size(); }
+private:
+	PieceHashes(QCryptographicHash::Algorithm algorithm, qlonglong length, QList<QByteArray> hashes, int fd);
+	~PieceHashes();
+	
+	// m_lock must be held
+	// Adds the range, returns the covered range it has become a part of
+	void cover(qlonglong& from, qlonglong& to);
+	void uncover(qlonglong from, qlonglong to);
+	// Queues the unverified pieces within the covered range that overlap <offset, end)
+	void queueComplete(qlonglong offset, qlonglong end, qlonglong from, qlonglong to);
+	// Reads at most budget bytes (-1 for no limit)
+	void verifyQueued(qlonglong budget);
+	// Continues reading the piece, returns true once it's done with it
+	bool verify(int piece, qlonglong& budget);
+	qlonglong pieceEnd(int piece) const;
+private:
+	enum PieceState { Unknown, Queued, Verified };
+	
+	QCryptographicHash::Algorithm m_algorithm;
+	qlonglong m_nLength, m_nTotal;
+	QList<QByteArray> m_hashes;
+	QVector<char> m_states;
+	// written ranges (offset -> end), joined
+	QMap<qlonglong, qlonglong> m_covered;
+	QList<int> m_queue, m_corrupt;
+	// the piece being read, it's the first one in m_queue
+	QCryptographicHash m_partial;
+	int m_nPartialPiece;
+	qlonglong m_nPartialPos;
+	int m_fd;
+	QMutex m_lock;
+	QAtomicInt m_nRefs;
+};
+
+#endif
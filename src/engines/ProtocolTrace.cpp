@@ -0,0 +1,152 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#include "ProtocolTrace.h"
+#include "CurlStat.h"
+#include <QDateTime>
+#include <QStringList>
+#include <cstring>
+
+ProtocolTrace::ProtocolTrace(int capacity)
+	: m_nCapacity(qMax<int>(capacity, 1024)), m_buffer(0), m_nTail(0), m_nHead(0)
+{
+}
+
+ProtocolTrace::~ProtocolTrace()
+{
+	delete [] m_buffer;
+}
+
+void ProtocolTrace::setEnabled(bool enabled)
+{
+	QMutexLocker l(&m_lock);
+	
+	if(enabled && !m_buffer)
+		m_buffer = new char[m_nCapacity];
+	m_bEnabled.storeRelease(enabled);
+}
+
+void ProtocolTrace::clear()
+{
+	QMutexLocker l(&m_lock);
+	m_nTail = m_nHead = 0;
+}
+
+void ProtocolTrace::put(qint64 pos, const void* data, int bytes)
+{
+	int offset = pos % m_nCapacity;
+	int first = qMin(bytes, m_nCapacity - offset);
+	
+	memcpy(m_buffer + offset, data, first);
+	memcpy(m_buffer, static_cast<const char*>(data) + first, bytes - first);
+}
+
+void ProtocolTrace::get(qint64 pos, void* data, int bytes) const
+{
+	int offset = pos % m_nCapacity;
+	int first = qMin(bytes, m_nCapacity - offset);
+	
+	memcpy(data, m_buffer + offset, first);
+	memcpy(static_cast<char*>(data) + first, m_buffer, bytes - first);
+}
+
+void ProtocolTrace::record(const void* source, curl_infotype type, const char* text, size_t bytes)
+{
+	Header hdr;
+	
+	// the trailing line breaks are of no use
+	while(bytes > 0 && (text[bytes-1] == '\n' || text[bytes-1] == '\r'))
+		bytes--;
+	if(!bytes)
+		return;
+	
+	hdr.time = CurlStat::monotonicMsecs();
+	hdr.source = quintptr(source);
+	hdr.type = type;
+	hdr.length = qMin<size_t>(bytes, m_nCapacity / 4);
+	
+	QMutexLocker l(&m_lock);
+	const qint64 size = sizeof(hdr) + hdr.length;
+	
+	if(!m_buffer)
+		return;
+	
+	// make room by dropping the oldest records
+	while(m_nHead + size - m_nTail > m_nCapacity)
+	{
+		Header old;
+		get(m_nTail, &old, sizeof(old));
+		m_nTail += sizeof(old) + old.length;
+	}
+	
+	put(m_nHead, &hdr, sizeof(hdr));
+	put(m_nHead + sizeof(hdr), text, hdr.length);
+	m_nHead += size;
+}
+
+QString ProtocolTrace::format() const
+{
+	QMutexLocker l(&m_lock);
+	QStringList lines;
+	QByteArray text;
+	
+	// the records carry the monotonic time
+	const QDateTime now = QDateTime::currentDateTime();
+	const qint64 mono = CurlStat::monotonicMsecs();
+	
+	for(qint64 pos = m_nTail; pos < m_nHead; )
+	{
+		Header hdr;
+		const char* dir;
+		
+		get(pos, &hdr, sizeof(hdr));
+		text.resize(hdr.length);
+		get(pos + sizeof(hdr), text.data(), hdr.length);
+		pos += sizeof(hdr) + hdr.length;
+		
+		if(hdr.type == CURLINFO_HEADER_IN)
+			dir = "<";
+		else if(hdr.type == CURLINFO_HEADER_OUT)
+			dir = ">";
+		else
+			dir = "*";
+		
+		QString time = now.addMSecs(hdr.time - mono).toString("yyyy-MM-dd hh:mm:ss.zzz");
+		QString prefix = QString("%1 0x%2 %3 ").arg(time).arg(qulonglong(hdr.source), 0, 16).arg(dir);
+		
+		// a request comes as a single block of header lines
+		foreach(QByteArray line, text.split('\n'))
+		{
+			line = line.trimmed();
+			if(!line.isEmpty())
+				lines << prefix + QString::fromUtf8(line);
+		}
+	}
+	
+	return lines.join("\n");
+}
@@ -0,0 +1,74 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef PROTOCOLTRACE_H
+#define PROTOCOLTRACE_H
+#include <QMutex>
+#include <QAtomicInt>
+#include <QString>
+#include <curl/curl.h>
+
+// A fixed-size binary ring of curl's protocol lines (headers and informational messages).
+// Recording only copies the raw bytes over the oldest ones, the lines are formatted
+// only when someone wants to see them. Nothing is allocated until it's enabled.
+class ProtocolTrace
+{
+public:
+	// capacity in bytes
+	ProtocolTrace(int capacity);
+	~ProtocolTrace();
+	
+	void setEnabled(bool enabled);
+	bool isEnabled() const { return m_bEnabled.loadAcquire(); }
+	
+	// called from the polling threads, the source tells the connections apart
+	void record(const void* source, curl_infotype type, const char* text, size_t bytes);
+	// one line per record, the oldest first
+	QString format() const;
+	void clear();
+private:
+	struct Header
+	{
+		qint64 time;
+		quintptr source;
+		quint32 type, length;
+	};
+	
+	// the positions grow forever, they're taken modulo the capacity
+	void put(qint64 pos, const void* data, int bytes);
+	void get(qint64 pos, void* data, int bytes) const;
+private:
+	QAtomicInt m_bEnabled;
+	int m_nCapacity;
+	char* m_buffer;
+	// the start of the oldest record and the end of the newest one
+	qint64 m_nTail, m_nHead;
+	mutable QMutex m_lock;
+};
+
+#endif
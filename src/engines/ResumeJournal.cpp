@@ -0,0 +1,368 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#include "config.h"
+#include "ResumeJournal.h"
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QtDebug>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef POSIX_LINUX
+#	define pwrite64 pwrite
+#	define fdatasync fsync
+#endif
+
+static const char JOURNAL_MAGIC[8] = { 'F', 'R', 'J', 'R', 'N', 'L', '0', '1' };
+static const quint32 RECORD_TAG = 0x4a52;
+// the journal is rewritten once it has this many records and most of them are redundant
+static const int COMPACT_RECORDS = 1024;
+
+struct JournalRecord
+{
+	qint64 offset, bytes;
+	quint32 check, reserved;
+};
+
+static quint32 recordCheck(const JournalRecord& rec)
+{
+	return (RECORD_TAG << 16) | qChecksum(reinterpret_cast<const char*>(&rec), 2*sizeof(qint64));
+}
+
+QMutex ResumeJournal::m_openLock;
+QMap<QString,ResumeJournal*> ResumeJournal::m_open;
+
+ResumeJournal::ResumeJournal(QString uuid, int fd)
+	: m_nRefs(1), m_strUuid(uuid), m_strPath(path(uuid)), m_fd(fd), m_bDiscarded(false), m_nSize(0), m_nRecords(0)
+{
+}
+
+ResumeJournal::~ResumeJournal()
+{
+	::close(m_fd);
+}
+
+QString ResumeJournal::path(QString uuid)
+{
+	return QDir::homePath() + QLatin1String(USER_PROFILE_PATH "/journals/") + uuid;
+}
+
+ResumeJournal* ResumeJournal::open(QString uuid, bool truncate)
+{
+	QMutexLocker locker(&m_openLock);
+	ResumeJournal* journal = m_open.value(uuid);
+	
+	// two instances appending to the same file would overwrite each other's records
+	if(journal)
+	{
+		QMutexLocker l(&journal->m_lock);
+		if(!journal->m_bDiscarded)
+		{
+			journal->ref();
+			if(truncate)
+			{
+				journal->m_ranges.clear();
+				journal->m_pending.clear();
+				journal->compact();
+			}
+			return journal;
+		}
+	}
+	
+	QString p = path(uuid);
+	QDir().mkpath(QFileInfo(p).path());
+	
+	int fd = ::open(QFile::encodeName(p).constData(), O_CREAT|O_RDWR, 0600);
+	if(fd < 0)
+	{
+		qDebug() << "ResumeJournal: cannot open" << p << strerror(errno);
+		return 0;
+	}
+	
+	journal = new ResumeJournal(uuid, fd);
+	
+	if(!truncate)
+		journal->m_nSize = replay(fd, journal->m_ranges);
+	
+	if(journal->m_nSize)
+	{
+		// cut off a torn record so that the next ones are readable
+		journal->m_nRecords = (journal->m_nSize - sizeof(JOURNAL_MAGIC)) / sizeof(JournalRecord);
+		if(ftruncate(fd, journal->m_nSize) != 0)
+			qDebug() << "ResumeJournal: ftruncate failed:" << strerror(errno);
+	}
+	else
+	{
+		journal->m_ranges.clear();
+		
+		if(ftruncate(fd, 0) != 0 || !writeAll(fd, QByteArray(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)), 0) || fdatasync(fd) != 0)
+		{
+			qDebug() << "ResumeJournal: cannot initialize" << p << strerror(errno);
+			delete journal;
+			return 0;
+		}
+		journal->m_nSize = sizeof(JOURNAL_MAGIC);
+	}
+	
+	m_open[uuid] = journal;
+	return journal;
+}
+
+bool ResumeJournal::read(QString uuid, QList<Range>& ranges)
+{
+	int fd = ::open(QFile::encodeName(path(uuid)).constData(), O_RDONLY);
+	if(fd < 0)
+		return false;
+	
+	QMap<qlonglong,qlonglong> merged;
+	bool valid = replay(fd, merged) > 0;
+	::close(fd);
+	
+	ranges.clear();
+	for(QMap<qlonglong,qlonglong>::const_iterator it = merged.constBegin(); it != merged.constEnd(); it++)
+	{
+		Range r = { it.key(), it.value() };
+		ranges << r;
+	}
+	
+	return valid;
+}
+
+void ResumeJournal::remove(QString uuid)
+{
+	QFile::remove(path(uuid));
+}
+
+void ResumeJournal::ref()
+{
+	m_nRefs.ref();
+}
+
+void ResumeJournal::deref()
+{
+	QMutexLocker locker(&m_openLock);
+	
+	if(!m_nRefs.deref())
+	{
+		if(m_open.value(m_strUuid) == this)
+			m_open.remove(m_strUuid);
+		delete this;
+	}
+}
+
+qlonglong ResumeJournal::replay(int fd, QMap<qlonglong,qlonglong>& ranges)
+{
+	QByteArray data;
+	char buf[16*1024];
+	ssize_t rd;
+	
+	if(lseek(fd, 0, SEEK_SET) < 0)
+		return 0;
+	while((rd = ::read(fd, buf, sizeof(buf))) != 0)
+	{
+		if(rd < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return 0;
+		}
+		data.append(buf, rd);
+	}
+	
+	if(data.size() < int(sizeof(JOURNAL_MAGIC)) || memcmp(data.constData(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)))
+		return 0;
+	
+	qlonglong pos = sizeof(JOURNAL_MAGIC);
+	while(pos + qlonglong(sizeof(JournalRecord)) <= data.size())
+	{
+		JournalRecord rec;
+		memcpy(&rec, data.constData() + pos, sizeof(rec));
+		
+		if(rec.check != recordCheck(rec) || rec.offset < 0 || rec.bytes < 0)
+			break;
+		
+		addRange(ranges, rec.offset, rec.bytes);
+		pos += sizeof(rec);
+	}
+	
+	return pos;
+}
+
+void ResumeJournal::addRange(QMap<qlonglong,qlonglong>& ranges, qlonglong offset, qlonglong bytes)
+{
+	if(bytes <= 0)
+		return;
+	
+	qlonglong end = offset + bytes;
+	QMap<qlonglong,qlonglong>::iterator it = ranges.upperBound(offset);
+	
+	if(it != ranges.begin())
+	{
+		--it;
+		if(it.key() + it.value() >= offset)
+		{
+			offset = it.key();
+			end = qMax(end, it.key() + it.value());
+			it = ranges.erase(it);
+		}
+		else
+			++it;
+	}
+	
+	while(it != ranges.end() && it.key() <= end)
+	{
+		end = qMax(end, it.key() + it.value());
+		it = ranges.erase(it);
+	}
+	
+	ranges.insert(offset, end - offset);
+}
+
+void ResumeJournal::appendRecord(QByteArray& out, qlonglong offset, qlonglong bytes)
+{
+	JournalRecord rec;
+	
+	rec.offset = offset;
+	rec.bytes = bytes;
+	rec.check = recordCheck(rec);
+	rec.reserved = 0;
+	
+	out.append(reinterpret_cast<const char*>(&rec), sizeof(rec));
+}
+
+bool ResumeJournal::writeAll(int fd, const QByteArray& data, qlonglong offset)
+{
+	const char* p = data.constData();
+	size_t left = data.size();
+	
+	while(left > 0)
+	{
+		ssize_t written = pwrite64(fd, p, left, offset);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		p += written;
+		left -= written;
+		offset += written;
+	}
+	return true;
+}
+
+void ResumeJournal::record(qlonglong offset, qlonglong bytes)
+{
+	QMutexLocker locker(&m_lock);
+	
+	if(m_bDiscarded || bytes <= 0)
+		return;
+	
+	appendRecord(m_pending, offset, bytes);
+	addRange(m_ranges, offset, bytes);
+}
+
+void ResumeJournal::commit()
+{
+	QMutexLocker locker(&m_lock);
+	
+	if(m_bDiscarded || m_pending.isEmpty())
+		return;
+	
+	int records = m_pending.size() / sizeof(JournalRecord);
+	
+	if(m_nRecords + records >= COMPACT_RECORDS && m_nRecords + records > 4*m_ranges.size() && compact())
+	{
+		m_pending.clear();
+		return;
+	}
+	
+	if(!writeAll(m_fd, m_pending, m_nSize) || fdatasync(m_fd) != 0)
+	{
+		qDebug() << "ResumeJournal: write failed:" << strerror(errno);
+		// drop the partial record, the ranges get recorded again by the next commit
+		if(ftruncate(m_fd, m_nSize) != 0)
+			qDebug() << "ResumeJournal: ftruncate failed:" << strerror(errno);
+		return;
+	}
+	
+	m_nSize += m_pending.size();
+	m_nRecords += records;
+	m_pending.clear();
+}
+
+bool ResumeJournal::compact()
+{
+	QString tmp = m_strPath + ".new";
+	QByteArray data(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+	
+	for(QMap<qlonglong,qlonglong>::const_iterator it = m_ranges.constBegin(); it != m_ranges.constEnd(); it++)
+		appendRecord(data, it.key(), it.value());
+	
+	int fd = ::open(QFile::encodeName(tmp).constData(), O_CREAT|O_TRUNC|O_WRONLY, 0600);
+	if(fd < 0)
+		return false;
+	
+	if(!writeAll(fd, data, 0) || fdatasync(fd) != 0 || ::rename(QFile::encodeName(tmp).constData(), QFile::encodeName(m_strPath).constData()) != 0)
+	{
+		qDebug() << "ResumeJournal: compaction failed:" << strerror(errno);
+		::close(fd);
+		::unlink(QFile::encodeName(tmp).constData());
+		return false;
+	}
+	
+	// make the rename itself durable
+	int dir = ::open(QFile::encodeName(QFileInfo(m_strPath).path()).constData(), O_RDONLY);
+	if(dir >= 0)
+	{
+		fsync(dir);
+		::close(dir);
+	}
+	
+	// the new file is opened for writing, that's enough for appending
+	::close(m_fd);
+	m_fd = fd;
+	m_nSize = data.size();
+	m_nRecords = m_ranges.size();
+	
+	return true;
+}
+
+void ResumeJournal::discard()
+{
+	QMutexLocker locker(&m_lock);
+	
+	m_bDiscarded = true;
+	m_pending.clear();
+	::unlink(QFile::encodeName(m_strPath).constData());
+}
@@ -0,0 +1,101 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef RESUMEJOURNAL_H
+#define RESUMEJOURNAL_H
+#include <QString>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QByteArray>
+
+// Append-only log of byte ranges that have been synced to the disk.
+// The XML queue only knows how much data has been handed over to the write-behind
+// stage, so after a crash it may claim data that never made it to the disk.
+// The DiskWriter records every range once it has been synced, which makes
+// the journal the authoritative source of the progress when resuming.
+// Each record carries a checksum and a torn record at the end is simply dropped.
+// The journal gets rewritten from the merged ranges once it grows too long.
+class ResumeJournal
+{
+public:
+	struct Range
+	{
+		qlonglong offset, bytes;
+	};
+	
+	// Opens the journal of a transfer for appending, existing records are kept unless truncate is set.
+	// A journal still open from the previous run of the transfer is shared. Returns 0 on failure.
+	static ResumeJournal* open(QString uuid, bool truncate);
+	// Reads the merged ranges without opening the journal, returns false if there is no usable journal
+	static bool read(QString uuid, QList<Range>& ranges);
+	// Deletes the journal of a transfer that isn't open
+	static void remove(QString uuid);
+	
+	void ref();
+	// The journal is closed once the last reference is gone
+	void deref();
+	
+	// Records a range that has already been synced, it becomes durable with the next commit()
+	void record(qlonglong offset, qlonglong bytes);
+	// Writes out and syncs the recorded ranges, compacts the journal if needed
+	void commit();
+	// Deletes the journal file, nothing is recorded anymore
+	void discard();
+private:
+	ResumeJournal(QString uuid, int fd);
+	~ResumeJournal();
+	
+	static QString path(QString uuid);
+	// Returns the size of the valid part of the file
+	static qlonglong replay(int fd, QMap<qlonglong,qlonglong>& ranges);
+	static void addRange(QMap<qlonglong,qlonglong>& ranges, qlonglong offset, qlonglong bytes);
+	static void appendRecord(QByteArray& out, qlonglong offset, qlonglong bytes);
+	static bool writeAll(int fd, const QByteArray& data, qlonglong offset);
+	// Rewrites the journal from m_ranges, m_lock must be held
+	bool compact();
+	
+	static QMutex m_openLock;
+	// uuid -> journal
+	static QMap<QString,ResumeJournal*> m_open;
+	
+	QMutex m_lock;
+	QAtomicInt m_nRefs;
+	QString m_strUuid, m_strPath;
+	int m_fd;
+	bool m_bDiscarded;
+	// offset -> bytes, merged
+	QMap<qlonglong,qlonglong> m_ranges;
+	QByteArray m_pending;
+	// size of the valid part of the file
+	qlonglong m_nSize;
+	int m_nRecords;
+};
+
+#endif
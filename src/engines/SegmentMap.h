@@ -0,0 +1,428 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef SEGMENTMAP_H
+#define SEGMENTMAP_H
+#include <QMap>
+#include <QHash>
+#include <QList>
+#include <QString>
+#include <QStringList>
+
+// Ordered interval map of a download's segments, keyed by their offsets.
+// The free gaps between the segments are indexed by their size too, so that
+// both the segment owning an offset and the largest gap are found in logarithmic time.
+// Looking for a gap by what precedes it (findGap()) isn't indexed.
+// The segment type needs the offset, bytes and client (a pointer, non-null if the segment is active) members.
+// These three may only be changed through the map, anything else may be modified in place.
+template<typename Seg> class SegmentMap
+{
+public:
+	typedef typename QMap<qlonglong, Seg>::iterator iterator;
+	typedef typename QMap<qlonglong, Seg>::const_iterator const_iterator;
+	
+	struct Range
+	{
+		Range() : offset(0), bytes(0) {}
+		Range(qlonglong _offset, qlonglong _bytes) : offset(_offset), bytes(_bytes) {}
+		
+		qlonglong offset, bytes;
+	};
+	
+	SegmentMap() : m_nTotal(0), m_nDone(0) {}
+	
+	// Where the last gap ends, 0 if unknown
+	void setTotal(qlonglong total)
+	{
+		if(total == m_nTotal)
+			return;
+		dropGap(m_nTotal);
+		m_nTotal = total;
+		refreshGap(m_nTotal);
+	}
+	qlonglong total() const { return m_nTotal; }
+	// The sum of the segments' bytes
+	qlonglong done() const { return m_nDone; }
+	bool hasActive() const { return !m_clients.isEmpty(); }
+	
+	int size() const { return m_segments.size(); }
+	bool isEmpty() const { return m_segments.isEmpty(); }
+	iterator begin() { return m_segments.begin(); }
+	iterator end() { return m_segments.end(); }
+	const_iterator begin() const { return m_segments.constBegin(); }
+	const_iterator end() const { return m_segments.constEnd(); }
+	
+	// Positional access takes linear time, it's meant for the UI
+	Seg& operator[](int i)
+	{
+		iterator it = m_segments.begin();
+		it += i;
+		return *it;
+	}
+	const Seg& operator[](int i) const
+	{
+		const_iterator it = m_segments.constBegin();
+		it += i;
+		return *it;
+	}
+	
+	void clear()
+	{
+		m_segments.clear();
+		m_gaps.clear();
+		m_gapSizes.clear();
+		m_clients.clear();
+		m_nDone = 0;
+		refreshGap(m_nTotal);
+	}
+	
+	// An existing segment with the same offset is replaced
+	iterator insert(const Seg& seg)
+	{
+		iterator it = m_segments.find(seg.offset);
+		if(it != m_segments.end())
+			erase(it);
+		
+		it = m_segments.insert(seg.offset, seg);
+		m_nDone += seg.bytes;
+		if(seg.client)
+			m_clients[seg.client] = seg.offset;
+		
+		refreshGap(seg.offset);
+		refreshGap(gapEndAfter(seg.offset));
+		return it;
+	}
+	
+	iterator erase(iterator it)
+	{
+		qlonglong offset = it.key();
+		
+		m_nDone -= it->bytes;
+		if(it->client)
+			m_clients.remove(it->client);
+		
+		dropGap(offset);
+		it = m_segments.erase(it);
+		refreshGap(gapEndAfter(offset));
+		return it;
+	}
+	
+	void setBytes(iterator it, qlonglong bytes)
+	{
+		m_nDone += bytes - it->bytes;
+		it->bytes = bytes;
+		refreshGap(gapEndAfter(it.key()));
+	}
+	
+	template<typename Client> void setClient(iterator it, Client* client)
+	{
+		if(it->client)
+			m_clients.remove(it->client);
+		it->client = client;
+		if(client)
+			m_clients[client] = it.key();
+	}
+	
+	// The segment the client is downloading
+	iterator findClient(const void* client)
+	{
+		typename QHash<const void*, qlonglong>::const_iterator c = m_clients.constFind(client);
+		if(c == m_clients.constEnd())
+			return m_segments.end();
+		return m_segments.find(c.value());
+	}
+	
+	// The segment whose data cover the offset, end() if it lies in a gap
+	iterator owner(qlonglong offset)
+	{
+		iterator it = m_segments.upperBound(offset);
+		if(it == m_segments.begin())
+			return m_segments.end();
+		--it;
+		return (offset < it.key() + it->bytes) ? it : m_segments.end();
+	}
+	
+	// The last segment starting before the offset, end() if there's none
+	iterator preceding(qlonglong offset)
+	{
+		iterator it = m_segments.lowerBound(offset);
+		if(it == m_segments.begin())
+			return m_segments.end();
+		return --it;
+	}
+	const_iterator preceding(qlonglong offset) const
+	{
+		const_iterator it = m_segments.lowerBound(offset);
+		if(it == m_segments.constBegin())
+			return m_segments.constEnd();
+		return --it;
+	}
+	
+	// Merges an inactive segment with the inactive segments it touches or overlaps.
+	// Returns the resulting segment, an empty inactive segment is just removed and end() is returned.
+	iterator merge(iterator it)
+	{
+		if(it->client)
+			return it;
+		if(!it->bytes)
+		{
+			erase(it);
+			return m_segments.end();
+		}
+		
+		if(it != m_segments.begin())
+		{
+			iterator prev = it;
+			--prev;
+			
+			if(!prev->client && prev.key() + prev->bytes >= it.key())
+			{
+				qlonglong last = qMax(prev.key() + prev->bytes, it.key() + it->bytes);
+				erase(it);
+				setBytes(prev, last - prev.key());
+				it = prev;
+			}
+		}
+		
+		while(true)
+		{
+			iterator next = it;
+			++next;
+			
+			if(next == m_segments.end() || next->client || it.key() + it->bytes < next.key())
+				break;
+			
+			qlonglong last = qMax(next.key() + next->bytes, it.key() + it->bytes);
+			erase(next);
+			setBytes(it, last - it.key());
+		}
+		
+		return it;
+	}
+	
+	// Merges everything that can be merged
+	void mergeAll()
+	{
+		for(iterator it = m_segments.begin(); it != m_segments.end();)
+		{
+			if(!it->client && !it->bytes)
+				it = erase(it);
+			else
+				++(it = merge(it));
+		}
+	}
+	
+	// Takes the range out of the inactive segments, so that it's downloaded again.
+	// Active segments are left alone, they have to be released first.
+	void cut(qlonglong offset, qlonglong bytes)
+	{
+		const qlonglong end = offset + bytes;
+		iterator it = preceding(offset);
+
+		if(it == m_segments.end())
+			it = m_segments.begin();
+
+		while(it != m_segments.end() && it.key() < end)
+		{
+			const qlonglong segEnd = it.key() + it->bytes;
+
+			if(it->client || segEnd <= offset)
+			{
+				++it;
+				continue;
+			}
+
+			Seg tail = *it;
+			if(it.key() < offset)
+			{
+				setBytes(it, offset - it.key());
+				++it;
+			}
+			else
+				it = erase(it);
+
+			if(segEnd > end)
+			{
+				// a segment starting right there already covers the rest
+				if(!m_segments.contains(end))
+				{
+					tail.offset = end;
+					tail.bytes = segEnd - end;
+					insert(tail);
+				}
+				break;
+			}
+		}
+	}
+
+	// The largest gap, bytes is 0 if there are no gaps
+	Range largestGap() const
+	{
+		if(m_gapSizes.isEmpty())
+			return Range();
+		
+		typename QMultiMap<qlonglong, qlonglong>::const_iterator it = m_gapSizes.constEnd();
+		--it;
+		return Range(it.value() - it.key(), it.key());
+	}
+	
+	// The smallest or the largest gap either following an active segment or not, bytes is 0 if there's none.
+	// The gaps are walked by size until one matches, which takes linear time if few of them do.
+	Range findGap(bool largest, bool afterActive) const
+	{
+		if(m_gapSizes.isEmpty())
+			return Range();
+		
+		typename QMultiMap<qlonglong, qlonglong>::const_iterator it = largest ? m_gapSizes.constEnd() : m_gapSizes.constBegin();
+		while(true)
+		{
+			if(largest)
+				--it;
+			
+			const_iterator prev = preceding(it.value());
+			bool active = prev != m_segments.constEnd() && prev->client;
+			
+			if(active == afterActive)
+				return Range(it.value() - it.key(), it.key());
+			
+			if(largest && it == m_gapSizes.constBegin())
+				break;
+			if(!largest && ++it == m_gapSizes.constEnd())
+				break;
+		}
+		
+		return Range();
+	}
+	
+	// All gaps ordered by their offsets
+	QList<Range> gaps() const
+	{
+		QList<Range> retval;
+		for(QMap<qlonglong, qlonglong>::const_iterator it = m_gaps.constBegin(); it != m_gaps.constEnd(); it++)
+			retval << Range(it.value(), it.key() - it.value());
+		return retval;
+	}
+	
+	// Compact text form of the covered ranges, touching ranges are joined.
+	// "offset:bytes" pairs separated by commas, the offsets are relative to the end of the previous range.
+	QString serialize() const
+	{
+		QStringList parts;
+		qlonglong lastEnd = 0, start = -1, end = 0;
+		
+		for(const_iterator it = m_segments.constBegin(); it != m_segments.constEnd(); it++)
+		{
+			if(!it->bytes)
+				continue;
+			
+			if(start >= 0 && it.key() <= end)
+			{
+				end = qMax(end, it.key() + it->bytes);
+				continue;
+			}
+			if(start >= 0)
+			{
+				parts << QString("%1:%2").arg(start - lastEnd).arg(end - start);
+				lastEnd = end;
+			}
+			start = it.key();
+			end = start + it->bytes;
+		}
+		if(start >= 0)
+			parts << QString("%1:%2").arg(start - lastEnd).arg(end - start);
+		
+		return parts.join(",");
+	}
+	
+	static QList<Range> deserialize(const QString& str)
+	{
+		QList<Range> retval;
+		qlonglong lastEnd = 0;
+		
+		foreach(QString part, str.split(',', QString::SkipEmptyParts))
+		{
+			int pos = part.indexOf(':');
+			if(pos < 0)
+				continue;
+			
+			Range r(lastEnd + part.left(pos).toLongLong(), part.mid(pos+1).toLongLong());
+			if(r.offset < 0 || r.bytes <= 0)
+				continue;
+			
+			retval << r;
+			lastEnd = r.offset + r.bytes;
+		}
+		
+		return retval;
+	}
+private:
+	// Where the gap following the segment at the offset ends
+	qlonglong gapEndAfter(qlonglong offset) const
+	{
+		const_iterator it = m_segments.upperBound(offset);
+		return (it != m_segments.constEnd()) ? it.key() : m_nTotal;
+	}
+	
+	void dropGap(qlonglong end)
+	{
+		QMap<qlonglong, qlonglong>::iterator it = m_gaps.find(end);
+		if(it != m_gaps.end())
+		{
+			m_gapSizes.remove(end - it.value(), end);
+			m_gaps.erase(it);
+		}
+	}
+	
+	// Recomputes the gap ending at the offset, it starts where the preceding segment ends
+	void refreshGap(qlonglong end)
+	{
+		dropGap(end);
+		if(end <= 0 || (m_nTotal && end > m_nTotal))
+			return;
+		
+		qlonglong start = 0;
+		const_iterator prev = preceding(end);
+		if(prev != m_segments.constEnd())
+			start = prev.key() + prev->bytes;
+		
+		if(start < end)
+		{
+			m_gaps[end] = start;
+			m_gapSizes.insert(end - start, end);
+		}
+	}
+private:
+	QMap<qlonglong, Seg> m_segments;
+	// gap end -> gap start
+	QMap<qlonglong, qlonglong> m_gaps;
+	// gap size -> gap end
+	QMultiMap<qlonglong, qlonglong> m_gapSizes;
+	QHash<const void*, qlonglong> m_clients;
+	qlonglong m_nTotal, m_nDone;
+};
+
+#endif
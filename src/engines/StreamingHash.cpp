@@ -0,0 +1,251 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#include "config.h"
+#include "StreamingHash.h"
+#include <QtDebug>
+#include <QStringList>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+
+#ifndef O_LARGEFILE
+#	define O_LARGEFILE 0
+#endif
+
+// how much may be read back in one go, so that the writer thread doesn't stall for long
+static const qlonglong MAX_CATCHUP = 8*1024*1024;
+static const int READ_BUFFER = 256*1024;
+
+bool StreamingHash::parse(QString expected, QCryptographicHash::Algorithm& algorithm, QByteArray& digest)
+{
+	int pos = expected.indexOf(':');
+	if(pos < 0)
+		return false;
+	
+	QString name = expected.left(pos).toLower();
+	int length;
+	
+	if(name == "md5")
+	{
+		algorithm = QCryptographicHash::Md5;
+		length = 32;
+	}
+	else if(name == "sha-1" || name == "sha1")
+	{
+		algorithm = QCryptographicHash::Sha1;
+		length = 40;
+	}
+	else if(name == "sha-256" || name == "sha256")
+	{
+		algorithm = QCryptographicHash::Sha256;
+		length = 64;
+	}
+	else
+		return false;
+	
+	digest = expected.mid(pos+1).trimmed().toLower().toLatin1();
+	return digest.size() == length && QByteArray::fromHex(digest).toHex() == digest;
+}
+
+StreamingHash* StreamingHash::create(QString expected, QString file)
+{
+	QCryptographicHash::Algorithm algorithm;
+	QByteArray digest;
+	
+	if(!parse(expected, algorithm, digest))
+		return 0;
+	
+	QByteArray path = file.toUtf8();
+	// the file may not have been created by the download yet
+	int fd = ::open(path.constData(), O_CREAT | O_RDONLY | O_LARGEFILE | O_CLOEXEC, 0666);
+	if(fd < 0)
+	{
+		qDebug() << "StreamingHash: cannot open" << file << strerror(errno);
+		return 0;
+	}
+	
+	return new StreamingHash(expected.left(expected.indexOf(':')).toUpper(), algorithm, digest, fd);
+}
+
+StreamingHash::StreamingHash(QString algorithm, QCryptographicHash::Algorithm algo, QByteArray digest, int fd)
+	: m_strAlgorithm(algorithm), m_hash(algo), m_expected(digest), m_fd(fd), m_nHashed(0), m_nHolds(0), m_bFailed(false), m_nRefs(1)
+{
+}
+
+StreamingHash::~StreamingHash()
+{
+	::close(m_fd);
+}
+
+void StreamingHash::ref()
+{
+	m_nRefs.ref();
+}
+
+void StreamingHash::deref()
+{
+	if(!m_nRefs.deref())
+		delete this;
+}
+
+bool StreamingHash::readBack(qlonglong end)
+{
+	QByteArray buf(READ_BUFFER, Qt::Uninitialized);
+	
+	while(m_nHashed < end)
+	{
+		ssize_t r = pread64(m_fd, buf.data(), qMin<qlonglong>(buf.size(), end - m_nHashed), m_nHashed);
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+		{
+			qDebug() << "StreamingHash: read failed at" << m_nHashed;
+			m_bFailed = true;
+			return false;
+		}
+		
+		m_hash.addData(buf.constData(), r);
+		m_nHashed += r;
+	}
+	return true;
+}
+
+void StreamingHash::catchUp()
+{
+	qlonglong budget = MAX_CATCHUP;
+	
+	while(!m_pending.isEmpty() && !m_bFailed)
+	{
+		QMap<qlonglong, qlonglong>::iterator it = m_pending.begin();
+		
+		// there's a hole that hasn't been written yet
+		if(it.key() > m_nHashed)
+			break;
+		
+		qlonglong end = it.value();
+		if(end > m_nHashed)
+		{
+			qlonglong step = qMin(end, m_nHashed + budget);
+			
+			budget -= step - m_nHashed;
+			if(!readBack(step) || step < end)
+				break;
+		}
+		m_pending.erase(it);
+	}
+}
+
+void StreamingHash::written(qlonglong offset, const char* data, size_t bytes)
+{
+	QMutexLocker l(&m_lock);
+	const qlonglong end = offset + bytes;
+	
+	if(m_bFailed || end <= m_nHashed)
+		return;
+	
+	if(offset <= m_nHashed)
+	{
+		m_hash.addData(data + (m_nHashed - offset), end - m_nHashed);
+		m_nHashed = end;
+	}
+	else
+		addPending(offset, end);
+	
+	catchUp();
+}
+
+void StreamingHash::present(qlonglong offset, qlonglong bytes)
+{
+	QMutexLocker l(&m_lock);
+	
+	if(bytes <= 0 || offset + bytes <= m_nHashed)
+		return;
+	
+	if(m_nHolds)
+		m_held << qMakePair(offset, offset + bytes);
+	else
+		addPending(offset, offset + bytes);
+}
+
+void StreamingHash::hold()
+{
+	QMutexLocker l(&m_lock);
+	m_nHolds++;
+}
+
+void StreamingHash::release()
+{
+	QMutexLocker l(&m_lock);
+	
+	if(--m_nHolds)
+		return;
+	
+	// read back along with the next written data
+	for(int i=0;i<m_held.size();i++)
+	{
+		if(m_held[i].second > m_nHashed)
+			addPending(m_held[i].first, m_held[i].second);
+	}
+	m_held.clear();
+}
+
+void StreamingHash::addPending(qlonglong offset, qlonglong end)
+{
+	// merged with a range ending right where this one starts
+	QMap<qlonglong, qlonglong>::iterator it = m_pending.lowerBound(offset);
+	if(it != m_pending.begin() && (it-1).value() >= offset)
+		(it-1).value() = qMax((it-1).value(), end);
+	else
+		m_pending[offset] = qMax(m_pending.value(offset), end);
+}
+
+QByteArray StreamingHash::finish(qlonglong total)
+{
+	QMutexLocker l(&m_lock);
+	
+	if(m_bFailed || !readBack(total))
+		return QByteArray();
+	
+	m_pending.clear();
+	m_held.clear();
+	m_result = m_hash.result().toHex();
+	return m_result;
+}
+
+qlonglong StreamingHash::hashed()
+{
+	QMutexLocker l(&m_lock);
+	return m_nHashed;
+}
+
+bool StreamingHash::matches() const
+{
+	return !m_result.isEmpty() && m_result == m_expected;
+}
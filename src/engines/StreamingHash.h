@@ -0,0 +1,101 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef STREAMINGHASH_H
+#define STREAMINGHASH_H
+#include <QString>
+#include <QByteArray>
+#include <QMap>
+#include <QList>
+#include <QPair>
+#include <QMutex>
+#include <QAtomicInt>
+#include <QCryptographicHash>
+
+// Hashes the file of a download while it's being written, so that it can be verified
+// right on completion without reading it all over again.
+// The DiskWriter passes every written buffer. Data written right at the end of the hashed
+// part is hashed straight from the buffer, data written further on is read back from the file
+// once the hashed part has reached it - by then it's usually still in the page cache.
+// The expected hashes are given as "<algorithm>:<hex digest>", e.g. "sha-256:9f86d0...",
+// with the algorithm named as in Metalink.
+class StreamingHash
+{
+public:
+	// Returns 0 if the algorithm isn't supported or the file cannot be opened
+	static StreamingHash* create(QString expected, QString file);
+	// Whether the hash is usable, the hex digest is normalized
+	static bool parse(QString expected, QCryptographicHash::Algorithm& algorithm, QByteArray& digest);
+	
+	void ref();
+	// The hash is deleted once the last reference is gone
+	void deref();
+	
+	// Called by the DiskWriter thread with data that's already on the disk
+	void written(qlonglong offset, const char* data, size_t bytes);
+	// Data that had been written before the hash was created (e.g. by a previous run),
+	// it's read back bit by bit along with the newly written data
+	void present(qlonglong offset, qlonglong bytes);
+	// While the hash is held, the present data isn't read back, some of it may not have been
+	// written yet (see DiskWriter::attachHash())
+	void hold();
+	void release();
+	// Hashes whatever is left up to the given size, the data must have been written already
+	// (see DiskWriter::sync()). Returns the hex digest, an empty array on a read error.
+	QByteArray finish(qlonglong total);
+	// Whether the digest matches the expected one, to be called after finish()
+	bool matches() const;
+	// How much of the file has been hashed so far
+	qlonglong hashed();
+	QString algorithmName() const { return m_strAlgorithm; }
+private:
+	StreamingHash(QString algorithm, QCryptographicHash::Algorithm algo, QByteArray digest, int fd);
+	~StreamingHash();
+	
+	// m_lock must be held
+	bool readBack(qlonglong end);
+	void addPending(qlonglong offset, qlonglong end);
+	void catchUp();
+private:
+	QString m_strAlgorithm;
+	QCryptographicHash m_hash;
+	QByteArray m_expected, m_result;
+	int m_fd;
+	// everything before it has been hashed
+	qlonglong m_nHashed;
+	// written ranges beyond m_nHashed (offset -> end)
+	QMap<qlonglong, qlonglong> m_pending;
+	// present ranges waiting for the hash to be released
+	QList<QPair<qlonglong, qlonglong> > m_held;
+	int m_nHolds;
+	bool m_bFailed;
+	QMutex m_lock;
+	QAtomicInt m_nRefs;
+};
+
+#endif
@@ -112,6 +112,7 @@ void TorrentDetails::setPriority(int p)
 	foreach(int i, m_selFiles)
 		m_download->m_vecPriorities[i] = p;
 	m_download->m_handle.prioritize_files(m_download->m_vecPriorities);
+	m_download->markDirty();
 }
 
 void TorrentDetails::openFile()
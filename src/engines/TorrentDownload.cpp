@@ -774,6 +774,7 @@ void TorrentDownload::setObject(QString target)
 		{
 			m_handle.move_storage(newplace);
 			m_strTarget = target;
+			markDirty();
 		}
 		catch(...)
 		{
@@ -1576,7 +1577,7 @@ QVariant TorrentDownload::setFilePriorities(QList<QVariant>& args)
 	TorrentDownload* td = 0;
 	QVariantMap vmap;
 
-	XmlRpcService::findTransfer(uuid, &q, &t);
+	XmlRpcService::findEngineTransfer(uuid, &q, &t);
 	if (!t)
 		throw XmlRpcService::XmlRpcError(102, "Invalid transfer UUID");
 
@@ -1601,6 +1602,7 @@ QVariant TorrentDownload::setFilePriorities(QList<QVariant>& args)
 		}
 
 		td->m_handle.prioritize_files(td->m_vecPriorities);
+		td->markDirty();
 	}
 	catch (...)
 	{
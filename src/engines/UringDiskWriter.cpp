@@ -0,0 +1,248 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "config.h"
+#include "UringDiskWriter.h"
+#include <QtDebug>
+#include <cstring>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+UringDiskWriter::UringDiskWriter()
+	: m_bReady(false), m_bFailed(false)
+{
+	int r = io_uring_queue_init(RingEntries, &m_ring, 0);
+	if(r < 0)
+	{
+		qDebug() << "UringDiskWriter: io_uring is unavailable:" << strerror(-r);
+		return;
+	}
+	
+	m_bReady = true;
+	
+	struct io_uring_probe* probe = io_uring_get_probe_ring(&m_ring);
+	if(probe)
+	{
+		if(!io_uring_opcode_supported(probe, IORING_OP_WRITEV) || !io_uring_opcode_supported(probe, IORING_OP_FSYNC))
+		{
+			qDebug() << "UringDiskWriter: the kernel doesn't support the needed operations";
+			m_bReady = false;
+		}
+		io_uring_free_probe(probe);
+	}
+}
+
+UringDiskWriter::~UringDiskWriter()
+{
+	// the thread must not touch the ring anymore
+	stop();
+	
+	if(m_bReady)
+		io_uring_queue_exit(&m_ring);
+}
+
+UringDiskWriter* UringDiskWriter::create()
+{
+	UringDiskWriter* writer = new UringDiskWriter;
+	
+	if(!writer->m_bReady)
+	{
+		delete writer;
+		return 0;
+	}
+	
+	qDebug() << "UringDiskWriter: using io_uring";
+	return writer;
+}
+
+void UringDiskWriter::writeBatches(Batch* batches, int count)
+{
+	size_t lengths[MaxBatches];
+	// set if the batch has to be written again the plain way
+	bool retry[MaxBatches];
+	// the entries in the order they have been queued and the batches they belong to
+	struct io_uring_sqe* entries[RingEntries];
+	int owners[RingEntries];
+	unsigned sqes = 0;
+	
+	// the ring has failed before, the plain way is all that's left
+	if(m_bFailed)
+	{
+		DiskWriter::writeBatches(batches, count);
+		return;
+	}
+	
+	for(int i=0;i<count;i++)
+	{
+		Batch& batch = batches[i];
+		struct io_uring_sqe* sqe;
+		
+		lengths[i] = 0;
+		retry[i] = false;
+		
+		if(batch.error)
+			continue;
+		
+		if(batch.count)
+		{
+			for(int j=0;j<batch.count;j++)
+			{
+				m_iov[i][j].iov_base = batch.buffers[j]->data;
+				m_iov[i][j].iov_len = batch.buffers[j]->used;
+				lengths[i] += batch.buffers[j]->used;
+			}
+			
+			sqe = io_uring_get_sqe(&m_ring);
+			io_uring_prep_writev(sqe, batch.fd, m_iov[i], batch.count, batch.offset);
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(uintptr_t(i << 1)));
+			
+			// the sync only starts after the write has succeeded
+			if(batch.sync)
+				io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+			entries[sqes] = sqe;
+			owners[sqes++] = i;
+		}
+		if(batch.sync)
+		{
+			sqe = io_uring_get_sqe(&m_ring);
+			io_uring_prep_fsync(sqe, batch.fd, IORING_FSYNC_DATASYNC);
+			io_uring_sqe_set_data(sqe, reinterpret_cast<void*>(uintptr_t(i << 1 | 1)));
+			entries[sqes] = sqe;
+			owners[sqes++] = i;
+		}
+	}
+	
+	if(!sqes)
+		return;
+	
+	unsigned submitted = 0;
+	while(submitted < sqes)
+	{
+		int r = io_uring_submit_and_wait(&m_ring, sqes - submitted);
+		
+		if(r == -EINTR || r == -EAGAIN)
+			continue;
+		else if(r < 0)
+		{
+			qDebug() << "UringDiskWriter: submission failed:" << strerror(-r);
+			break;
+		}
+		submitted += r;
+	}
+	
+	if(submitted < sqes)
+	{
+		// The entries are consumed in order, the rest has never reached the kernel.
+		// Their batches are written the plain way below and the entries become no-ops,
+		// a later submission must not pick up iovecs and buffers that have been reused by then.
+		for(unsigned n = submitted; n < sqes; n++)
+		{
+			retry[owners[n]] = true;
+			io_uring_prep_nop(entries[n]);
+			io_uring_sqe_set_flags(entries[n], 0);
+			io_uring_sqe_set_data(entries[n], reinterpret_cast<void*>(NopData));
+		}
+		flushNops();
+	}
+	
+	for(unsigned done = 0; done < submitted;)
+	{
+		struct io_uring_cqe* cqe;
+		int e = io_uring_wait_cqe(&m_ring, &cqe);
+		
+		if(e == -EINTR)
+			continue;
+		else if(e < 0)
+		{
+			qDebug() << "UringDiskWriter: failed to reap completions:" << strerror(-e);
+			m_bFailed = true;
+			break;
+		}
+		
+		uintptr_t data = reinterpret_cast<uintptr_t>(io_uring_cqe_get_data(cqe));
+		int res = cqe->res;
+		
+		io_uring_cqe_seen(&m_ring, cqe);
+		
+		// one of the entries that never made it in the first place
+		if(data == NopData)
+			continue;
+		
+		int i = data >> 1;
+		bool isSync = data & 1;
+		done++;
+		
+		if(res == -ECANCELED)
+		{
+			// the write before has been short or has failed
+			continue;
+		}
+		else if(res < 0)
+		{
+			if(!batches[i].error)
+				batches[i].error = -res;
+		}
+		else if(!isSync && size_t(res) < lengths[i])
+			retry[i] = true;
+	}
+	
+	// short writes are rare enough to be simply redone, positional writes can be repeated
+	for(int i=0;i<count;i++)
+	{
+		if(!retry[i] || batches[i].error)
+			continue;
+		
+		Batch& batch = batches[i];
+		if(batch.count)
+			batch.error = writeBuffers(batch.fd, batch.offset, batch.buffers, batch.count);
+		if(!batch.error && batch.sync && fdatasync(batch.fd) != 0)
+			batch.error = errno;
+	}
+}
+
+void UringDiskWriter::flushNops()
+{
+	int failures = 0;
+	
+	while(io_uring_sq_ready(&m_ring))
+	{
+		int r = io_uring_submit(&m_ring);
+		
+		if(r >= 0 || r == -EINTR)
+			continue;
+		
+		// the completion queue may be full, the no-ops are reaped along with the other completions
+		if(++failures >= MaxNopAttempts)
+		{
+			qDebug() << "UringDiskWriter: giving up on io_uring:" << strerror(-r);
+			m_bFailed = true;
+			break;
+		}
+		usleep(1000);
+	}
+}
@@ -0,0 +1,64 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef URINGDISKWRITER_H
+#define URINGDISKWRITER_H
+#include "DiskWriter.h"
+#include <liburing.h>
+#include <stdint.h>
+
+// Submits the writes (and syncs) of all streams collected in a round
+// through io_uring at once instead of issuing a syscall for each of them.
+class UringDiskWriter : public DiskWriter
+{
+public:
+	// Returns 0 if the kernel lacks io_uring support
+	static UringDiskWriter* create();
+	~UringDiskWriter();
+protected:
+	UringDiskWriter();
+	virtual void writeBatches(Batch* batches, int count);
+private:
+	// Submits the entries turned into no-ops after a failed submission,
+	// stops using the ring if it doesn't take them
+	void flushNops();
+private:
+	// a write and a sync for every batch
+	enum { RingEntries = 2*MaxBatches };
+	// how many times flushNops() tries before giving up
+	enum { MaxNopAttempts = 100 };
+	// the user data of the no-ops
+	static const uintptr_t NopData = ~uintptr_t(0);
+	
+	bool m_bReady;
+	// set once the ring has failed, everything goes the plain way then
+	bool m_bFailed;
+	struct io_uring m_ring;
+	struct iovec m_iov[MaxBatches][MaxCoalesce];
+};
+
+#endif
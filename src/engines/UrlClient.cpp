@@ -21,31 +21,38 @@ along with this program; if not, see <http://www.gnu.org/licenses/>.
 #include "UrlClient.h"
 #include "Proxy.h"
 #include "fatrat.h"
-#include "CurlPollingMaster.h"
+#include "CurlTransferGroup.h"
 #include "Settings.h"
+#include "DiskWriter.h"
+#include "ProtocolTrace.h"
+#include "HostGovernor.h"
 #include <QFileInfo>
 #include <cstring>
 #include <errno.h>
 #include <sys/types.h>
 #include <unistd.h>
 
-#ifndef POSIX_LINUX
-#	define lseek64 lseek
-#endif
-
 UrlClient::UrlClient()
-	: m_source(0), m_target(0), m_rangeFrom(0), m_rangeTo(-1), m_progress(0), m_curl(0), m_postData(0), m_bTerminating(false)
+	: m_source(0), m_target(0), m_journal(0), m_hash(0), m_pieces(0), m_trace(0), m_stream(0), m_race(0), m_rangeFrom(0), m_rangeTo(-1), m_progress(0), m_nFirstByte(0), m_nBodyLimit(0), m_curl(0), m_postData(0), m_bTerminating(false), m_bWarmUp(false), m_bRefused(false)
 {
 	m_errorBuffer[0] = 0;
 }
 
 UrlClient::~UrlClient()
 {
-	if (m_target)
+	if (m_stream)
+	{
+		// the file is closed by the writer once the data is out
+		m_stream->close();
+		m_stream = 0;
+	}
+	else if (m_target)
 	{
 		close(m_target);
 		m_target = 0;
 	}
+	if (m_race)
+		m_race->deref();
 	delete [] m_postData;
 
 //	if (m_curl != 0)
@@ -57,15 +64,36 @@ void UrlClient::setSourceObject(UrlObject& obj)
 	m_source = &obj;
 }
 
-void UrlClient::setTargetObject(int fd)
+void UrlClient::setTargetObject(int fd, ResumeJournal* journal, StreamingHash* hash, PieceHashes* pieces)
 {
 	m_target = fd;
+	m_journal = journal;
+	m_hash = hash;
+	m_pieces = pieces;
+}
+
+void UrlClient::raceWith(UrlClient* other)
+{
+	if (m_race)
+		m_race->deref();
+	m_race = other->m_race;
+	m_race->ref();
 }
 
 void UrlClient::setRange(qlonglong from, qlonglong to)
 {
-	m_rangeFrom = from;
-	m_rangeTo = to;
+	// writeData() may be setting the end from Content-Length right now
+	if (m_race)
+	{
+		QMutexLocker l(&m_race->m_lock);
+		m_rangeFrom = from;
+		m_rangeTo = to;
+	}
+	else
+	{
+		m_rangeFrom = from;
+		m_rangeTo = to;
+	}
 }
 
 qlonglong UrlClient::progress() const
@@ -81,12 +109,20 @@ void UrlClient::start()
 	QUrl url = m_source->url;
 	bool bWatchHeaders = false;
 	
-	if(lseek64(m_target, m_rangeFrom, SEEK_SET) == (off_t) -1)
+	if (m_nBodyLimit)
 	{
-		emit failure(tr("Failed to seek in the file - %1").arg(strerror(errno)));
-		return;
+		if (!m_race)
+			m_race = new RaceMark(0);
+	}
+	else if (!m_bWarmUp)
+	{
+		// the data is written at explicit offsets by the DiskWriter thread, nothing is written from the polling thread
+		m_stream = DiskWriter::instance()->openStream(m_target, m_rangeFrom, this, m_journal, m_hash, m_pieces);
+		if (!m_race)
+			m_race = new RaceMark(m_rangeFrom);
+		m_target = 0;
+		qDebug() << "Position in file:" << m_rangeFrom;
 	}
-	qDebug() << "Position in file:" << lseek64(m_target, 0, SEEK_CUR);
 	
 	m_curl = curl_easy_init();
 	
@@ -97,8 +133,10 @@ void UrlClient::start()
 	}
 	
 	ba = url.toEncoded();
-	bWatchHeaders = ba.startsWith("http");
+	bWatchHeaders = ba.startsWith("http") && !m_bWarmUp;
 	curl_easy_setopt(m_curl, CURLOPT_URL, ba.constData());
+	if (m_bWarmUp)
+		curl_easy_setopt(m_curl, CURLOPT_NOBODY, 1L);
 	
 	if(!auth.isEmpty())
 		curl_easy_setopt(m_curl, CURLOPT_USERPWD, auth.constData());
@@ -166,6 +204,16 @@ void UrlClient::start()
 	curl_easy_setopt(m_curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
 	curl_easy_setopt(m_curl, CURLOPT_FTP_FILEMETHOD, CURLFTPMETHOD_SINGLECWD);
 
+#if LIBCURL_VERSION_NUM >= 0x072f00
+	if(getSettingsValue("httpftp/http2").toBool())
+	{
+		// HTTP/2 is negotiated over TLS only, servers speaking just HTTP/1.1 get a connection per segment.
+		// PIPEWAIT makes the segments wait for the first connection to find out before opening their own.
+		curl_easy_setopt(m_curl, CURLOPT_HTTP_VERSION, long(CURL_HTTP_VERSION_2TLS));
+		curl_easy_setopt(m_curl, CURLOPT_PIPEWAIT, 1L);
+	}
+#endif
+
 	if(m_rangeFrom || m_rangeTo != -1)
 	{
 		char range[128];
@@ -190,9 +238,13 @@ void UrlClient::start()
 		QByteArray ba = m_source->strReferrer.toUtf8();
 		curl_easy_setopt(m_curl, CURLOPT_REFERER, ba.constData());
 	}
-	curl_easy_setopt(m_curl, CURLOPT_DEBUGFUNCTION, curl_debug_callback);
-	curl_easy_setopt(m_curl, CURLOPT_DEBUGDATA, this);
-	curl_easy_setopt(m_curl, CURLOPT_VERBOSE, true);
+	// curl doesn't even produce the lines unless someone wants them
+	if (m_trace && m_trace->isEnabled())
+	{
+		curl_easy_setopt(m_curl, CURLOPT_DEBUGFUNCTION, curl_debug_callback);
+		curl_easy_setopt(m_curl, CURLOPT_DEBUGDATA, this);
+		curl_easy_setopt(m_curl, CURLOPT_VERBOSE, true);
+	}
 	curl_easy_setopt(m_curl, CURLOPT_ERRORBUFFER, m_errorBuffer);
 	curl_easy_setopt(m_curl, CURLOPT_FAILONERROR, true);
 	curl_easy_setopt(m_curl, CURLOPT_SSL_VERIFYPEER, false);
@@ -220,6 +272,12 @@ void UrlClient::stop()
 	//m_curl = 0;
 	m_bTerminating = true;
 	m_progress = 0;
+	
+	if(!m_strSlotHost.isEmpty())
+	{
+		HostGovernor::instance()->release(m_strSlotHost);
+		m_strSlotHost.clear();
+	}
 }
 
 size_t UrlClient::process_header(const char* ptr, size_t size, size_t nmemb, UrlClient* This)
@@ -237,6 +295,14 @@ size_t UrlClient::process_header(const char* ptr, size_t size, size_t nmemb, Url
 
 void UrlClient::processHeaders()
 {
+	if(m_headers.contains("content-range"))
+	{
+		// bytes <from>-<to>/<total>, the total may be unknown ("*")
+		QRegExp re("bytes\\s+\\d+-\\d+/(\\d+)");
+		if(re.indexIn(QString::fromLatin1(m_headers["content-range"])) != -1)
+			emit rangesConfirmed(re.cap(1).toLongLong());
+	}
+	
 	if(!m_headers.contains("location"))
 	{
 		if(m_headers.contains("content-disposition") /*&& m_bAutoName*/)
@@ -307,13 +373,12 @@ CURL* UrlClient::curlHandle()
 
 int UrlClient::curl_debug_callback(CURL*, curl_infotype type, char* text, size_t bytes, UrlClient* This)
 {
-	if(type != CURLINFO_DATA_IN && type != CURLINFO_DATA_OUT)
-	{
-		QByteArray line = QByteArray(text, bytes).trimmed();
-		qDebug() << "CURL debug:" << line;
-		if(!line.isEmpty())
-			emit This->logMessage(line);
-	}
+	if (This->m_bTerminating)
+		return 0;
+	
+	// the data and the SSL traffic aren't of interest
+	if (type == CURLINFO_TEXT || type == CURLINFO_HEADER_IN || type == CURLINFO_HEADER_OUT)
+		This->m_trace->record(This, type, text, bytes);
 	
 	return 0;
 }
@@ -324,6 +389,22 @@ bool UrlClient::writeData(const char* buffer, size_t bytes)
 	if(m_bTerminating)
 		return true;
 	
+	QMutexLocker l(&m_race->m_lock);
+	
+	if(m_nBodyLimit)
+	{
+		// there's no file, nor a range
+		m_body.append(buffer, qMin(towrite, m_nBodyLimit - m_body.size()));
+		m_progress += towrite;
+		if(m_body.size() >= m_nBodyLimit)
+		{
+			m_bTerminating = true;
+			emit done(QString());
+			return false;
+		}
+		return true;
+	}
+	
 	if(m_rangeTo == -1)
 	{
 		double len;
@@ -342,6 +423,14 @@ bool UrlClient::writeData(const char* buffer, size_t bytes)
 	}
 	if(!m_progress)
 	{
+		double firstByte;
+		if (!m_nFirstByte && curl_easy_getinfo(m_curl, CURLINFO_STARTTRANSFER_TIME, &firstByte) == CURLE_OK)
+			m_nFirstByte = qMax(1, int(firstByte * 1000));
+		
+		char* address;
+		if (m_strAddress.isEmpty() && curl_easy_getinfo(m_curl, CURLINFO_PRIMARY_IP, &address) == CURLE_OK && address)
+			m_strAddress = QLatin1String(address);
+		
 		char url[1024];
 		if (curl_easy_getinfo(m_curl, CURLINFO_EFFECTIVE_URL, url) == CURLE_OK)
 		{
@@ -363,12 +452,25 @@ bool UrlClient::writeData(const char* buffer, size_t bytes)
 	
 	if (towrite > 0)
 	{
-		if (write(m_target, buffer, towrite) != towrite && !m_bTerminating)
+		int err = m_stream->error();
+		if (err != 0)
 		{
-			emit failure(tr("Write failed (%1)").arg(strerror(errno)));
+			emit failure(tr("Write failed (%1)").arg(strerror(err)));
 			m_bTerminating = true;
 			return false;
 		}
+		qlonglong pos = m_rangeFrom + m_progress;
+		// in the endgame, the other client may have written this part already
+		qlonglong skip = qBound(qlonglong(0), m_race->m_nPosition - pos, qlonglong(towrite));
+		
+		m_stream->seek(pos + skip);
+		if (skip < towrite && !m_stream->write(buffer + skip, towrite - skip))
+		{
+			// the disk can't keep up, DiskWriter unpauses the transfer once there's room again
+			m_bWritePaused = true;
+			return true;
+		}
+		m_race->m_nPosition = qMax(m_race->m_nPosition, pos + towrite);
 	}
 
 	if(m_progress+qlonglong(bytes) > m_rangeTo-m_rangeFrom && m_rangeTo != -1 && !m_bTerminating)
@@ -376,6 +478,7 @@ bool UrlClient::writeData(const char* buffer, size_t bytes)
 		// The range has apparently been shrinked since the thread was started
 		qDebug() << "----------- Prematurely ending a shortened segment - m_rangeTo:" << m_rangeTo << "; progress:" << (m_progress+bytes);
 		m_bTerminating = true;
+		m_stream->flush();
 		emit done(QString());
 	}
 	m_progress += towrite;
@@ -388,6 +491,8 @@ bool UrlClient::writeData(const char* buffer, size_t bytes)
 
 void UrlClient::transferDone(CURLcode result)
 {
+	if (m_stream)
+		m_stream->flush();
 	if (m_bTerminating)
 		return;
 
@@ -406,21 +511,27 @@ void UrlClient::transferDone(CURLcode result)
 	else
 	{
 		QString err;
+		long code = 0;
+		
 		if(result == CURLE_OPERATION_TIMEDOUT)
 			err = tr("Timeout");
 		else if(m_errorBuffer[0])
 			err = QString::fromUtf8(m_errorBuffer);
 		else
 			err = curl_easy_strerror(result);
+		
+		curl_easy_getinfo(m_curl, CURLINFO_RESPONSE_CODE, &code);
+		m_bRefused = result == CURLE_COULDNT_CONNECT || code == 503 || code == 421
+			|| err.contains(QLatin1String("too many"), Qt::CaseInsensitive);
 		qDebug() << "The transfer has failed, firing an event";
 		m_bTerminating = true;
 		emit done(err);
 	}
 }
 
-void UrlClient::setPollingMaster(CurlPollingMaster* master)
+void UrlClient::setTransferGroup(CurlTransferGroup* group)
 {
-	m_master = master;
+	setSegmentMaster(group);
 }
 
 
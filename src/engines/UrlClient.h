@@ -24,11 +24,18 @@ along with this program; if not, see <http://www.gnu.org/licenses/>.
 #include <QUuid>
 #include <QHash>
 #include <QByteArray>
+#include <QMutex>
+#include <QAtomicInt>
 #include <QNetworkCookie>
 #include <curl/curl.h>
 #include "engines/CurlUser.h"
+#include "engines/DiskWriter.h"
 
-class CurlPollingMaster;
+class CurlTransferGroup;
+class ResumeJournal;
+class StreamingHash;
+class PieceHashes;
+class ProtocolTrace;
 
 class UrlClient : public QObject, public CurlUser
 {
@@ -48,17 +55,57 @@ public:
 		QList<QNetworkCookie> cookies;
 	};
 	
+	// Shared by the clients racing for the same range in the endgame,
+	// whatever lies before the mark has been written by one of them already
+	class RaceMark
+	{
+	public:
+		RaceMark(qlonglong position) : m_nPosition(position), m_nRefs(1) {}
+		void ref() { m_nRefs.ref(); }
+		void deref() { if(!m_nRefs.deref()) delete this; }
+		
+		QMutex m_lock;
+		qlonglong m_nPosition;
+	private:
+		QAtomicInt m_nRefs;
+	};
+	
 	void start();
 	void stop();
+	// Makes the client race the given started client, both write only what the other hasn't written yet.
+	// To be called before start().
+	void raceWith(UrlClient* other);
 	
 	void setSourceObject(UrlObject& obj);
-	void setTargetObject(int fd);
+	// The file descriptor is taken over, it's written to by the DiskWriter thread.
+	// Synced ranges are recorded in the journal if one is given, written data is passed to the hashes.
+	void setTargetObject(int fd, ResumeJournal* journal = 0, StreamingHash* hash = 0, PieceHashes* pieces = 0);
 	// The range is in form <from, to)
 	void setRange(qlonglong from, qlonglong to);
+	// Bytes handed over to the DiskWriter, data still held by curl isn't included
 	qlonglong progress() const;
 	qlonglong rangeFrom() const { return m_rangeFrom; }
 	qlonglong rangeTo() const { return m_rangeTo; }
-	void setPollingMaster(CurlPollingMaster* master);
+	const UrlObject* sourceObject() const { return m_source; }
+	// Msecs from the start to the first byte of the body, 0 until it arrives
+	int firstByteTime() const { return m_nFirstByte; }
+	// The IP address of the server, empty until the response arrives
+	QString primaryAddress() const { return m_strAddress; }
+	// The server has turned the connection down (refused, 503, 421, too many connections)
+	bool refused() const { return m_bRefused; }
+	// The connection holds a slot of the HostGovernor, given back once it's stopped
+	void setHostSlot(QString host) { m_strSlotHost = host; }
+	// Only opens a connection (a HEAD request, nothing is written), so that it's in the connection
+	// cache of the transfer group's polling thread by the time the real transfers start
+	void setWarmUp(bool warmUp) { m_bWarmUp = warmUp; }
+	// The body is kept in memory instead of being written into a file, the transfer
+	// ends successfully once there's as much as the limit. To be called before start().
+	void setMemoryTarget(int limit) { m_nBodyLimit = limit; }
+	// The body received so far by a client with a memory target
+	QByteArray body() const { return m_body; }
+	void setTransferGroup(CurlTransferGroup* group);
+	// The protocol lines are recorded there if the trace is enabled when the client starts
+	void setTrace(ProtocolTrace* trace) { m_trace = trace; }
 	
 	virtual CURL* curlHandle();
 	virtual bool writeData(const char* buffer, size_t bytes);
@@ -71,20 +118,29 @@ protected:
 signals:
 	void failure(QString msg);
 	void renameTo(QString name);
-	void logMessage(QString msg);
 	void done(QString error = QString());
 	void totalSizeKnown(qlonglong bytes);
 	void rangesUnsupported();
+	// A partial response has confirmed the size of the file along with the support for ranges
+	void rangesConfirmed(qlonglong total);
 private:
 	UrlObject* m_source;
 	int m_target;
+	ResumeJournal* m_journal;
+	StreamingHash* m_hash;
+	PieceHashes* m_pieces;
+	ProtocolTrace* m_trace;
+	DiskWriter::Stream* m_stream;
+	RaceMark* m_race;
 	qlonglong m_rangeFrom, m_rangeTo, m_progress;
+	int m_nFirstByte, m_nBodyLimit;
+	QByteArray m_body;
+	QString m_strAddress, m_strSlotHost;
 	CURL* m_curl;
 	char m_errorBuffer[CURL_ERROR_SIZE];
 	char* m_postData;
 	QHash<QByteArray, QByteArray> m_headers;
-	//CurlPollingMaster* m_master;
-	bool m_bTerminating;
+	bool m_bTerminating, m_bWarmUp, m_bRefused;
 };
 
 #endif
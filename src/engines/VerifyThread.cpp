@@ -0,0 +1,70 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#include "config.h"
+#include "VerifyThread.h"
+#include "DiskWriter.h"
+#include "StreamingHash.h"
+#include "PieceHashes.h"
+
+VerifyThread::VerifyThread(QString path, qlonglong total, StreamingHash* hash, PieceHashes* pieces)
+	: m_strPath(path), m_nTotal(total), m_hash(hash), m_pieces(pieces)
+{
+	if(m_hash)
+		m_hash->ref();
+	if(m_pieces)
+		m_pieces->ref();
+}
+
+VerifyThread::~VerifyThread()
+{
+	wait();
+	if(m_hash)
+		m_hash->deref();
+	if(m_pieces)
+		m_pieces->deref();
+}
+
+void VerifyThread::run()
+{
+	DiskWriter::instance()->sync(m_strPath);
+	
+	// the corrupt pieces are downloaded again, the hash would have to start over anyway
+	if(m_pieces)
+	{
+		m_pieces->flush();
+		if(m_pieces->hasCorrupt())
+		{
+			emit verified();
+			return;
+		}
+	}
+	if(m_hash)
+		m_hash->finish(m_nTotal);
+	
+	emit verified();
+}
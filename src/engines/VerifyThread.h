@@ -0,0 +1,60 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef VERIFYTHREAD_H
+#define VERIFYTHREAD_H
+#include <QThread>
+#include <QString>
+
+class StreamingHash;
+class PieceHashes;
+
+// Finishes the checks of a completed download off the GUI thread: waits for the rest
+// of the file to be written, verifies the pieces still waiting and hashes whatever
+// the streaming hash hasn't caught up on. The hash isn't finished if a piece is corrupt.
+// The thread deletes nothing, connect finished() to deleteLater() to get rid of it.
+class VerifyThread : public QThread
+{
+Q_OBJECT
+public:
+	// The hashes are referenced until the thread is done, either may be 0
+	VerifyThread(QString path, qlonglong total, StreamingHash* hash, PieceHashes* pieces);
+	~VerifyThread();
+	
+	virtual void run();
+signals:
+	// The file is on the disk and the hashes are done, see PieceHashes::takeCorrupt()
+	// and StreamingHash::matches()
+	void verified();
+private:
+	QString m_strPath;
+	qlonglong m_nTotal;
+	StreamingHash* m_hash;
+	PieceHashes* m_pieces;
+};
+
+#endif
@@ -244,7 +244,7 @@ int main(int argc,char** argv)
 	
 	g_qmgr->exit();
 	Queue::stopQueues();
-	Queue::saveQueues();
+	Queue::saveQueues(true);
 	Queue::unloadQueues();
 	
 	runEngines(false);
@@ -640,7 +640,7 @@ void restartApplication()
 
 	g_qmgr->exit();
 	Queue::stopQueues();
-	Queue::saveQueues();
+	Queue::saveQueues(true);
 
 	if (execvp(g_argv[0], g_argv) == -1)
 		qDebug() << "execvp() failed: " << strerror(errno);
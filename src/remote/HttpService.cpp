@@ -36,6 +36,7 @@ respects for all of the code used other than "OpenSSL".
 #include "fatrat.h"
 #include "Logger.h"
 #include "TransferFactory.h"
+#include "engines/LazyTransfer.h"
 #include "dbus/DbusImpl.h"
 #include "remote/XmlRpcService.h"
 
@@ -450,7 +451,7 @@ void HttpService::SubclassService::operator()(const pion::http::request_ptr &req
 	Queue* q = 0;
 	Transfer* t = 0;
 
-	findTransfer(transfer, &q, &t);
+	findEngineTransfer(transfer, &q, &t);
 
 	if (!q || !t || !dynamic_cast<TransferHttpService*>(t))
 	{
@@ -544,6 +545,26 @@ int HttpService::findTransfer(QString transferUUID, Queue** q, Transfer** t, boo
 	return -1;
 }
 
+int HttpService::findEngineTransfer(QString transferUUID, Queue** q, Transfer** t, Transfer** inQueue)
+{
+	int pos = findTransfer(transferUUID, q, t);
+	
+	if (qobject_cast<LazyTransfer*>(*t))
+	{
+		// the main thread needs the locks to create it
+		(*q)->unlock();
+		g_queuesLock.unlock();
+		
+		TransferFactory::instance()->materialize(transferUUID);
+		pos = findTransfer(transferUUID, q, t);
+	}
+	
+	if (inQueue)
+		*inQueue = *t;
+	*t = LazyTransfer::engineObject(*t);
+	return pos;
+}
+
 void HttpService::findQueue(QString queueUUID, Queue** q)
 {
 	*q = 0;
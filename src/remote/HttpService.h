@@ -74,6 +74,10 @@ public:
 
 	static void findQueue(QString queueUUID, Queue** q);
 	static int findTransfer(QString transferUUID, Queue** q, Transfer** t, bool lockForWrite = false);
+	// Like findTransfer(), but a lazily loaded transfer is given as its engine object, which is
+	// created in the main thread if needed. The position is that of the stand-in (see LazyTransfer),
+	// which is what inQueue gets. The generic properties are to be changed on the latter.
+	static int findEngineTransfer(QString transferUUID, Queue** q, Transfer** t, Transfer** inQueue = 0);
 
 	static QVariant generateCertificate(QList<QVariant>&);
 private slots:
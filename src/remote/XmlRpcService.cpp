@@ -279,7 +279,7 @@ QVariant XmlRpcService::Transfer_getAdvancedProperties(QList<QVariant>& args)
 	Transfer* t = 0;
 	QVariantMap vmap;
 
-	HttpService::findTransfer(uuid, &q, &t);
+	HttpService::findEngineTransfer(uuid, &q, &t);
 	if (!t)
 		throw XmlRpcError(102, "Invalid transfer UUID");
 
@@ -560,10 +560,16 @@ QVariant XmlRpcService::Transfer_setProperties(QStringList luuid, QVariantMap pr
 {
 	Queue* q = 0;
 	Transfer* t = 0;
+	Transfer* engine = 0;
 
 	foreach (QString uuid, luuid)
 	{
-		HttpService::findTransfer(uuid, &q, &t);
+		// the stand-in of a lazily loaded transfer passes the generic properties
+		// on when it's replaced, the object is the engine's business
+		if (properties.contains("object"))
+			HttpService::findEngineTransfer(uuid, &q, &engine, &t);
+		else
+			HttpService::findTransfer(uuid, &q, &t);
 
 		if(!t)
 			throw XmlRpcError(102, "Invalid transfer UUID");
@@ -584,7 +590,8 @@ QVariant XmlRpcService::Transfer_setProperties(QStringList luuid, QVariantMap pr
 			else if(prop == "object")
 			{
 				checkType(it.value(), QVariant::String);
-				t->setObject(it.value().toString());
+				engine->setObject(it.value().toString());
+				engine->markDirty();
 			}
 			else if(prop == "userSpeedLimits")
 			{
@@ -940,6 +947,11 @@ int XmlRpcService::findTransfer(QString transferUUID, Queue** q, Transfer** t, b
 	return HttpService::findTransfer(transferUUID, q, t, lockForWrite);
 }
 
+int XmlRpcService::findEngineTransfer(QString transferUUID, Queue** q, Transfer** t)
+{
+	return HttpService::findEngineTransfer(transferUUID, q, t);
+}
+
 QVariant XmlRpcService::Transfer_getSpeedGraph(QList<QVariant>& args)
 {
 	Queue* q;
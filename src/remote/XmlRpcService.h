@@ -54,6 +54,8 @@ public:
 	static void deregisterFunction(QString name);
 	static void findQueue(QString queueUUID, Queue** q);
 	static int findTransfer(QString transferUUID, Queue** q, Transfer** t, bool lockForWrite = false);
+	// See HttpService::findEngineTransfer()
+	static int findEngineTransfer(QString transferUUID, Queue** q, Transfer** t);
 protected:
 	static QVariant getTransferClasses(QList<QVariant>&);
 	static QVariant getQueues(QList<QVariant>&);
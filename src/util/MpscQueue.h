@@ -0,0 +1,89 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+#include <QAtomicPointer>
+
+// Unbounded lock-free queue with any number of producers and a single consumer.
+// push() may be called from any thread, pop() only from the consuming one.
+template<typename T> class MpscQueue
+{
+public:
+	MpscQueue()
+	{
+		m_tail = new Node;
+		m_head.store(m_tail);
+	}
+	~MpscQueue()
+	{
+		while(m_tail)
+		{
+			Node* next = m_tail->next.load();
+			delete m_tail;
+			m_tail = next;
+		}
+	}
+	
+	void push(const T& value)
+	{
+		Node* node = new Node;
+		node->value = value;
+		
+		Node* prev = m_head.fetchAndStoreOrdered(node);
+		prev->next.storeRelease(node);
+	}
+	
+	// Returns false if the queue is empty (or a producer is just in the middle of a push)
+	bool pop(T& value)
+	{
+		Node* next = m_tail->next.loadAcquire();
+		if(!next)
+			return false;
+		
+		value = next->value;
+		delete m_tail;
+		m_tail = next;
+		return true;
+	}
+private:
+	struct Node
+	{
+		Node() : next(0), value() {}
+		
+		QAtomicPointer<Node> next;
+		T value;
+	};
+	
+	MpscQueue(const MpscQueue&);
+	MpscQueue& operator=(const MpscQueue&);
+	
+	QAtomicPointer<Node> m_head;
+	Node* m_tail;
+};
+
+#endif
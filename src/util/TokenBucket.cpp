@@ -0,0 +1,155 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#include "TokenBucket.h"
+#include <time.h>
+#include <cmath>
+
+// defined before the global nodes, so that it outlives them
+QReadWriteLock TokenBucket::m_treeLock;
+TokenBucket TokenBucket::m_global[2];
+
+// how much may be saved up for a burst, in msecs of the limit
+static const int BURST_MSECS = 100;
+// but always enough for a couple of curl's buffers
+static const int MIN_BURST = 32*1024;
+
+TokenBucket::TokenBucket(TokenBucket* parent)
+	: m_parent(0), m_nLimit(0), m_dTokens(0), m_nLastRefill(0)
+{
+	setParent(parent);
+}
+
+TokenBucket::~TokenBucket()
+{
+	QWriteLocker l(&m_treeLock);
+	
+	foreach(TokenBucket* child, m_children)
+	{
+		child->m_parent = m_parent;
+		if(m_parent)
+			m_parent->m_children << child;
+	}
+	m_children.clear();
+	detach();
+}
+
+void TokenBucket::detach()
+{
+	if(m_parent)
+		m_parent->m_children.removeOne(this);
+	m_parent = 0;
+}
+
+void TokenBucket::setParent(TokenBucket* parent)
+{
+	QWriteLocker l(&m_treeLock);
+	
+	if(parent == m_parent)
+		return;
+	
+	detach();
+	m_parent = parent;
+	if(m_parent)
+		m_parent->m_children << this;
+}
+
+void TokenBucket::setLimit(int limit)
+{
+	QMutexLocker l(&m_lock);
+	
+	limit = qMax(0, limit);
+	if(limit == m_nLimit.load())
+		return;
+	
+	// start with an empty bucket, so that a lower limit applies right away
+	m_dTokens = 0;
+	m_nLastRefill = now();
+	m_nLimit.storeRelease(limit);
+}
+
+int TokenBucket::limit() const
+{
+	return m_nLimit.loadAcquire();
+}
+
+qint64 TokenBucket::now()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return qint64(ts.tv_sec)*1000 + ts.tv_nsec/1000000;
+}
+
+void TokenBucket::refill(qint64 now, int limit)
+{
+	if(now <= m_nLastRefill)
+		return;
+	
+	double burst = qMax<double>(double(limit) * BURST_MSECS / 1000, MIN_BURST);
+	
+	m_dTokens = qMin(burst, m_dTokens + double(limit) * (now - m_nLastRefill) / 1000);
+	m_nLastRefill = now;
+}
+
+int TokenBucket::wait()
+{
+	QReadLocker l(&m_treeLock);
+	const qint64 t = now();
+	double msecs = 0;
+	
+	for(TokenBucket* b = this; b != 0; b = b->m_parent)
+	{
+		const int limit = b->m_nLimit.loadAcquire();
+		if(!limit)
+			continue;
+		
+		QMutexLocker lb(&b->m_lock);
+		b->refill(t, limit);
+		if(b->m_dTokens < 0)
+			msecs = qMax(msecs, -b->m_dTokens * 1000 / limit);
+	}
+	
+	return int(std::ceil(msecs));
+}
+
+void TokenBucket::consume(int bytes)
+{
+	QReadLocker l(&m_treeLock);
+	const qint64 t = now();
+	
+	for(TokenBucket* b = this; b != 0; b = b->m_parent)
+	{
+		const int limit = b->m_nLimit.loadAcquire();
+		if(!limit)
+			continue;
+		
+		QMutexLocker lb(&b->m_lock);
+		b->refill(t, limit);
+		b->m_dTokens -= bytes;
+	}
+}
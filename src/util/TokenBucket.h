@@ -0,0 +1,79 @@
+/*
+FatRat download manager
+http://fatrat.dolezel.info
+
+Copyright (C) 2006-2011 Lubos Dolezel <lubos a dolezel.info>
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+version 3 as published by the Free Software Foundation.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, see <http://www.gnu.org/licenses/>.
+
+In addition, as a special exemption, Luboš Doležel gives permission
+to link the code of FatRat with the OpenSSL project's
+"OpenSSL" library (or with modified versions of it that use the; same
+license as the "OpenSSL" library), and distribute the linked
+executables. You must obey the GNU General Public License in all
+respects for all of the code used other than "OpenSSL".
+*/
+
+
+
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+#include <QList>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QAtomicInt>
+
+// A node of the hierarchical bandwidth shaper: global -> queue -> transfer -> segment.
+// Every node limits the sum of its subtree. The tokens are drawn from the node and all of its
+// ancestors, so whatever a node leaves unused is there for its siblings right away.
+// The tokens may run into debt, the transfer then has to wait until all of its ancestors are out of it.
+// The shape of the tree is guarded by a single lock, the tokens by a lock of every node,
+// the nodes without a limit are passed without locking. The methods may be called from any thread.
+class TokenBucket
+{
+public:
+	TokenBucket(TokenBucket* parent = 0);
+	// the children are handed over to the parent
+	~TokenBucket();
+	
+	void setParent(TokenBucket* parent);
+	// bytes per second, 0 means unlimited
+	void setLimit(int limit);
+	int limit() const;
+	
+	// Msecs to wait before any more data may pass through, 0 if it may go right away
+	int wait();
+	void consume(int bytes);
+	
+	static TokenBucket* global(bool upload) { return &m_global[upload ? 1 : 0]; }
+private:
+	// m_lock must be held
+	void refill(qint64 now, int limit);
+	// m_treeLock must be held for writing
+	void detach();
+	static qint64 now();
+private:
+	TokenBucket* m_parent;
+	QList<TokenBucket*> m_children;
+	QAtomicInt m_nLimit;
+	// guards the tokens
+	QMutex m_lock;
+	double m_dTokens;
+	qint64 m_nLastRefill;
+	
+	// guards m_parent and m_children of all the nodes
+	static QReadWriteLock m_treeLock;
+	static TokenBucket m_global[2];
+};
+
+#endif